@@ -1,15 +1,182 @@
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <array>
+#include <utility>
 #include <cstdint>
 #include <thread>
 #include <chrono>
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cctype>
+#include <algorithm>
+#include <iterator>
+#include <exception>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <cerrno>
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#ifdef _WIN32
+#define NOMINMAX // Keep std::min/std::max usable
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
-class SimpleIO { // todo: make it grid based
+// The JIT backend targets x86-64 Linux hosts only
+#if defined(__x86_64__) && defined(__linux__)
+#define NIGG8_JIT 1
+#else
+#define NIGG8_JIT 0
+#endif
+
+// SSE2 and AVX2 fill kernels on x86-64 hosts, picked at runtime
+#if defined(__x86_64__) || defined(_M_X64)
+#define NIGG8_SIMD 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define NIGG8_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#include <intrin.h>
+#define NIGG8_TARGET_AVX2
+#endif
+#else
+#define NIGG8_SIMD 0
+#endif
+
+// Build with -DNIGG8_PROFILE=1 for --profile; otherwise the profiler and its
+// hooks in the interpreter are not compiled at all
+#ifndef NIGG8_PROFILE
+#define NIGG8_PROFILE 0
+#endif
+
+#ifndef _WIN32
+typedef uint32_t COLORREF; // 0x00BBGGRR, as on Windows
+#define RGB(r, g, b) ((COLORREF)(((uint8_t)(r)) | ((uint32_t)(uint8_t)(g) << 8) | ((uint32_t)(uint8_t)(b) << 16)))
+struct POINT { long x, y; };
+#endif
+
+// Puts back a stream's flags, precision and fill when it goes out of scope,
+// so a report can use std::fixed or std::hex on a stream it does not own
+class StreamFormat {
+public:
+    explicit StreamFormat(std::ios& stream)
+        : stream(stream), flags(stream.flags()), precision(stream.precision()), fill(stream.fill()) {}
+    ~StreamFormat() {
+        stream.flags(flags);
+        stream.precision(precision);
+        stream.fill(fill);
+    }
+
+    StreamFormat(const StreamFormat&) = delete;
+    StreamFormat& operator=(const StreamFormat&) = delete;
+
+private:
+    std::ios& stream;
+    std::ios::fmtflags flags;
+    std::streamsize precision;
+    char fill;
+};
+
+// Text, drawing and input for the guest. Drawing goes to a back buffer that
+// backends show on present(), so a burst of draw calls costs one blit.
+class SimpleIO {
+public:
+    virtual ~SimpleIO() {}
+
+    virtual void print(const std::string& text) = 0;
+    virtual std::string input() = 0;
+    virtual void draw_rect(int x, int y, int w, int h, COLORREF color) = 0;
+    virtual void draw_circle(int x, int y, int r, COLORREF color) = 0;
+    virtual void color_text(const std::string& text, COLORREF color, int x, int y) = 0;
+    virtual void draw_line(int x1, int y1, int x2, int y2, COLORREF color) = 0;
+    virtual void clear_screen(COLORREF color = RGB(255, 255, 255)) = 0;
+
+    virtual bool mouse_clicked() { return false; }
+    virtual POINT get_mouse_pos() { return {0, 0}; }
+    virtual void message_loop() {}
+
+    // Show everything drawn since the last presentation
+    virtual void present() {}
+    // present(), unless the last one was less than a frame ago
+    virtual void present_if_due() {}
+};
+
+// Screen areas drawn since the last presentation. Overlapping rectangles are
+// merged, and past MAX_RECTS everything collapses into one bounding box.
+struct DirtyRegion {
+    struct Rect {
+        int left, top, right, bottom; // right/bottom exclusive
+    };
+
+    static const size_t MAX_RECTS = 8;
+    std::vector<Rect> rects;
+
+    // Add a rectangle, clipped to a width x height screen
+    void add(int left, int top, int right, int bottom, int width, int height) {
+        Rect r = { std::max(left, 0), std::max(top, 0), std::min(right, width), std::min(bottom, height) };
+        if (r.left >= r.right || r.top >= r.bottom) return;
+        for (size_t i = 0; i < rects.size();) {
+            const Rect& o = rects[i];
+            if (r.left <= o.right && o.left <= r.right && r.top <= o.bottom && o.top <= r.bottom) {
+                r = bounds(r, o);
+                rects[i] = rects.back();
+                rects.pop_back();
+                i = 0; // The grown rectangle may now touch earlier ones
+            } else {
+                ++i;
+            }
+        }
+        rects.push_back(r);
+        if (rects.size() > MAX_RECTS) {
+            for (size_t i = 1; i < rects.size(); ++i) rects[0] = bounds(rects[0], rects[i]);
+            rects.resize(1);
+        }
+    }
+
+    bool empty() const { return rects.empty(); }
+    void clear() { rects.clear(); }
+
+    static Rect bounds(const Rect& a, const Rect& b) {
+        return { std::min(a.left, b.left), std::min(a.top, b.top), std::max(a.right, b.right), std::max(a.bottom, b.bottom) };
+    }
+};
+
+// Limits presentation to a fixed number of frames per second of host time
+struct FrameClock {
+    std::chrono::steady_clock::duration interval;
+    std::chrono::steady_clock::time_point next;
+
+    explicit FrameClock(double fps)
+        : interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps))),
+          next() {}
+
+    bool due() {
+        auto now = std::chrono::steady_clock::now();
+        if (now < next) return false;
+        next = now + interval;
+        return true;
+    }
+};
+
+#ifdef _WIN32
+class WindowsIO : public SimpleIO { // todo: make it grid based
     HWND hwnd = nullptr;
     HINSTANCE hInstance = nullptr;
     bool graphicsMode;
@@ -21,8 +188,10 @@ class SimpleIO { // todo: make it grid based
     WINDOWPLACEMENT prevPlacement = {};
     HDC backBufferDC = nullptr;
     HBITMAP backBufferBitmap = nullptr;
+    DirtyRegion dirty; // Back buffer areas not yet copied to the window
+    FrameClock frameClock;
 
-    static SimpleIO* instance;
+    static WindowsIO* instance;
 
     static LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
         if (uMsg == WM_DESTROY) PostQuitMessage(0);
@@ -76,6 +245,7 @@ class SimpleIO { // todo: make it grid based
         HDC hdc = GetDC(hwnd);
         BitBlt(hdc, 0, 0, width, height, backBufferDC, 0, 0, SRCCOPY);
         ReleaseDC(hwnd, hdc);
+        dirty.clear();
     }
 
     void resize(int w, int h) {
@@ -105,7 +275,7 @@ class SimpleIO { // todo: make it grid based
     }
 
 public:
-    SimpleIO(bool useGraphics) : graphicsMode(useGraphics) {
+    WindowsIO(bool useGraphics, double fps = 60.0) : graphicsMode(useGraphics), frameClock(fps) {
         instance = this;
         if (graphicsMode) {
             hInstance = GetModuleHandle(nullptr);
@@ -127,7 +297,7 @@ public:
         }
     }
 
-    ~SimpleIO() {
+    ~WindowsIO() {
         if (graphicsMode) {
             if (backBufferDC) DeleteDC(backBufferDC);
             if (backBufferBitmap) DeleteObject(backBufferBitmap);
@@ -135,24 +305,26 @@ public:
         }
     }
 
-    void print(const std::string& text) {
+    void print(const std::string& text) override {
         if (graphicsMode) {
             TextOutA(backBufferDC, 10, 10, text.c_str(), (int)text.size());
-            paint();
+            SIZE extent = {};
+            GetTextExtentPoint32A(backBufferDC, text.c_str(), (int)text.size(), &extent);
+            dirty.add(10, 10, 10 + extent.cx, 10 + extent.cy, width, height);
+            present_if_due();
         } else {
             std::cout << text;
         }
     }
 
-    std::string input() {
+    std::string input() override {
         if (graphicsMode) {
+            // Sleep in GetMessage until a key arrives rather than polling
             latestInput.clear();
-            while (latestInput.empty()) {
-                MSG msg;
-                if (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
-                    TranslateMessage(&msg);
-                    DispatchMessage(&msg);
-                }
+            MSG msg;
+            while (latestInput.empty() && GetMessage(&msg, nullptr, 0, 0) > 0) {
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
             }
             std::string res = latestInput;
             latestInput.clear();
@@ -164,49 +336,55 @@ public:
         }
     }
 
-    void draw_rect(int x, int y, int w, int h, COLORREF color) {
+    void draw_rect(int x, int y, int w, int h, COLORREF color) override {
         if (graphicsMode) {
             HBRUSH brush = CreateSolidBrush(color);
             RECT rect = { x, y, x + w, y + h };
             FillRect(backBufferDC, &rect, brush);
             DeleteObject(brush);
-            paint();
+            dirty.add(x, y, x + w, y + h, width, height);
+            present_if_due();
         }
     }
 
-    void draw_circle(int x, int y, int r, COLORREF color) {
+    void draw_circle(int x, int y, int r, COLORREF color) override {
         if (graphicsMode) {
             HBRUSH brush = CreateSolidBrush(color);
             HBRUSH oldBrush = (HBRUSH)SelectObject(backBufferDC, brush);
             Ellipse(backBufferDC, x - r, y - r, x + r, y + r);
             SelectObject(backBufferDC, oldBrush);
             DeleteObject(brush);
-            paint();
+            dirty.add(x - r, y - r, x + r, y + r, width, height);
+            present_if_due();
         }
     }
 
-    void color_text(const std::string& text, COLORREF color, int x, int y) {
+    void color_text(const std::string& text, COLORREF color, int x, int y) override {
         if (graphicsMode) {
             SetTextColor(backBufferDC, color);
             SetBkMode(backBufferDC, TRANSPARENT);
             TextOutA(backBufferDC, x, y, text.c_str(), (int)text.size());
-            paint();
+            SIZE extent = {};
+            GetTextExtentPoint32A(backBufferDC, text.c_str(), (int)text.size(), &extent);
+            dirty.add(x, y, x + extent.cx, y + extent.cy, width, height);
+            present_if_due();
         }
     }
 
-    void clear_screen(COLORREF color = RGB(255, 255, 255)) {
+    void clear_screen(COLORREF color = RGB(255, 255, 255)) override {
         if (graphicsMode) {
             HBRUSH brush = CreateSolidBrush(color);
             RECT rect = { 0, 0, width, height };
             FillRect(backBufferDC, &rect, brush);
             DeleteObject(brush);
-            paint();
+            dirty.add(0, 0, width, height, width, height);
+            present_if_due();
         } else {
             system("cls");
         }
     }
 
-    void draw_line(int x1, int y1, int x2, int y2, COLORREF color) {
+    void draw_line(int x1, int y1, int x2, int y2, COLORREF color) override {
         if (graphicsMode) {
             HPEN pen = CreatePen(PS_SOLID, 1, color);
             HPEN oldPen = (HPEN)SelectObject(backBufferDC, pen);
@@ -216,11 +394,12 @@ public:
 
             SelectObject(backBufferDC, oldPen);
             DeleteObject(pen);
-            paint();
+            dirty.add(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1, std::max(y1, y2) + 1, width, height);
+            present_if_due();
         }
     }
 
-    bool mouse_clicked() {
+    bool mouse_clicked() override {
         if (graphicsMode) {
             bool clicked = mouseClicked;
             mouseClicked = false;
@@ -229,11 +408,11 @@ public:
         return false;
     }
 
-    POINT get_mouse_pos() {
+    POINT get_mouse_pos() override {
         return mousePos;
     }
 
-    void message_loop() {
+    void message_loop() override {
         if (graphicsMode) {
             MSG msg;
             while (GetMessage(&msg, nullptr, 0, 0)) {
@@ -242,427 +421,7355 @@ public:
             }
         }
     }
-};
 
-SimpleIO* SimpleIO::instance = nullptr;
-SimpleIO io(false);
+    // Blit only what changed since the last presentation
+    void present() override {
+        if (!graphicsMode || dirty.empty()) return;
+        HDC hdc = GetDC(hwnd);
+        for (const DirtyRegion::Rect& r : dirty.rects) {
+            BitBlt(hdc, r.left, r.top, r.right - r.left, r.bottom - r.top, backBufferDC, r.left, r.top, SRCCOPY);
+        }
+        ReleaseDC(hwnd, hdc);
+        dirty.clear();
+    }
 
-std::vector<uint8_t> get_program(const std::string& filepath) {
-    std::vector<uint8_t> program;
-    std::ifstream file(filepath, std::ios::binary); // Open file in binary mode
+    void present_if_due() override {
+        if (!dirty.empty() && frameClock.due()) present();
+    }
+};
 
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file: " + filepath);
-    };
+WindowsIO* WindowsIO::instance = nullptr;
+#endif
 
-    uint8_t byte;
-    while (file.read(reinterpret_cast<char*>(&byte), sizeof(byte))) {
-        program.push_back(byte); // Read one byte at a time and push to vector
-    };
+// Console only: text goes to stdout, drawing is ignored
+class ConsoleIO : public SimpleIO {
+public:
+    void print(const std::string& text) override {
+        std::cout << text;
+    }
+
+    std::string input() override {
+        std::string s;
+        std::getline(std::cin, s);
+        return s;
+    }
 
-    file.close();
+    void draw_rect(int, int, int, int, COLORREF) override {}
+    void draw_circle(int, int, int, COLORREF) override {}
+    void color_text(const std::string&, COLORREF, int, int) override {}
+    void draw_line(int, int, int, int, COLORREF) override {}
 
-    return program;
+    void clear_screen(COLORREF = RGB(255, 255, 255)) override {
+        std::cout << "\033[2J\033[H";
+    }
 };
 
-class VirtualMachine {
-private:
-    static const size_t MEMORY_SIZE = 256;
-    static const size_t NUM_REGISTERS = 256; // Covers all register IDs (0x01–0x24)
-    static const double CLOCK_PERIOD_MS; // 1000 ms / 16 Hz = 62.5 ms
+// Drawing into a 32-bit pixel surface. Rectangles, circles and clears are
+// split into horizontal spans and filled by the fastest span kernel the CPU
+// supports (AVX2, SSE2 or scalar, chosen once); lines are Bresenham.
+// Shapes are clipped to the surface and match GDI's coverage rules.
+struct Raster {
+    using SpanKernel = void (*)(uint32_t* pixels, size_t count, uint32_t value);
 
-    std::vector<uint8_t> memory; // 256 bytes of RAM
-    std::vector<uint8_t> registers; // Register file (r1–r4, e1–e4, x1–x4/l1–l4)
-    uint8_t pc; // Program counter (8-bit address)
-    uint8_t sp; // Stack pointer
-    bool running; // VM state
-    bool flag_equal, flag_less, flag_more; // Comparison flags
+    struct Kernel {
+        const char* name;
+        SpanKernel fill;
+    };
 
-public:
-    VirtualMachine() : memory(MEMORY_SIZE, 0), registers(NUM_REGISTERS, 0),
-                       pc(0), sp(0xff), running(false),
-                       flag_equal(false), flag_less(false), flag_more(false) {}
+    // Spans at least this long use non-temporal stores, so a full clear of a
+    // large surface does not evict everything else from the cache
+    static const size_t STREAM_PIXELS = 1 << 16;
 
-    // Load program into memory
-    void load_program(const std::vector<uint8_t>& program) {
-        if (program.size() > MEMORY_SIZE) {
-            throw std::runtime_error("Program too large for memory");
+    uint32_t* pixels;
+    int width, height;
+    SpanKernel fill;
+
+    Raster(uint32_t* pixels, int width, int height, SpanKernel fill = best().fill)
+        : pixels(pixels), width(width), height(height), fill(fill) {}
+
+    // Fill [left, right) x [top, bottom)
+    void rect(int left, int top, int right, int bottom, uint32_t p) const {
+        left = std::max(left, 0);
+        top = std::max(top, 0);
+        right = std::min(right, width);
+        bottom = std::min(bottom, height);
+        if (left >= right || top >= bottom) return;
+        if (left == 0 && right == width) { // Whole rows are one contiguous span
+            fill(pixels + static_cast<size_t>(top) * width, static_cast<size_t>(bottom - top) * width, p);
+            return;
         }
-        for (size_t i = 0; i < program.size(); ++i) {
-            memory[i] = program[i];
+        for (int y = top; y < bottom; ++y) {
+            fill(pixels + static_cast<size_t>(y) * width + left, right - left, p);
         }
-        
-        // Debug: Print out loaded program
-        for (size_t i = 0; i < program.size(); ++i) {
-            std::cout << std::hex << std::setw(2) << std::setfill('0') << (int)program[i] << " ";
-        }        
-        std::cout << std::endl;
-        std::cout << std::endl;
-        std::cout << std::endl;
     }
 
-    // Run the VM at 16 Hz
-    void run() {
-        running = true;
-        while (running) {
-            auto start = std::chrono::steady_clock::now();
-            execute_instruction();
-            auto end = std::chrono::steady_clock::now();
-            auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-            auto sleep_ms = static_cast<long>(CLOCK_PERIOD_MS - elapsed_ms);
-            if (sleep_ms > 0) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
-            }
-        }
+    void clear(uint32_t p) const {
+        rect(0, 0, width, height, p);
     }
 
-private:
-    // Fetch value based on addressing mode
-    uint8_t fetch_operand(uint8_t mode, uint8_t operand1, uint8_t operand2) {
-        switch (mode) {
-            case 0x00: case 0x10: case 0x20: case 0x30: return operand1; // Immediate
-            case 0x01: case 0x11: case 0x21: case 0x31: return registers[operand1]; // Register
-            case 0x02: case 0x12: case 0x22: case 0x32: return memory[operand1]; // Memory
-            case 0x03: case 0x13: case 0x23: case 0x33: return memory[registers[operand1]]; // Register indirect
-            default: throw std::runtime_error("Invalid operand mode");
+    // Filled disk covering the pixel centers inside the circle, within the
+    // same [x - r, x + r) box GDI's Ellipse() uses. Row py holds the pixels
+    // whose doubled offset 2 * (px - x) + 1 squared fits in what the row's
+    // offset leaves of (2r)^2, which is a run of k + 1 pixels either side of x.
+    void circle(int x, int y, int r, uint32_t p) const {
+        if (r <= 0) return;
+        const int64_t r2 = 4 * static_cast<int64_t>(r) * r;
+        const int top = std::max(y - r, 0), bottom = std::min(y + r, height);
+        for (int py = top; py < bottom; ++py) {
+            int64_t dy = 2 * static_cast<int64_t>(py - y) + 1;
+            int64_t rest = r2 - dy * dy;
+            if (rest < 1) continue;
+            int k = static_cast<int>((isqrt(rest) - 1) / 2);
+            rect(x - k - 1, py, x + k + 1, py + 1, p);
         }
     }
 
-    // Store value based on addressing mode
-    void store_operand(uint8_t mode, uint8_t dest, uint8_t value) {
-        switch (mode) {
-            case 0x00: case 0x01: case 0x02: case 0x03: dest = value; break;
-            case 0x10: case 0x11: case 0x12: case 0x13: registers[dest] = value; break; // Register
-            case 0x20: case 0x21: case 0x22: case 0x23: memory[dest] = value; break; // Memory
-            case 0x30: case 0x31: case 0x32: case 0x33: memory[registers[dest]] = value; break; // Register indirect
-            default: throw std::runtime_error("Invalid destination mode");
+    // Bresenham, leaving out the end point like GDI's LineTo()
+    void line(int x1, int y1, int x2, int y2, uint32_t p) const {
+        if (y1 == y2) {
+            if (x1 < x2) rect(x1, y1, x2, y1 + 1, p);
+            else rect(x2 + 1, y1, x1 + 1, y1 + 1, p);
+            return;
+        }
+        int dx = std::abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
+        int dy = -std::abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
+        int err = dx + dy;
+        int x = x1, y = y1;
+        // Every point lies in the endpoints' bounding box, so when both are on
+        // the surface no point needs clipping
+        const bool inside = inside_surface(x1, y1) && inside_surface(x2, y2);
+        uint32_t* const out = pixels; // Locals, as stores through out could alias the members
+        const int w = width, h = height;
+        while (x != x2 || y != y2) {
+            if (inside || (x >= 0 && y >= 0 && x < w && y < h)) out[static_cast<size_t>(y) * w + x] = p;
+            int e2 = 2 * err;
+            if (e2 >= dy) { err += dy; x += sx; }
+            if (e2 <= dx) { err += dx; y += sy; }
         }
     }
 
-    // Execute a single instruction
-    void execute_instruction() {
-        if (pc >= MEMORY_SIZE) {
-            running = false;
-            return;
-        }
+    // The kernels this CPU can run, slowest first
+    static const std::vector<Kernel>& kernels() {
+        static const std::vector<Kernel> list = [] {
+            std::vector<Kernel> k = { { "scalar", fill_scalar } };
+#if NIGG8_SIMD
+            k.push_back({ "sse2", fill_sse2 }); // Part of x86-64
+            if (has_avx2()) k.push_back({ "avx2", fill_avx2 });
+#endif
+            return k;
+        }();
+        return list;
+    }
 
-        uint8_t opcode = memory[pc++];
+    static const Kernel& best() {
+        return kernels().back();
+    }
 
-        switch (opcode) {
-            case 0x00: // nop
-                break;
+private:
+    bool inside_surface(int x, int y) const {
+        return x >= 0 && y >= 0 && x < width && y < height;
+    }
 
-            case 0x01: { // out todo: make this myltiple opps
-                uint8_t mode = memory[pc++];
-                uint8_t data = memory[pc++];
-                uint8_t port = memory[pc++];
-                uint8_t value = fetch_operand(mode, data, port);
-                std::cout << static_cast<char>(value); // TODO: use SimpleIO
-                const uint8_t PORT_PRINT        = 0x00;
-                const uint8_t PORT_DRAW_RECT    = 0x01;
-                const uint8_t PORT_DRAW_CIRCLE  = 0x02;
-                const uint8_t PORT_DRAW_LINE    = 0x03;
-                
-                switch (port) {
-                    case PORT_PRINT:
-                    {
-                        std::string s(1, (char)data);
-                        io.print(s);
-                        break;
-                    }
-                    case PORT_DRAW_RECT:
-                    {
-                        io.draw_rect(50, 50, data, data, RGB(0, 0, 255));
-                        break;
-                    }
-                    case PORT_DRAW_CIRCLE:
-                    {
-                        io.draw_circle(100, 100, data, RGB(255, 0, 0));
-                        break;
-                    }
-                    case PORT_DRAW_LINE:
-                    {
-                        io.draw_line(10, 10, 10 + data, 10 + data, RGB(0, 255, 0));
-                        break;
-                    }
-                }
-                
+    static int64_t isqrt(int64_t v) {
+        int64_t s = static_cast<int64_t>(std::sqrt(static_cast<double>(v)));
+        while (s * s > v) --s;
+        while ((s + 1) * (s + 1) <= v) ++s;
+        return s;
+    }
 
-                break;
-            }
+    static void fill_scalar(uint32_t* pixels, size_t count, uint32_t value) {
+        for (size_t i = 0; i < count; ++i) pixels[i] = value;
+    }
 
-            case 0x02: { // in
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t port = memory[pc++];
-                uint8_t value;
-                std::cin >> value; // TODO: use SimpleIO
-                store_operand(mode, dest, value);
-                break;
-            }
+#if NIGG8_SIMD
+    static bool has_avx2() {
+#if defined(__GNUC__)
+        return __builtin_cpu_supports("avx2");
+#else
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return false;
+        __cpuid(info, 1);
+        const bool os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        if (!os_saves_ymm) return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#endif
+    }
 
-            case 0x03: { // lea
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t addr = memory[pc++];
-                store_operand(mode, dest, addr);
-                break;
+    // Scalar stores up to 16-byte alignment, then aligned vector stores
+    static void fill_sse2(uint32_t* pixels, size_t count, uint32_t value) {
+        for (; count && (reinterpret_cast<uintptr_t>(pixels) & 15); --count) *pixels++ = value;
+        const __m128i v = _mm_set1_epi32(static_cast<int>(value));
+        if (count >= STREAM_PIXELS) {
+            for (; count >= 4; count -= 4, pixels += 4) _mm_stream_si128(reinterpret_cast<__m128i*>(pixels), v);
+            _mm_sfence();
+        } else {
+            for (; count >= 8; count -= 8, pixels += 8) {
+                _mm_store_si128(reinterpret_cast<__m128i*>(pixels), v);
+                _mm_store_si128(reinterpret_cast<__m128i*>(pixels + 4), v);
             }
-
-            case 0x04: { // mov
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t value = fetch_operand(mode, src, 0);
-                store_operand(mode, dest, value);
-                break;
+            if (count >= 4) {
+                _mm_store_si128(reinterpret_cast<__m128i*>(pixels), v);
+                count -= 4;
+                pixels += 4;
             }
+        }
+        for (; count; --count) *pixels++ = value;
+    }
 
-            case 0x05: { // ret
-                if (sp >= 0xff) {
-                    throw std::runtime_error("Stack underflow");
-                }
-                pc = memory[++sp];
-                break;
+    // As fill_sse2, with 32-byte stores; the tail is one masked store
+    NIGG8_TARGET_AVX2 static void fill_avx2(uint32_t* pixels, size_t count, uint32_t value) {
+        for (; count && (reinterpret_cast<uintptr_t>(pixels) & 31); --count) *pixels++ = value;
+        const __m256i v = _mm256_set1_epi32(static_cast<int>(value));
+        if (count >= STREAM_PIXELS) {
+            for (; count >= 8; count -= 8, pixels += 8) _mm256_stream_si256(reinterpret_cast<__m256i*>(pixels), v);
+            _mm_sfence();
+        } else {
+            for (; count >= 16; count -= 16, pixels += 16) {
+                _mm256_store_si256(reinterpret_cast<__m256i*>(pixels), v);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(pixels + 8), v);
             }
-
-            case 0x06: { // cal
-                uint8_t addr = memory[pc++];
-                if (--sp < 0) {
-                    throw std::runtime_error("Stack overflow");
-                }
-                memory[sp] = pc;
-                pc = addr;
-                break;
+            if (count >= 8) {
+                _mm256_store_si256(reinterpret_cast<__m256i*>(pixels), v);
+                count -= 8;
+                pixels += 8;
             }
+        }
+        if (count) {
+            const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(count)), lanes);
+            _mm256_maskstore_epi32(reinterpret_cast<int*>(pixels), mask, v);
+        }
+    }
+#endif
+};
 
-            case 0x07: // jmp
-                pc = memory[pc];
-                break;
+// Headless RGBA framebuffer, for running graphical programs in CI at full
+// speed. Drawing goes to a back buffer; present() copies the dirty rectangles
+// to the front buffer and, if asked to, writes the frame out as a PPM file.
+// Drawing never presents by itself. Text is not rasterized: print() goes to
+// the text stream instead.
+class FramebufferIO : public SimpleIO {
+    int width, height;
+    std::vector<uint32_t> back, front; // COLORREF | 0xff000000: R, G, B, A bytes in memory
+    DirtyRegion dirty;
+    FrameClock frameClock;
+    uint64_t frames = 0; // Presentations so far
+    std::string framePrefix; // Write every frame to <prefix><frame>.ppm when set
+    std::ostream& text;
 
-            case 0x08: // jl
-                if (flag_less) pc = memory[pc];
-                else pc++;
-                break;
+    static uint32_t pixel(COLORREF color) {
+        return color | 0xff000000u;
+    }
 
-            case 0x09: // jnl
-                if (!flag_less) pc = memory[pc];
-                else pc++;
-                break;
+    Raster raster() {
+        return Raster(back.data(), width, height);
+    }
 
-            case 0x0a: // jnm
-                if (!flag_more) pc = memory[pc];
-                else pc++;
-                break;
+public:
+    FramebufferIO(int width = 800, int height = 600, double fps = 60.0, std::ostream& text = std::cout)
+        : width(width), height(height),
+          back(static_cast<size_t>(width) * height, pixel(RGB(255, 255, 255))), front(back),
+          frameClock(fps), text(text) {}
 
-            case 0x0b: // jm
-                if (flag_more) pc = memory[pc];
-                else pc++;
-                break;
+    void print(const std::string& s) override {
+        text << s;
+    }
 
-            case 0x0c: // jne
-                if (!flag_equal) pc = memory[pc];
-                else pc++;
-                break;
+    std::string input() override {
+        std::string s;
+        std::getline(std::cin, s);
+        return s;
+    }
 
-            case 0x0d: // je
-                if (flag_equal) pc = memory[pc];
-                else pc++;
-                break;
+    void draw_rect(int x, int y, int w, int h, COLORREF color) override {
+        raster().rect(x, y, x + w, y + h, pixel(color));
+        dirty.add(x, y, x + w, y + h, width, height);
+    }
 
-            case 0x0e: { // cmp
-                uint8_t mode = memory[pc++];
-                uint8_t op1 = memory[pc++];
-                uint8_t op2 = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, op1, 0);
-                uint8_t val2 = fetch_operand(mode >> 4, op2, 0);
-                flag_equal = (val1 == val2);
-                flag_less = (val1 < val2);
-                flag_more = (val1 > val2);
-                break;
-            }
+    void draw_circle(int x, int y, int r, COLORREF color) override {
+        raster().circle(x, y, r, pixel(color));
+        dirty.add(x - r, y - r, x + r, y + r, width, height);
+    }
 
-            case 0x0f: { // (unassigned)(uninmplemented) int
-                break;
-            }
+    void color_text(const std::string& s, COLORREF, int, int) override {
+        text << s;
+    }
 
-            case 0x10: { // add
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = val1 + val2;
-                store_operand(mode, dest, result);
-                break;
-            }
-                
-            case 0x11: { // sub
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = val1 - val2;
-                store_operand(mode, dest, result);
-                break;
-            }
-                
-            case 0x12: { // mul
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = val1 * val2;
-                store_operand(mode, dest, result);
-                break;
-            }
-            
-            case 0x13: { // div
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result;
-            
-                // Handle division by zero by returning 0
-                if (val2 == 0) {
-                    result = 0;
-                } else {
-                    result = val1 / val2;
-                }
-                
-                store_operand(mode, dest, result);
-                break;
-            }
+    void draw_line(int x1, int y1, int x2, int y2, COLORREF color) override {
+        raster().line(x1, y1, x2, y2, pixel(color));
+        dirty.add(std::min(x1, x2), std::min(y1, y2), std::max(x1, x2) + 1, std::max(y1, y2) + 1, width, height);
+    }
 
-            case 0x20: { // and
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = val1 & val2;
-                store_operand(mode, dest, result);
-                break;
-            }
+    void clear_screen(COLORREF color = RGB(255, 255, 255)) override {
+        raster().clear(pixel(color));
+        dirty.add(0, 0, width, height, width, height);
+    }
 
-            case 0x21: { // or
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = val1 | val2;
-                store_operand(mode, dest, result);
-                break;
-            }
-            
-            case 0x22: { // xor
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = val1 ^ val2;
-                store_operand(mode, dest, result);
-                break;
+    void present() override {
+        if (dirty.empty()) return;
+        for (const DirtyRegion::Rect& r : dirty.rects) {
+            for (int y = r.top; y < r.bottom; ++y) {
+                size_t row = static_cast<size_t>(y) * width;
+                std::copy(back.begin() + row + r.left, back.begin() + row + r.right, front.begin() + row + r.left);
             }
+        }
+        dirty.clear();
+        ++frames;
+        if (!framePrefix.empty()) {
+            std::ostringstream path;
+            path << framePrefix << std::setw(6) << std::setfill('0') << frames << ".ppm";
+            write_ppm(path.str());
+        }
+    }
 
-            case 0x24: { // nor
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = ~(val1 | val2);
-                store_operand(mode, dest, result);
-                break;
-            }
-            
-            case 0x25: { // nand
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t val1 = fetch_operand(mode, dest, 0);
-                uint8_t val2 = fetch_operand(mode, src, 0);
-                uint8_t result = ~(val1 & val2);
-                store_operand(mode, dest, result);
-                break;
-            }
+    void present_if_due() override {
+        if (!dirty.empty() && frameClock.due()) present();
+    }
 
-            case 0x23: { // not
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                uint8_t value = fetch_operand(mode, dest, 0);
-                store_operand(mode, dest, ~value);
-                break;
+    void dump_frames(const std::string& prefix) {
+        framePrefix = prefix;
+    }
+
+    // Write the last presented frame as a binary PPM
+    void write_ppm(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+        file << "P6\n" << width << " " << height << "\n255\n";
+        std::vector<char> row(static_cast<size_t>(width) * 3);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                uint32_t p = front[static_cast<size_t>(y) * width + x];
+                row[3 * x] = static_cast<char>(p & 0xff);
+                row[3 * x + 1] = static_cast<char>((p >> 8) & 0xff);
+                row[3 * x + 2] = static_cast<char>((p >> 16) & 0xff);
             }
+            file.write(row.data(), row.size());
+        }
+    }
 
-            case 0x26: { // push
-                uint8_t mode = memory[pc++];
-                uint8_t src = memory[pc++];
-                uint8_t value = fetch_operand(mode, src, 0);
-                if (--sp < 0) {
-                    throw std::runtime_error("Stack overflow");
-                }
-                memory[sp] = value;
-                break;
+    const std::vector<uint32_t>& pixels() const { return front; }
+    uint64_t frame_count() const { return frames; }
+};
+
+// Draw calls recorded for later replay onto another SimpleIO
+struct DisplayList {
+    enum class Kind : uint8_t { Rect, Circle, Line, Clear, Text, Print };
+
+    struct Command {
+        Kind kind;
+        COLORREF color;
+        int a, b, c, d; // Coordinates and sizes, as passed to the draw call
+        uint32_t text; // Index into strings for Text and Print
+    };
+
+    std::vector<Command> commands;
+    std::vector<std::string> strings;
+
+    bool empty() const { return commands.empty(); }
+
+    void clear() {
+        commands.clear();
+        strings.clear();
+    }
+
+    void add(Kind kind, COLORREF color, int a = 0, int b = 0, int c = 0, int d = 0) {
+        commands.push_back({ kind, color, a, b, c, d, 0 });
+    }
+
+    void add_text(Kind kind, const std::string& text, COLORREF color = 0, int x = 0, int y = 0) {
+        commands.push_back({ kind, color, x, y, 0, 0, static_cast<uint32_t>(strings.size()) });
+        strings.push_back(text);
+    }
+
+    // A full clear hides everything drawn before it; only printed text,
+    // which goes to a stream rather than the screen, still has to be replayed
+    void drop_hidden() {
+        std::vector<Command> kept;
+        std::vector<std::string> kept_strings;
+        for (const Command& c : commands) {
+            if (c.kind != Kind::Print) continue;
+            kept.push_back(c);
+            kept.back().text = static_cast<uint32_t>(kept_strings.size());
+            kept_strings.push_back(std::move(strings[c.text]));
+        }
+        commands.swap(kept);
+        strings.swap(kept_strings);
+    }
+
+    // Append other, leaving it empty
+    void splice(DisplayList& other) {
+        if (commands.empty()) {
+            commands.swap(other.commands);
+            strings.swap(other.strings);
+            return;
+        }
+        if (!other.empty() && other.commands.front().kind == Kind::Clear) drop_hidden();
+        const uint32_t base = static_cast<uint32_t>(strings.size());
+        for (Command c : other.commands) {
+            if (c.kind == Kind::Text || c.kind == Kind::Print) c.text += base;
+            commands.push_back(c);
+        }
+        std::move(other.strings.begin(), other.strings.end(), std::back_inserter(strings));
+        other.clear();
+    }
+
+    void replay(SimpleIO& target) const {
+        for (const Command& c : commands) {
+            switch (c.kind) {
+                case Kind::Rect: target.draw_rect(c.a, c.b, c.c, c.d, c.color); break;
+                case Kind::Circle: target.draw_circle(c.a, c.b, c.c, c.color); break;
+                case Kind::Line: target.draw_line(c.a, c.b, c.c, c.d, c.color); break;
+                case Kind::Clear: target.clear_screen(c.color); break;
+                case Kind::Text: target.color_text(strings[c.text], c.color, c.a, c.b); break;
+                case Kind::Print: target.print(strings[c.text]); break;
             }
+        }
+    }
+};
 
-            case 0x27: { // pop
-                uint8_t mode = memory[pc++];
-                uint8_t dest = memory[pc++];
-                if (sp >= 0xff) {
-                    throw std::runtime_error("Stack underflow");
+// Draws onto target from a thread of its own. The caller's draw calls only
+// append to a display list, which present_if_due() and present() hand over;
+// the render thread takes whatever has been handed over once per frame,
+// replays it into target's back buffer and presents, so any number of draw
+// calls per frame costs one present and the caller never waits on drawing.
+// target must not be used directly until stop().
+class RenderThread : public SimpleIO {
+    static const size_t MAX_PENDING = 1 << 20; // Commands handed over but not drawn before the caller waits
+
+    SimpleIO& target;
+    std::chrono::steady_clock::duration interval;
+    DisplayList recording; // Caller side, unlocked
+    DisplayList pending; // Handed over, guarded by lock
+    DisplayList drawing; // Render thread side, unlocked
+    bool flush_requested = false; // Draw pending now rather than at the next frame
+    bool stopping = false;
+    std::mutex lock;
+    std::condition_variable wake; // Render thread: work or stop
+    std::condition_variable drained; // Caller: pending has room again
+
+    // Written by the render thread, read once it has stopped
+    uint64_t frames = 0;
+    double frame_seconds = 0.0, max_frame_seconds = 0.0; // Replay and present time
+    uint64_t queued = 0, max_queued = 0; // Commands drawn per frame
+    std::exception_ptr error; // First failure drawing, rethrown by stop()
+
+    std::thread worker; // Last, so everything it uses is initialized first
+
+    void hand_over(bool flush) {
+        std::unique_lock<std::mutex> guard(lock);
+        if (pending.commands.size() > MAX_PENDING) {
+            drained.wait(guard, [&] { return pending.commands.size() <= MAX_PENDING; });
+        }
+        pending.splice(recording);
+        if (flush) {
+            flush_requested = true;
+            wake.notify_one();
+        }
+    }
+
+    void render() {
+        auto next = std::chrono::steady_clock::now() + interval;
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait_until(guard, next, [&] { return flush_requested || stopping; });
+            const bool last = stopping;
+            flush_requested = false;
+            std::swap(pending, drawing);
+            guard.unlock();
+            drained.notify_one();
+
+            if (!drawing.empty() && !error) {
+                auto start = std::chrono::steady_clock::now();
+                try {
+                    drawing.replay(target);
+                    target.present();
+                } catch (...) {
+                    error = std::current_exception();
                 }
-                uint8_t value = memory[++sp];
-                store_operand(mode, dest, value);
-                break;
-            }
-            
-            case 0x30: {
-                break;
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                ++frames;
+                frame_seconds += seconds;
+                max_frame_seconds = std::max(max_frame_seconds, seconds);
+                queued += drawing.commands.size();
+                max_queued = std::max<uint64_t>(max_queued, drawing.commands.size());
             }
+            drawing.clear();
+            next = std::chrono::steady_clock::now() + interval;
 
-            case 0x31: {
-                break;
-            }
+            guard.lock();
+            if (last && pending.empty()) break;
+        }
+    }
 
-            case 0xff: // hlt
-                running = false;
-                break;
-            
-            default:
-                throw std::runtime_error("Unknown opcode: " + std::to_string(opcode));
+public:
+    explicit RenderThread(SimpleIO& target, double fps = 60.0)
+        : target(target),
+          interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps))),
+          worker(&RenderThread::render, this) {}
+
+    ~RenderThread() {
+        try {
+            stop();
+        } catch (...) {
+        }
+    }
 
+    RenderThread(const RenderThread&) = delete;
+    RenderThread& operator=(const RenderThread&) = delete;
+
+    // Draw everything recorded so far, then end the thread; rethrows what
+    // went wrong drawing, if anything did
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.splice(recording);
+            stopping = true;
         }
+        wake.notify_one();
+        worker.join();
+        if (error) std::rethrow_exception(error);
+    }
+
+    void print(const std::string& text) override { recording.add_text(DisplayList::Kind::Print, text); }
+    std::string input() override { return target.input(); }
+
+    void draw_rect(int x, int y, int w, int h, COLORREF color) override {
+        recording.add(DisplayList::Kind::Rect, color, x, y, w, h);
+    }
+
+    void draw_circle(int x, int y, int r, COLORREF color) override {
+        recording.add(DisplayList::Kind::Circle, color, x, y, r);
+    }
+
+    void color_text(const std::string& text, COLORREF color, int x, int y) override {
+        recording.add_text(DisplayList::Kind::Text, text, color, x, y);
+    }
+
+    void draw_line(int x1, int y1, int x2, int y2, COLORREF color) override {
+        recording.add(DisplayList::Kind::Line, color, x1, y1, x2, y2);
+    }
+
+    void clear_screen(COLORREF color = RGB(255, 255, 255)) override {
+        recording.drop_hidden();
+        recording.add(DisplayList::Kind::Clear, color);
+    }
+
+    bool mouse_clicked() override { return target.mouse_clicked(); }
+    POINT get_mouse_pos() override { return target.get_mouse_pos(); }
+
+    void present() override { hand_over(true); }
+    void present_if_due() override {
+        if (!recording.empty()) hand_over(false);
+    }
+
+    // Frames drawn, mean and worst time to draw one, and mean and largest
+    // number of commands drawn per frame; valid after stop()
+    void report(std::ostream& out) const {
+        StreamFormat format(out);
+        out << std::dec << "Rendered " << frames << " frames, " << std::fixed << std::setprecision(3)
+            << (frames ? frame_seconds * 1000.0 / frames : 0.0) << " ms mean, " << max_frame_seconds * 1000.0
+            << " ms max, " << std::setprecision(1) << (frames ? static_cast<double>(queued) / frames : 0.0)
+            << " commands/frame mean, " << max_queued << " max" << std::endl;
     }
 };
 
-// Define clock period (1000 ms / 16 Hz = 62.5 ms)
-const double VirtualMachine::CLOCK_PERIOD_MS = 1000.0 / 16.0;
+// Bytes for in, handed from an I/O thread to the VM through a lock-free
+// single-producer/single-consumer ring. Either side parks on a condition
+// variable instead of spinning when the ring is empty or full, so a guest
+// waiting on in costs no CPU.
+class InputQueue {
+    static const size_t CAPACITY = 4096; // Power of two
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Error: No input binary" << std::endl;
-        return 1;
+    std::array<uint8_t, CAPACITY> ring;
+    alignas(64) std::atomic<size_t> head; // Next byte to pop, advanced by the consumer
+    alignas(64) std::atomic<size_t> tail; // Next free slot, advanced by the producer
+    std::atomic<bool> closed; // No more bytes will be pushed
+    std::atomic<int> waiters; // Threads (about to be) waiting on wake
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread reader;
+#ifndef _WIN32
+    int stop_pipe[2] = {-1, -1}; // Written to end the reader's poll()
+#endif
+
+    // Block until ready() holds. The count is raised before ready() is
+    // checked under the lock, and the other side checks it after publishing,
+    // so a wakeup cannot fall between the check and the wait. A count rather
+    // than a flag, so one side leaving cannot hide the other still waiting.
+    template <typename Ready>
+    void park(Ready ready) {
+        std::unique_lock<std::mutex> guard(lock);
+        waiters.fetch_add(1);
+        while (!ready()) wake.wait(guard);
+        waiters.fetch_sub(1);
     }
 
-    VirtualMachine vm;
+    void unpark() {
+        if (waiters.load() != 0) {
+            std::lock_guard<std::mutex> guard(lock);
+            wake.notify_all();
+        }
+    }
 
-    // Load program:
-    std::vector<uint8_t> program = get_program(argv[1]);
+public:
+    InputQueue() : ring(), head(0), tail(0), closed(false), waiters(0) {}
 
-    try {
-        vm.load_program(program);
-        vm.run();
-    } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << std::endl;
-        return 1;
+    ~InputQueue() {
+        stop();
+    }
+
+    InputQueue(const InputQueue&) = delete;
+    InputQueue& operator=(const InputQueue&) = delete;
+
+    // Bytes ready to pop without blocking
+    size_t available() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+    }
+
+    // available() != 0, ordered against the waiter count for park()
+    bool nonempty() const {
+        return tail.load() != head.load(std::memory_order_relaxed);
+    }
+
+    // Producer side: append value, waiting while the ring is full
+    void push(uint8_t value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == CAPACITY) {
+            park([&] { return t - head.load() != CAPACITY || closed.load(); });
+            if (closed.load()) return; // Stopped while full
+        }
+        ring[t & (CAPACITY - 1)] = value;
+        tail.store(t + 1);
+        unpark();
+    }
+
+    // Producer side: no more bytes follow
+    void close() {
+        closed.store(true);
+        unpark();
+    }
+
+    // Consumer side: the next byte, waiting for one if needed; 0 once the
+    // queue is closed and drained, like reading past the end of the input
+    uint8_t pop() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == h) {
+            park([&] { return tail.load() != h || closed.load(); });
+            if (tail.load(std::memory_order_acquire) == h) return 0;
+        }
+        uint8_t value = ring[h & (CAPACITY - 1)];
+        head.store(h + 1);
+        unpark();
+        return value;
+    }
+
+    // Consumer side: true once nothing is left and nothing more will come
+    bool drained() const {
+        return closed.load() && available() == 0;
+    }
+
+    // Consumer side: wait without popping until a byte is ready or the
+    // queue is closed
+    void wait() {
+        if (available() == 0) park([&] { return nonempty() || closed.load(); });
+    }
+
+    // Like wait(), giving up at deadline; false if the deadline came first
+    bool wait_until(std::chrono::steady_clock::time_point deadline) {
+        if (available() != 0) return true;
+        std::unique_lock<std::mutex> guard(lock);
+        waiters.fetch_add(1);
+        const bool woken = wake.wait_until(guard, deadline, [&] { return nonempty() || closed.load(); });
+        waiters.fetch_sub(1);
+        return woken;
+    }
+
+    // Start a thread pushing the non-whitespace characters of standard input,
+    // the values in would read from std::cin, and closing at end of file
+    void feed_stdin() {
+#ifdef _WIN32
+        // A blocking console read cannot be interrupted, so the reader is
+        // left to end with the process
+        std::thread([this] {
+            char c;
+            while (std::cin.get(c)) {
+                if (!std::isspace(static_cast<unsigned char>(c))) push(static_cast<uint8_t>(c));
+            }
+            close();
+        }).detach();
+#else
+        if (pipe(stop_pipe) != 0) {
+            throw std::runtime_error("Failed to create input thread pipe");
+        }
+        reader = std::thread([this] {
+            char buffer[256];
+            pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { stop_pipe[0], POLLIN, 0 } };
+            for (;;) {
+                if (poll(fds, 2, -1) < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                if (fds[1].revents) break;
+                ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                for (ssize_t i = 0; i < n; ++i) {
+                    if (!std::isspace(static_cast<unsigned char>(buffer[i]))) push(static_cast<uint8_t>(buffer[i]));
+                }
+            }
+            close();
+        });
+#endif
+    }
+
+    // End the reader thread, if any, and close the queue
+    void stop() {
+#ifndef _WIN32
+        if (reader.joinable()) {
+            closed.store(true); // Also releases a reader parked on a full ring
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                wake.notify_all();
+            }
+            char c = 0;
+            if (write(stop_pipe[1], &c, 1) < 0) {}
+            reader.join();
+            ::close(stop_pipe[0]);
+            ::close(stop_pipe[1]);
+            stop_pipe[0] = stop_pipe[1] = -1;
+        }
+#endif
+        close();
+    }
+};
+
+#ifdef _WIN32
+WindowsIO io(false);
+#else
+ConsoleIO io;
+#endif
+
+// A program ready to load: the initial contents of all of memory and where
+// execution starts. Loading one is a 256-byte copy however it was stored.
+struct ProgramImage {
+    std::array<uint8_t, 256> memory{};
+    uint16_t size = 0; // End of the last byte loaded from the file
+    uint8_t entry = 0;
+    uint8_t stack_pointer = 0xff;
+
+    // A plain binary: code at address 0, executed from there
+    static ProgramImage raw(const uint8_t* data, size_t size) {
+        if (size > 256) {
+            throw std::runtime_error("Program too large for memory");
+        }
+        ProgramImage image;
+        std::copy(data, data + size, image.memory.begin());
+        image.size = static_cast<uint16_t>(size);
+        return image;
+    }
+
+    static ProgramImage raw(const std::vector<uint8_t>& program) {
+        return raw(program.data(), program.size());
+    }
+
+    // Identifies the loaded state (memory, entry and stack pointer), e.g. so a
+    // recorded input log is only replayed against the program it came from
+    uint32_t checksum() const;
+};
+
+// Sectioned image files start with this header (multi-byte fields little-endian):
+//    0  magic "N8IM"
+//    4  version
+//    5  entry point
+//    6  initial stack pointer
+//    7  section count
+//    8  checksum: 32-bit FNV-1a of everything after the header
+// followed by the sections, each a load address (1 byte), a kind (1 byte) and a
+// size (2 bytes), then size bytes of contents unless the section is zero-filled.
+// Files without the magic are raw binaries.
+const uint8_t IMAGE_MAGIC[4] = { 'N', '8', 'I', 'M' };
+const uint8_t IMAGE_VERSION = 1;
+const size_t IMAGE_HEADER_SIZE = 12;
+
+enum class SectionKind : uint8_t {
+    Bytes = 0, // Code or initialized data
+    Zero = 1 // BSS: zero-filled, no contents in the file
+};
+
+inline uint32_t image_checksum(const uint8_t* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+inline uint32_t ProgramImage::checksum() const {
+    uint8_t tail[2] = { entry, stack_pointer };
+    uint32_t hash = image_checksum(memory.data(), memory.size());
+    for (uint8_t b : tail) {
+        hash = (hash ^ b) * 16777619u;
+    }
+    return hash;
+}
+
+ProgramImage parse_program(const uint8_t* data, size_t size) {
+    if (size < IMAGE_HEADER_SIZE || std::memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+        return ProgramImage::raw(data, size);
+    }
+    if (data[4] != IMAGE_VERSION) {
+        throw std::runtime_error("Unsupported image version: " + std::to_string(data[4]));
+    }
+    uint32_t checksum = data[8] | (data[9] << 8) | (data[10] << 16) | (static_cast<uint32_t>(data[11]) << 24);
+    if (image_checksum(data + IMAGE_HEADER_SIZE, size - IMAGE_HEADER_SIZE) != checksum) {
+        throw std::runtime_error("Image checksum mismatch");
+    }
+
+    ProgramImage image;
+    image.entry = data[5];
+    image.stack_pointer = data[6];
+    size_t offset = IMAGE_HEADER_SIZE;
+    for (uint8_t i = 0; i < data[7]; ++i) {
+        if (size - offset < 4) {
+            throw std::runtime_error("Truncated image section header");
+        }
+        uint8_t address = data[offset];
+        SectionKind kind = static_cast<SectionKind>(data[offset + 1]);
+        size_t length = data[offset + 2] | (data[offset + 3] << 8);
+        offset += 4;
+        if (address + length > image.memory.size()) {
+            throw std::runtime_error("Image section does not fit in memory");
+        }
+        switch (kind) {
+            case SectionKind::Bytes:
+                if (size - offset < length) {
+                    throw std::runtime_error("Truncated image section");
+                }
+                std::copy(data + offset, data + offset + length, image.memory.begin() + address);
+                offset += length;
+                break;
+            case SectionKind::Zero:
+                std::fill(image.memory.begin() + address, image.memory.begin() + address + length, 0);
+                break;
+            default:
+                throw std::runtime_error("Unknown image section kind: " + std::to_string(static_cast<int>(kind)));
+        }
+        image.size = std::max<uint16_t>(image.size, static_cast<uint16_t>(address + length));
+    }
+    return image;
+}
+
+// A whole file, mapped read-only where the host supports it and read in one
+// call otherwise
+class MappedFile {
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    std::vector<uint8_t> buffer;
+#else
+    void* mapping = nullptr;
+#endif
+
+public:
+    explicit MappedFile(const std::string& filepath) {
+#ifdef _WIN32
+        std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open file: " + filepath);
+        }
+        buffer.resize(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        bytes = buffer.data();
+        length = buffer.size();
+#else
+        int fd = open(filepath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file: " + filepath);
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            length = static_cast<size_t>(info.st_size);
+            mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Failed to map file: " + filepath);
+        }
+        bytes = static_cast<const uint8_t*>(mapping);
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (mapping) munmap(mapping, length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+ProgramImage get_program(const std::string& filepath) {
+    MappedFile file(filepath);
+    return parse_program(file.data(), file.size());
+}
+
+// Encoded size of an instruction: 1 (no operands), 2 (address), 3 (mode and
+// one operand) or 4 (mode and two operands)
+constexpr uint8_t instruction_length(uint8_t opcode) {
+    switch (opcode) {
+        case 0x01: case 0x02: case 0x03: case 0x04: case 0x0e: case 0x30: case 0x31: case 0x33:
+        case 0x10: case 0x11: case 0x12: case 0x13:
+        case 0x20: case 0x21: case 0x22: case 0x24: case 0x25:
+            return 4;
+        case 0x23: case 0x26: case 0x27: case 0x32:
+            return 3;
+        case 0x06: case 0x07: case 0x08: case 0x09:
+        case 0x0a: case 0x0b: case 0x0c: case 0x0d: case 0x14:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// The block instructions (mcpy 0x30, mcmp 0x31) work on BLOCK_COUNT_REGISTER
+// (r4) bytes and take one extra cycle per BLOCK_BYTES_PER_CYCLE of them
+constexpr uint8_t BLOCK_COUNT_REGISTER = 0x04;
+constexpr uint8_t BLOCK_BYTES_PER_CYCLE = 4;
+
+constexpr uint64_t block_cycles(uint8_t count) {
+    return count / BLOCK_BYTES_PER_CYCLE;
+}
+
+// The atomic instructions (tas 0x32, cas 0x33) read, compare and write their
+// byte in one step even with other cores sharing memory. cas compares with
+// and reports back through ATOMIC_EXPECTED_REGISTER (r1).
+constexpr uint8_t ATOMIC_EXPECTED_REGISTER = 0x01;
+
+// Guest faults stop execution instead of unwinding through the interpreter;
+// VirtualMachine::run() reports them to the host afterwards
+enum class Fault : uint8_t {
+    None,
+    InvalidOperandMode,
+    InvalidDestinationMode,
+    UnknownOpcode,
+    StackUnderflow, // ret or pop with nothing pushed
+    StackOverflow // cal or push with sp already at 0
+};
+
+// The whole architectural state in one flat struct, plus fixed buffers for
+// in and port 0, so that core_step() can run during compilation
+struct CoreState {
+    std::array<uint8_t, 256> memory{};
+    std::array<uint8_t, 256> registers{};
+    uint8_t pc = 0, sp = 0xff;
+    bool flag_equal = false, flag_less = false, flag_more = false;
+    bool running = true;
+    Fault fault = Fault::None;
+    uint8_t fault_pc = 0;
+    uint64_t instructions = 0;
+    uint64_t cycles = 0; // instructions plus the extra cycles of block instructions
+    std::array<uint8_t, 256> input{}; // What in reads, 0 past input_size
+    size_t input_size = 0, input_used = 0;
+    std::array<uint8_t, 256> output{}; // The first bytes written to port 0
+    size_t output_size = 0;
+};
+
+constexpr uint8_t core_fetch(const CoreState& s, uint8_t kind, uint8_t operand) {
+    switch (kind) {
+        case 0: return operand;
+        case 1: return s.registers[operand];
+        case 2: return s.memory[operand];
+        default: return s.memory[s.registers[operand]];
+    }
+}
+
+constexpr void core_store(CoreState& s, uint8_t kind, uint8_t dest, uint8_t value) {
+    switch (kind) {
+        case 0: break;
+        case 1: s.registers[dest] = value; break;
+        case 2: s.memory[dest] = value; break;
+        default: s.memory[s.registers[dest]] = value; break;
+    }
+}
+
+constexpr void core_trap(CoreState& s, Fault fault, uint8_t at) {
+    s.fault = fault;
+    s.fault_pc = at;
+    s.running = false;
+}
+
+// Execute one instruction: the reference for the instruction set, without
+// the decode cache, dispatch tables or ports of VirtualMachine (which must
+// agree with it)
+constexpr void core_step(CoreState& s) {
+    const uint8_t at = s.pc;
+    const uint8_t opcode = s.memory[at];
+    const uint8_t next = s.memory[static_cast<uint8_t>(at + 1)];
+    const uint8_t length = instruction_length(opcode);
+    const uint8_t src = length > 2 ? next & 0x0f : 0;
+    const uint8_t dst = length > 2 ? next >> 4 : 0;
+    const uint8_t a = length > 2 ? s.memory[static_cast<uint8_t>(at + 2)] : next;
+    const uint8_t b = length > 2 ? s.memory[static_cast<uint8_t>(at + 3)] : 0;
+    s.pc = static_cast<uint8_t>(at + length);
+    ++s.instructions;
+    ++s.cycles;
+
+    if (length > 2 && (src > 3 || dst > 3)) {
+        if (opcode == 0x27) { // pop checks the stack before the mode
+            if (s.sp >= 0xff) return core_trap(s, Fault::StackUnderflow, at);
+            ++s.sp;
+        }
+        bool store_only = opcode == 0x02 || opcode == 0x03 || opcode == 0x27;
+        return core_trap(s, store_only ? Fault::InvalidDestinationMode : Fault::InvalidOperandMode, at);
+    }
+
+    switch (opcode) {
+        case 0x00: case 0x0f: // nop, int
+            break;
+        case 0x14: case 0x15: // int n, iret (like the ports, the interrupt controller is not modelled)
+            break;
+        case 0x30: case 0x31: { // mcpy, mcmp: blocks at [address] or [register], wrapping at 0xff
+            if (dst < 2) return core_trap(s, opcode == 0x30 ? Fault::InvalidDestinationMode : Fault::InvalidOperandMode, at);
+            const uint8_t count = s.registers[BLOCK_COUNT_REGISTER];
+            const uint8_t first = dst == 2 ? a : s.registers[a];
+            const uint8_t second = src == 2 ? b : src == 3 ? s.registers[b] : 0;
+            const uint8_t value = core_fetch(s, src, b); // Used when the source is a byte, not a block
+            std::array<uint8_t, 256> source{};
+            for (unsigned i = 0; i < count; ++i) {
+                source[i] = src >= 2 ? s.memory[static_cast<uint8_t>(second + i)] : value;
+            }
+            if (opcode == 0x30) {
+                for (unsigned i = 0; i < count; ++i) s.memory[static_cast<uint8_t>(first + i)] = source[i];
+            } else {
+                uint8_t left = 0, right = 0;
+                for (unsigned i = 0; i < count && left == right; ++i) {
+                    left = s.memory[static_cast<uint8_t>(first + i)];
+                    right = source[i];
+                }
+                s.flag_equal = left == right;
+                s.flag_less = left < right;
+                s.flag_more = left > right;
+            }
+            s.cycles += block_cycles(count);
+            break;
+        }
+        case 0x32: case 0x33: { // tas, cas: flags compare the byte's old value with 0 or r1
+            if (dst < 2) return core_trap(s, Fault::InvalidDestinationMode, at);
+            uint8_t& byte = s.memory[dst == 2 ? a : s.registers[a]];
+            const uint8_t value = opcode == 0x32 ? 1 : core_fetch(s, src, b);
+            const uint8_t old = byte;
+            const uint8_t expected = opcode == 0x32 ? 0 : s.registers[ATOMIC_EXPECTED_REGISTER];
+            s.flag_equal = old == expected;
+            s.flag_less = old < expected;
+            s.flag_more = old > expected;
+            if (opcode == 0x32 || old == expected) byte = value;
+            else s.registers[ATOMIC_EXPECTED_REGISTER] = old;
+            break;
+        }
+        case 0x01: // out
+            if (b == 0 && s.output_size < s.output.size()) s.output[s.output_size++] = core_fetch(s, src, a);
+            break;
+        case 0x02: // in; port 1 is the count of input left, ports 8-11 the mailbox and core number of a lone core
+            if (b == 1) core_store(s, dst, a, static_cast<uint8_t>(std::min<size_t>(s.input_size - s.input_used, 255)));
+            else if (b >= 8 && b <= 11) core_store(s, dst, a, b == 11 ? 1 : 0);
+            else core_store(s, dst, a, s.input_used < s.input_size ? s.input[s.input_used++] : 0);
+            break;
+        case 0x03: // lea
+            core_store(s, dst, a, b);
+            break;
+        case 0x05: // ret; the stack works as in VirtualMachine::push_stack()
+            if (s.sp >= 0xff) return core_trap(s, Fault::StackUnderflow, at);
+            s.pc = s.memory[s.sp++];
+            break;
+        case 0x06: // cal
+            if (s.sp == 0) return core_trap(s, Fault::StackOverflow, at);
+            s.memory[--s.sp] = s.pc;
+            s.pc = a;
+            break;
+        case 0x07: s.pc = a; break;
+        case 0x08: if (s.flag_less) s.pc = a; break;
+        case 0x09: if (!s.flag_less) s.pc = a; break;
+        case 0x0a: if (!s.flag_more) s.pc = a; break;
+        case 0x0b: if (s.flag_more) s.pc = a; break;
+        case 0x0c: if (!s.flag_equal) s.pc = a; break;
+        case 0x0d: if (s.flag_equal) s.pc = a; break;
+        case 0x0e: { // cmp
+            uint8_t left = core_fetch(s, src, a);
+            uint8_t right = core_fetch(s, dst, b);
+            s.flag_equal = left == right;
+            s.flag_less = left < right;
+            s.flag_more = left > right;
+            break;
+        }
+        case 0x04: case 0x10: case 0x11: case 0x12: case 0x13: // The ALU reads both operands with the source mode
+        case 0x20: case 0x21: case 0x22: case 0x23: case 0x24: case 0x25: {
+            uint8_t x = core_fetch(s, src, a);
+            uint8_t y = opcode == 0x23 ? 0 : core_fetch(s, src, b);
+            uint8_t result = 0;
+            switch (opcode) {
+                case 0x04: result = y; break;
+                case 0x10: result = x + y; break;
+                case 0x11: result = x - y; break;
+                case 0x12: result = x * y; break;
+                case 0x13: result = y == 0 ? 0 : x / y; break;
+                case 0x20: result = x & y; break;
+                case 0x21: result = x | y; break;
+                case 0x22: result = x ^ y; break;
+                case 0x23: result = ~x; break;
+                case 0x24: result = ~(x | y); break;
+                default: result = ~(x & y); break;
+            }
+            core_store(s, dst, a, result);
+            break;
+        }
+        case 0x26: { // push
+            uint8_t value = core_fetch(s, src, a);
+            if (s.sp == 0) return core_trap(s, Fault::StackOverflow, at);
+            s.memory[--s.sp] = value;
+            break;
+        }
+        case 0x27: { // pop
+            if (s.sp >= 0xff) return core_trap(s, Fault::StackUnderflow, at);
+            uint8_t value = s.memory[s.sp++];
+            core_store(s, dst, a, value);
+            break;
+        }
+        case 0xff: // hlt
+            s.running = false;
+            break;
+        default:
+            return core_trap(s, Fault::UnknownOpcode, at);
+    }
+}
+
+// Run until hlt, a fault, pc reaching stop (before executing there) or
+// max_instructions in total
+constexpr CoreState core_run(CoreState s, uint64_t max_instructions, int stop = -1) {
+    while (s.running && s.instructions < max_instructions && s.pc != stop) {
+        core_step(s);
+    }
+    return s;
+}
+
+// test.asm and what it assembles to; the assembler is not constexpr, so
+// BenchmarkSuite::run() checks that it still produces these bytes
+const char TEST_ASM[] = "start:\n  cal main\n  cal end\n\nmain:\n  ret\n\nend:\n  hlt\n";
+constexpr std::array<uint8_t, 6> TEST_ASM_BYTES = { 0x06, 0x04, 0x06, 0x05, 0x05, 0xff };
+
+// test.asm run during compilation
+constexpr CoreState core_run_test_asm() {
+    CoreState s;
+    for (size_t i = 0; i < TEST_ASM_BYTES.size(); ++i) {
+        s.memory[i] = TEST_ASM_BYTES[i];
+    }
+    return core_run(s, 100);
+}
+constexpr CoreState TEST_ASM_RESULT = core_run_test_asm();
+static_assert(!TEST_ASM_RESULT.running && TEST_ASM_RESULT.fault == Fault::None &&
+              TEST_ASM_RESULT.instructions == 4 && TEST_ASM_RESULT.pc == 6 &&
+              TEST_ASM_RESULT.sp == 0xfe && TEST_ASM_RESULT.memory[0xfe] == 4,
+              "test.asm must halt after cal, ret, cal, hlt with the second return address pushed");
+
+// Pre-execute program from its entry until pc reaches stop, so the work of
+// init code (ROM tables, cleared buffers) ships in the image instead of
+// running at every start. Images hold no registers or flags, so init code
+// has to leave its results in memory.
+inline ProgramImage bake_program(const ProgramImage& program, uint8_t stop, uint64_t max_instructions) {
+    CoreState s;
+    s.memory = program.memory;
+    s.pc = program.entry;
+    s.sp = program.stack_pointer;
+    s = core_run(s, max_instructions, stop);
+    if (s.fault != Fault::None) {
+        throw std::runtime_error("Init code faulted at " + std::to_string(s.fault_pc));
+    }
+    if (s.pc != stop || !s.running) {
+        throw std::runtime_error("Init code did not reach " + std::to_string(stop));
+    }
+    ProgramImage baked = program;
+    baked.memory = s.memory;
+    baked.size = 256;
+    baked.entry = s.pc;
+    baked.stack_pointer = s.sp;
+    return baked;
+}
+
+// One section of an image file, as produced by the assembler
+struct ImageSection {
+    uint8_t address;
+    SectionKind kind;
+    uint16_t size;
+    std::vector<uint8_t> bytes; // Contents, for SectionKind::Bytes
+};
+
+// Serialize sections into the image file format read by parse_program()
+std::vector<uint8_t> encode_image(const std::vector<ImageSection>& sections, uint8_t entry, uint8_t stack_pointer) {
+    if (sections.size() > 255) {
+        throw std::runtime_error("Too many image sections");
+    }
+    std::vector<uint8_t> file(IMAGE_MAGIC, IMAGE_MAGIC + sizeof(IMAGE_MAGIC));
+    file.push_back(IMAGE_VERSION);
+    file.push_back(entry);
+    file.push_back(stack_pointer);
+    file.push_back(static_cast<uint8_t>(sections.size()));
+    file.resize(IMAGE_HEADER_SIZE);
+    for (const ImageSection& section : sections) {
+        file.push_back(section.address);
+        file.push_back(static_cast<uint8_t>(section.kind));
+        file.push_back(static_cast<uint8_t>(section.size));
+        file.push_back(static_cast<uint8_t>(section.size >> 8));
+        if (section.kind == SectionKind::Bytes) {
+            file.insert(file.end(), section.bytes.begin(), section.bytes.end());
+        }
+    }
+    uint32_t checksum = image_checksum(file.data() + IMAGE_HEADER_SIZE, file.size() - IMAGE_HEADER_SIZE);
+    for (int i = 0; i < 4; ++i) {
+        file[8 + i] = static_cast<uint8_t>(checksum >> (8 * i));
+    }
+    return file;
+}
+
+// Two-pass assembler for the test.asm dialect. The first pass parses every
+// line, sizes it and records labels; the second emits bytes with the labels
+// resolved. One Assembler can be reused for many programs.
+//
+//   name:                 label for the next address
+//   mov r1, 5             operands: 5, 0x05, 0b101, 'c' or a label (immediate),
+//   add r1, r2            r1-r4, e1-e4, x1-x4 or l1-l4 (register),
+//   out [r1], 0           [0x80] or [label] (memory), [r1] (register indirect)
+//   db 1, 'a', "text"     raw bytes
+//   .org 0x40             continue at another address
+//   .zero 16              reserve zero-filled bytes
+//   .entry start          where execution starts (default 0)
+//   .stack 0xf0           initial stack pointer (default 0xff)
+//   ; comment
+//
+// The ALU instructions read both operands with the source mode, so their
+// operands must be of the same kind.
+class Assembler {
+public:
+    // Assemble source into a loadable image; throws on the first error
+    ProgramImage assemble(const std::string& source) {
+        statements.clear();
+        labels.clear();
+        sections.clear();
+        entry = 0;
+        stack_pointer = 0xff;
+        parse(source);
+        emit();
+
+        ProgramImage image;
+        image.entry = entry;
+        image.stack_pointer = stack_pointer;
+        for (const ImageSection& section : sections) {
+            if (section.kind == SectionKind::Bytes) {
+                std::copy(section.bytes.begin(), section.bytes.end(), image.memory.begin() + section.address);
+            } else {
+                std::fill(image.memory.begin() + section.address, image.memory.begin() + section.address + section.size, 0);
+            }
+            image.size = std::max<uint16_t>(image.size, static_cast<uint16_t>(section.address + section.size));
+        }
+        return image;
+    }
+
+    // Labels of the last assembled program and their addresses
+    const std::unordered_map<std::string, uint16_t>& symbols() const {
+        return labels;
+    }
+
+    // The last assembled program in the image file format
+    std::vector<uint8_t> image_file() const {
+        return encode_image(sections, entry, stack_pointer);
+    }
+
+private:
+    enum class Directive : uint8_t { Instruction, Bytes, Org, Zero, Entry, Stack };
+
+    // How an opcode's operands are encoded
+    enum class Form : uint8_t {
+        None, // nop, ret, hlt
+        Target, // Jumps and cal: one address byte
+        Vector, // int n: one vector byte
+        Alu, // dst, src: mode, dst, src; both read with the source mode
+        Unary, // not x: mode, x
+        Move, // mov dst, src: mode, dst, src
+        Compare, // cmp a, b: mode (a low, b high), a, b
+        Out, // out src, port
+        In, // in dst, port
+        Lea, // lea dst, value
+        Push, // push src: mode, src
+        Pop, // pop dst: mode, dst
+        Block, // mcpy/mcmp block, block or byte: encoded like Move
+        Lock, // tas byte: encoded like Pop
+        Swap // cas byte, value: encoded like Move
+    };
+
+    struct Mnemonic {
+        uint8_t opcode;
+        Form form;
+    };
+
+    struct Operand {
+        uint8_t kind; // Addressing mode: 0 immediate, 1 register, 2 memory, 3 register indirect
+        uint8_t value;
+        std::string label; // Resolved in the second pass when set
+    };
+
+    struct Statement {
+        Directive directive;
+        Form form;
+        uint8_t opcode;
+        int line;
+        uint16_t address;
+        std::vector<Operand> operands;
+    };
+
+    std::vector<Statement> statements;
+    std::unordered_map<std::string, uint16_t> labels;
+    std::vector<ImageSection> sections;
+    uint8_t entry = 0;
+    uint8_t stack_pointer = 0xff;
+
+    static const std::unordered_map<std::string, Mnemonic>& mnemonics() {
+        static const std::unordered_map<std::string, Mnemonic> table = {
+            { "nop", { 0x00, Form::None } }, { "out", { 0x01, Form::Out } }, { "in", { 0x02, Form::In } },
+            { "lea", { 0x03, Form::Lea } }, { "mov", { 0x04, Form::Move } }, { "ret", { 0x05, Form::None } },
+            { "cal", { 0x06, Form::Target } }, { "jmp", { 0x07, Form::Target } }, { "jl", { 0x08, Form::Target } },
+            { "jnl", { 0x09, Form::Target } }, { "jnm", { 0x0a, Form::Target } }, { "jm", { 0x0b, Form::Target } },
+            { "jne", { 0x0c, Form::Target } }, { "je", { 0x0d, Form::Target } }, { "cmp", { 0x0e, Form::Compare } },
+            { "int", { 0x14, Form::Vector } }, { "add", { 0x10, Form::Alu } }, { "sub", { 0x11, Form::Alu } },
+            { "mul", { 0x12, Form::Alu } }, { "div", { 0x13, Form::Alu } }, { "and", { 0x20, Form::Alu } },
+            { "or", { 0x21, Form::Alu } }, { "xor", { 0x22, Form::Alu } }, { "not", { 0x23, Form::Unary } },
+            { "nor", { 0x24, Form::Alu } }, { "nand", { 0x25, Form::Alu } }, { "push", { 0x26, Form::Push } },
+            { "pop", { 0x27, Form::Pop } }, { "mcpy", { 0x30, Form::Block } }, { "mcmp", { 0x31, Form::Block } },
+            { "tas", { 0x32, Form::Lock } }, { "cas", { 0x33, Form::Swap } },
+            { "iret", { 0x15, Form::None } }, { "hlt", { 0xff, Form::None } }
+        };
+        return table;
+    }
+
+    static size_t operand_count(Form form) {
+        switch (form) {
+            case Form::None: return 0;
+            case Form::Target: case Form::Vector: case Form::Unary: case Form::Push: case Form::Pop:
+            case Form::Lock: return 1;
+            default: return 2;
+        }
+    }
+
+    [[noreturn]] static void fail(int line, const std::string& message) {
+        throw std::runtime_error("line " + std::to_string(line) + ": " + message);
+    }
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    static bool is_name(char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.'; }
+
+    static std::string trim(const char* begin, const char* end) {
+        while (begin < end && is_space(*begin)) ++begin;
+        while (end > begin && is_space(end[-1])) --end;
+        return std::string(begin, end);
+    }
+
+    // r1-r4 are 0x01-0x04, e1-e4 0x11-0x14 and x1-x4 (alias l1-l4) 0x21-0x24
+    static bool register_id(const std::string& name, uint8_t& id) {
+        if (name.size() != 2 || name[1] < '1' || name[1] > '4') return false;
+        uint8_t index = static_cast<uint8_t>(name[1] - '0');
+        switch (name[0]) {
+            case 'r': id = index; return true;
+            case 'e': id = 0x10 | index; return true;
+            case 'x': case 'l': id = 0x20 | index; return true;
+            default: return false;
+        }
+    }
+
+    // Decimal, 0x hex or 0b binary, optionally negative; a leading zero is
+    // still decimal, so 010 is ten rather than octal eight
+    static uint8_t number(const std::string& text, int line) {
+        size_t at = text[0] == '-' ? 1 : 0;
+        int base = 10;
+        if (text.size() > at + 1 && text[at] == '0') {
+            char prefix = static_cast<char>(std::tolower(static_cast<unsigned char>(text[at + 1])));
+            if (prefix == 'x') base = 16;
+            if (prefix == 'b') base = 2;
+            if (base != 10) at += 2;
+        }
+        // strtol would also take a sign or whitespace here
+        if (at >= text.size() || !std::isxdigit(static_cast<unsigned char>(text[at]))) fail(line, "bad number: " + text);
+        char* end = nullptr;
+        long n = std::strtol(text.c_str() + at, &end, base);
+        if (text[0] == '-') n = -n;
+        if (*end != '\0' || n < -128 || n > 255) fail(line, "bad number: " + text);
+        return static_cast<uint8_t>(n);
+    }
+
+    // Number, character or label
+    static Operand value(const std::string& text, int line) {
+        Operand op = { 0, 0, std::string() };
+        if (text.empty()) fail(line, "missing operand");
+        if (text.size() == 3 && text[0] == '\'' && text[2] == '\'') {
+            op.value = static_cast<uint8_t>(text[1]);
+            return op;
+        }
+        if (std::isdigit(static_cast<unsigned char>(text[0])) || text[0] == '-') {
+            op.value = number(text, line);
+            return op;
+        }
+        for (char c : text) {
+            if (!is_name(c)) fail(line, "bad operand: " + text);
+        }
+        op.label = text;
+        return op;
+    }
+
+    static Operand operand(const std::string& text, int line) {
+        uint8_t id;
+        if (text.size() >= 2 && text.front() == '[' && text.back() == ']') {
+            std::string inner = trim(text.data() + 1, text.data() + text.size() - 1);
+            if (register_id(inner, id)) return { 3, id, std::string() };
+            Operand op = value(inner, line);
+            op.kind = 2;
+            return op;
+        }
+        if (register_id(text, id)) return { 1, id, std::string() };
+        return value(text, line);
+    }
+
+    // Split on commas outside quotes
+    static void split_operands(const char* begin, const char* end, std::vector<std::string>& out, int line) {
+        const char* start = begin;
+        char quote = 0;
+        for (const char* p = begin; p < end; ++p) {
+            if (quote) {
+                if (*p == quote) quote = 0;
+            } else if (*p == '"' || *p == '\'') {
+                quote = *p;
+            } else if (*p == ',') {
+                out.push_back(trim(start, p));
+                start = p + 1;
+            }
+        }
+        if (quote) fail(line, "unterminated quote");
+        std::string last = trim(start, end);
+        if (!last.empty() || !out.empty()) out.push_back(last);
+    }
+
+    static size_t size_of(const Statement& st) {
+        switch (st.directive) {
+            case Directive::Instruction: return instruction_length(st.opcode);
+            case Directive::Bytes: return st.operands.size();
+            default: return 0;
+        }
+    }
+
+    void parse(const std::string& source) {
+        std::vector<std::string> fields;
+        uint16_t address = 0;
+        int line = 0;
+        const char* p = source.data();
+        const char* text_end = p + source.size();
+        while (p < text_end) {
+            ++line;
+            const char* eol = static_cast<const char*>(std::memchr(p, '\n', text_end - p));
+            if (!eol) eol = text_end;
+            const char* end = p;
+            char quote = 0;
+            while (end < eol && (quote || *end != ';')) {
+                if (quote && *end == quote) quote = 0;
+                else if (!quote && (*end == '"' || *end == '\'')) quote = *end;
+                ++end;
+            }
+            const char* cur = p;
+            p = eol + 1;
+
+            // Labels
+            for (;;) {
+                while (cur < end && is_space(*cur)) ++cur;
+                const char* name = cur;
+                while (cur < end && is_name(*cur)) ++cur;
+                if (cur < end && *cur == ':' && cur > name) {
+                    std::string label(name, cur);
+                    if (!labels.emplace(label, address).second) fail(line, "duplicate label: " + label);
+                    ++cur;
+                    continue;
+                }
+                cur = name;
+                break;
+            }
+            if (cur == end) continue;
+
+            const char* word = cur;
+            while (cur < end && !is_space(*cur)) ++cur;
+            std::string mnemonic(word, cur);
+            fields.clear();
+            split_operands(cur, end, fields, line);
+
+            Statement st = { Directive::Instruction, Form::None, 0, line, address, std::vector<Operand>() };
+            if (mnemonic == "db") {
+                st.directive = Directive::Bytes;
+                for (const std::string& f : fields) {
+                    if (f.size() >= 2 && f.front() == '"' && f.back() == '"') {
+                        for (size_t i = 1; i + 1 < f.size(); ++i) {
+                            st.operands.push_back({ 0, static_cast<uint8_t>(f[i]), std::string() });
+                        }
+                    } else {
+                        st.operands.push_back(value(f, line));
+                    }
+                }
+            } else if (mnemonic == ".org" || mnemonic == ".zero" || mnemonic == ".entry" || mnemonic == ".stack") {
+                if (fields.size() != 1) fail(line, mnemonic + " takes one operand");
+                st.directive = mnemonic == ".org" ? Directive::Org
+                             : mnemonic == ".zero" ? Directive::Zero
+                             : mnemonic == ".entry" ? Directive::Entry : Directive::Stack;
+                st.operands.push_back(value(fields[0], line));
+                if (st.directive == Directive::Org || st.directive == Directive::Zero) {
+                    if (!st.operands[0].label.empty()) fail(line, mnemonic + " needs a number");
+                    address = st.directive == Directive::Org ? st.operands[0].value : address + st.operands[0].value;
+                }
+            } else {
+                auto it = mnemonics().find(mnemonic);
+                if (it == mnemonics().end()) fail(line, "unknown instruction: " + mnemonic);
+                st.opcode = it->second.opcode;
+                st.form = it->second.form;
+                if (fields.size() != operand_count(it->second.form)) {
+                    fail(line, mnemonic + " takes " + std::to_string(operand_count(it->second.form)) + " operand(s)");
+                }
+                for (const std::string& f : fields) {
+                    st.operands.push_back(operand(f, line));
+                }
+                check(st);
+            }
+            address = static_cast<uint16_t>(address + size_of(st));
+            if (address > 256) fail(line, "program does not fit in memory");
+            statements.push_back(std::move(st));
+        }
+    }
+
+    // Reject operand kinds the encoding cannot express
+    static void check(const Statement& st) {
+        const std::vector<Operand>& ops = st.operands;
+        auto require_immediate = [&](const Operand& op, const char* what) {
+            if (op.kind != 0) fail(st.line, std::string(what) + " must be an immediate or label");
+        };
+        switch (st.form) {
+            case Form::Target: require_immediate(ops[0], "jump target"); break;
+            case Form::Vector:
+                if (ops[0].kind != 0 || !ops[0].label.empty() || ops[0].value > 7) {
+                    fail(st.line, "interrupt vector must be a number from 0 to 7");
+                }
+                break;
+            case Form::Alu:
+                if (ops[0].kind != ops[1].kind) fail(st.line, "operands must be of the same kind");
+                break;
+            case Form::Out: case Form::In: require_immediate(ops[1], "port"); break;
+            case Form::Lea: require_immediate(ops[1], "lea value"); break;
+            case Form::Block:
+                if (ops[0].kind < 2) fail(st.line, "block must be [address] or [register]");
+                break;
+            case Form::Lock: case Form::Swap:
+                if (ops[0].kind < 2) fail(st.line, "atomic operand must be [address] or [register]");
+                break;
+            default: break;
+        }
+    }
+
+    uint8_t resolve(const Operand& op, int line) const {
+        if (op.label.empty()) return op.value;
+        auto it = labels.find(op.label);
+        if (it == labels.end()) fail(line, "unknown label: " + op.label);
+        // A label after the last byte of memory would wrap around to 0
+        if (it->second > 0xff) fail(line, "label is past the end of memory: " + op.label);
+        return static_cast<uint8_t>(it->second);
+    }
+
+    void emit() {
+        ImageSection* section = nullptr;
+        auto open = [&](uint16_t address) -> ImageSection& {
+            if (!section || section->kind != SectionKind::Bytes || section->address + section->size != address) {
+                sections.push_back({ static_cast<uint8_t>(address), SectionKind::Bytes, 0, std::vector<uint8_t>() });
+                section = &sections.back();
+            }
+            return *section;
+        };
+        auto put = [&](uint16_t address, uint8_t byte) {
+            ImageSection& s = open(address);
+            s.bytes.push_back(byte);
+            ++s.size;
+        };
+
+        for (const Statement& st : statements) {
+            const std::vector<Operand>& ops = st.operands;
+            uint16_t at = st.address;
+            switch (st.directive) {
+                case Directive::Org:
+                    break;
+                case Directive::Zero:
+                    if (ops[0].value) {
+                        sections.push_back({ static_cast<uint8_t>(at), SectionKind::Zero, ops[0].value, std::vector<uint8_t>() });
+                        section = &sections.back();
+                    }
+                    break;
+                case Directive::Entry:
+                    entry = resolve(ops[0], st.line);
+                    break;
+                case Directive::Stack:
+                    stack_pointer = resolve(ops[0], st.line);
+                    break;
+                case Directive::Bytes:
+                    for (const Operand& op : ops) put(at++, resolve(op, st.line));
+                    break;
+                case Directive::Instruction: {
+                    put(at++, st.opcode);
+                    switch (st.form) {
+                        case Form::None:
+                            break;
+                        case Form::Target: case Form::Vector:
+                            put(at++, resolve(ops[0], st.line));
+                            break;
+                        case Form::Unary:
+                            put(at++, static_cast<uint8_t>(ops[0].kind << 4 | ops[0].kind));
+                            put(at++, resolve(ops[0], st.line));
+                            break;
+                        case Form::Push:
+                            put(at++, ops[0].kind);
+                            put(at++, resolve(ops[0], st.line));
+                            break;
+                        case Form::Pop: case Form::Lock:
+                            put(at++, static_cast<uint8_t>(ops[0].kind << 4));
+                            put(at++, resolve(ops[0], st.line));
+                            break;
+                        case Form::Compare:
+                            put(at++, static_cast<uint8_t>(ops[1].kind << 4 | ops[0].kind));
+                            put(at++, resolve(ops[0], st.line));
+                            put(at++, resolve(ops[1], st.line));
+                            break;
+                        case Form::Out:
+                            put(at++, ops[0].kind);
+                            put(at++, resolve(ops[0], st.line));
+                            put(at++, resolve(ops[1], st.line));
+                            break;
+                        case Form::In: case Form::Lea:
+                            put(at++, static_cast<uint8_t>(ops[0].kind << 4));
+                            put(at++, resolve(ops[0], st.line));
+                            put(at++, resolve(ops[1], st.line));
+                            break;
+                        default: // Alu, Move, Block, Swap: dst kind high, src kind low
+                            put(at++, static_cast<uint8_t>(ops[0].kind << 4 | ops[1].kind));
+                            put(at++, resolve(ops[0], st.line));
+                            put(at++, resolve(ops[1], st.line));
+                            break;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+};
+
+#if NIGG8_JIT
+// Compiles basic blocks of guest code to x86-64. A block runs until the first
+// jmp/jl/.../cal/ret/hlt, or stops short of anything it cannot compile (out, in,
+// bad modes, unknown opcodes) or a breakpoint, which the VM then steps with
+// the interpreter.
+// Up to four guest registers and the comparison flags live in host registers
+// inside a block and are written back on every exit. Exits to a fixed address
+// are patched into direct jumps once the target block exists.
+class JitCompiler {
+public:
+    // Why compiled code returned to the VM
+    enum class Exit : uint8_t {
+        Dispatch, // No compiled block at ctx.pc yet, or too little budget to chain
+        Halt, // hlt retired
+        CodeWrite, // A store hit a byte in code_map (ctx.written)
+        Interpret // The instruction at ctx.pc must go through the interpreter
+    };
+
+    // Everything generated code reads or writes besides guest memory and registers
+    struct Context {
+        uint8_t* memory;
+        uint8_t* registers;
+        const uint8_t* code_map;
+        const uint8_t* const* blocks;
+        uint64_t budget; // Blocks chain into the next only while retired is below this
+        uint64_t retired;
+        uint8_t pc, sp;
+        uint8_t flag_equal, flag_less, flag_more;
+        Exit exit;
+        uint8_t written;
+    };
+
+    // Longest block; the VM enters (and chains) blocks only while at least
+    // this many instructions are left to run, so none can overrun a limit
+    static const int MAX_BLOCK_INSTRUCTIONS = 32;
+
+    JitCompiler(uint8_t* memory, uint8_t* registers, uint8_t* code_map, const bool* breakpoints)
+        : code_map(code_map), breakpoints(breakpoints), blocks(), covered() {
+        buffer = static_cast<uint8_t*>(mmap(nullptr, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (buffer == MAP_FAILED) {
+            throw std::runtime_error("Failed to allocate JIT buffer");
+        }
+        ctx = Context();
+        ctx.memory = memory;
+        ctx.registers = registers;
+        ctx.code_map = code_map;
+        ctx.blocks = blocks.data();
+        emit_trampoline();
+        protect(PROT_READ | PROT_EXEC);
+    }
+
+    ~JitCompiler() {
+        munmap(buffer, BUFFER_SIZE);
+    }
+
+    JitCompiler(const JitCompiler&) = delete;
+    JitCompiler& operator=(const JitCompiler&) = delete;
+
+    Context& context() { return ctx; }
+
+    // Compiled code for the block starting at pc, or nullptr if the first
+    // instruction there has to be interpreted
+    const uint8_t* block_at(uint8_t pc) {
+        if (!blocks[pc]) {
+            compile(pc);
+        }
+        return blocks[pc];
+    }
+
+    // Run from block until an exit; ctx must hold the current VM state
+    void enter(const uint8_t* block) {
+        entry(&ctx, block);
+    }
+
+    // Called for every store to a byte in code_map
+    void invalidate(uint8_t addr) {
+        if (covered[addr]) {
+            flush();
+        }
+    }
+
+    void flush() {
+        for (size_t i = 0; i < covered.size(); ++i) {
+            if (covered[i]) {
+                --code_map[i];
+            }
+        }
+        forget();
+    }
+
+    // Drop every block without uncounting it, for a caller that clears
+    // code_map itself; flush() after such a clear would underflow the map
+    void forget() {
+        covered.fill(false);
+        blocks.fill(nullptr);
+        pending.clear();
+        used = trampoline_size;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 1 << 20;
+    static const size_t MAX_BLOCK_BYTES = 16 << 10; // Generous bound for one block
+    static const int CACHED_REGISTERS = 4;
+
+    // x86-64 register numbers and their fixed roles in compiled code
+    enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+    static const Reg MEM = RBX, REGS = R12, CODE_MAP = R13, CTX = R14, RETIRED = R15;
+    static const Reg FLAG_EQ = R8, FLAG_LT = R9, FLAG_GT = R10;
+    static constexpr Reg SLOT_REGS[CACHED_REGISTERS] = { RSI, RDI, R11, RBP };
+
+    // Condition codes for jcc/setcc
+    enum Cond : uint8_t { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7 };
+
+    struct Insn {
+        uint8_t pc, opcode, src, dst, a, b, length;
+    };
+
+    // Out-of-line exit emitted after the block body
+    struct Stub {
+        uint8_t* site;
+        Exit exit;
+        uint8_t pc; // Where the guest continues
+        uint32_t retired; // Instructions completed when the stub is taken
+        int written; // Stored address, or -1 when it is in dl
+    };
+
+    struct Patch {
+        uint8_t target;
+        uint8_t* site;
+    };
+
+    Context ctx;
+    uint8_t* buffer;
+    size_t used = 0;
+    size_t trampoline_size = 0;
+    void (*entry)(Context*, const uint8_t*) = nullptr;
+    const uint8_t* epilogue = nullptr;
+    uint8_t* code_map; // Shared with the VM; one count per byte covered by a block
+    const bool* breakpoints; // The VM's; blocks end before these addresses
+    std::array<const uint8_t*, 256> blocks;
+    std::array<bool, 256> covered;
+    std::vector<Patch> pending; // Direct exits waiting for their target block
+    std::vector<Stub> stubs;
+
+    // Per-block register allocation
+    std::array<int8_t, 256> slot_of;
+    uint8_t slot_guest[CACHED_REGISTERS];
+    bool slot_dirty[CACHED_REGISTERS];
+    int slot_count = 0;
+    bool uses_flags = false, writes_flags = false;
+
+    void protect(int prot) {
+        mprotect(buffer, BUFFER_SIZE, prot);
+    }
+
+    // Raw emission
+    uint8_t* here() { return buffer + used; }
+    void byte(uint8_t b) { buffer[used++] = b; }
+    void dword(uint32_t v) { std::memcpy(buffer + used, &v, 4); used += 4; }
+
+    void link(uint8_t* site, const uint8_t* target) {
+        int32_t rel = static_cast<int32_t>(target - (site + 4));
+        std::memcpy(site, &rel, 4);
+    }
+
+    void rex(bool w, int reg, int index, int base, bool force) {
+        uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+        if (r != 0x40 || force) byte(r);
+    }
+
+    void modrm_rr(int reg, int rm) { byte(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+
+    // [base + disp32]
+    void modrm_disp(int reg, int base, int32_t disp) {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        dword(static_cast<uint32_t>(disp));
+    }
+
+    // [base + index]
+    void modrm_index(int reg, int base, int index) {
+        byte(0x44 | ((reg & 7) << 3));
+        byte(((index & 7) << 3) | (base & 7));
+        byte(0);
+    }
+
+    // Instructions used by the compiler (32-bit unless noted)
+    void movzx_load(int dst, int base, int32_t disp) { rex(false, dst, 0, base, false); byte(0x0f); byte(0xb6); modrm_disp(dst, base, disp); }
+    void movzx_load_index(int dst, int base, int index) { rex(false, dst, index, base, false); byte(0x0f); byte(0xb6); modrm_index(dst, base, index); }
+    void store8(int base, int32_t disp, int src) { rex(false, src, 0, base, true); byte(0x88); modrm_disp(src, base, disp); }
+    void store8_index(int base, int index, int src) { rex(false, src, index, base, true); byte(0x88); modrm_index(src, base, index); }
+    void store8_imm(int base, int32_t disp, uint8_t imm) { rex(false, 0, 0, base, false); byte(0xc6); modrm_disp(0, base, disp); byte(imm); }
+    void cmp8_imm(int base, int32_t disp, uint8_t imm) { rex(false, 0, 0, base, false); byte(0x80); modrm_disp(7, base, disp); byte(imm); }
+    void cmp8_imm_index(int base, int index, uint8_t imm) { rex(false, 0, index, base, false); byte(0x80); modrm_index(7, base, index); byte(imm); }
+    void cmp_imm(int r, uint32_t imm) { rex(false, 0, 0, r, false); byte(0x81); modrm_rr(7, r); dword(imm); }
+    void mov_imm(int dst, uint32_t imm) { rex(false, 0, 0, dst, false); byte(0xb8 + (dst & 7)); dword(imm); }
+    void alu_rr(uint8_t op, int dst, int src) { rex(false, src, 0, dst, false); byte(op); modrm_rr(src, dst); } // op r/m32, r32
+    void movzx_rr8(int dst, int src) { rex(false, dst, 0, src, true); byte(0x0f); byte(0xb6); modrm_rr(dst, src); }
+    void imul_rr(int dst, int src) { rex(false, dst, 0, src, false); byte(0x0f); byte(0xaf); modrm_rr(dst, src); }
+    void unary(int ext, int r) { rex(false, 0, 0, r, false); byte(0xf7); modrm_rr(ext, r); } // 2 not, 6 div
+    void inc_dec(int ext, int r) { rex(false, 0, 0, r, false); byte(0xff); modrm_rr(ext, r); } // 0 inc, 1 dec
+    void setcc(Cond cc, int r) { rex(false, 0, 0, r, true); byte(0x0f); byte(0x90 | cc); modrm_rr(0, r); }
+    uint8_t* jcc(Cond cc) { byte(0x0f); byte(0x80 | cc); dword(0); return here() - 4; }
+    uint8_t* jmp() { byte(0xe9); dword(0); return here() - 4; }
+    void load64(int dst, int base, int32_t disp) { rex(true, dst, 0, base, false); byte(0x8b); modrm_disp(dst, base, disp); }
+    void store64(int base, int32_t disp, int src) { rex(true, src, 0, base, false); byte(0x89); modrm_disp(src, base, disp); }
+    void add64_imm(int r, int32_t imm) { rex(true, 0, 0, r, false); byte(0x81); modrm_rr(0, r); dword(static_cast<uint32_t>(imm)); }
+    void cmp64_mem(int r, int base, int32_t disp) { rex(true, r, 0, base, false); byte(0x3b); modrm_disp(r, base, disp); }
+    void push(int r) { if (r >= 8) byte(0x41); byte(0x50 + (r & 7)); }
+    void pop(int r) { if (r >= 8) byte(0x41); byte(0x58 + (r & 7)); }
+
+    // entry(ctx, block) and the shared epilogue every exit jumps to
+    void emit_trampoline() {
+        entry = reinterpret_cast<void (*)(Context*, const uint8_t*)>(here());
+        push(RBX); push(RBP); push(R12); push(R13); push(R14); push(R15);
+        rex(true, RDI, 0, CTX, false); byte(0x89); modrm_rr(RDI, CTX); // mov r14, rdi
+        load64(MEM, CTX, offsetof(Context, memory));
+        load64(REGS, CTX, offsetof(Context, registers));
+        load64(CODE_MAP, CTX, offsetof(Context, code_map));
+        alu_rr(0x31, RETIRED, RETIRED);
+        byte(0xff); modrm_rr(4, RSI); // jmp rsi
+
+        epilogue = here();
+        store64(CTX, offsetof(Context, retired), RETIRED);
+        pop(R15); pop(R14); pop(R13); pop(R12); pop(RBP); pop(RBX);
+        byte(0xc3);
+        trampoline_size = used;
+    }
+
+    static bool has_mode(uint8_t opcode) {
+        return instruction_length(opcode) >= 3;
+    }
+
+    static bool compilable(const Insn& in) {
+        switch (in.opcode) {
+            case 0x01: case 0x02: case 0x14: case 0x15: // I/O, interrupt, block and atomic instructions stay in the interpreter
+            case 0x30: case 0x31: case 0x32: case 0x33:
+                return false;
+            case 0x00: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07: case 0x08:
+            case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d: case 0x0e: case 0x0f:
+            case 0x10: case 0x11: case 0x12: case 0x13: case 0x20: case 0x21: case 0x22:
+            case 0x23: case 0x24: case 0x25: case 0x26: case 0x27: case 0xff:
+                return !has_mode(in.opcode) || (in.src <= 3 && in.dst <= 3);
+            default:
+                return false;
+        }
+    }
+
+    static bool ends_block(uint8_t opcode) {
+        return (opcode >= 0x05 && opcode <= 0x0d) || opcode == 0xff;
+    }
+
+    // ALU opcodes that read the destination / source operand
+    static bool reads_dest(uint8_t opcode) { return opcode != 0x04; }
+    static bool reads_src(uint8_t opcode) { return opcode != 0x23; }
+    static bool is_alu(uint8_t opcode) {
+        return opcode == 0x04 || (opcode >= 0x10 && opcode <= 0x13) || (opcode >= 0x20 && opcode <= 0x25);
+    }
+
+    Insn read(uint8_t pc) const {
+        const uint8_t* m = ctx.memory;
+        Insn in;
+        in.pc = pc;
+        in.opcode = m[pc];
+        in.length = instruction_length(in.opcode);
+        uint8_t next = m[static_cast<uint8_t>(pc + 1)];
+        if (in.length <= 2) {
+            in.src = in.dst = 0;
+            in.a = next;
+            in.b = 0;
+        } else {
+            in.src = next & 0x0f;
+            in.dst = next >> 4;
+            in.a = m[static_cast<uint8_t>(pc + 2)];
+            in.b = m[static_cast<uint8_t>(pc + 3)];
+        }
+        return in;
+    }
+
+    // Pick the guest registers worth keeping in host registers for this block
+    void allocate(const Insn* list, int count) {
+        std::array<uint16_t, 256> uses{};
+        std::array<bool, 256> writes{};
+        auto use = [&](uint8_t kind, uint8_t operand, bool write) {
+            if (kind == 1 || kind == 3) ++uses[operand];
+            if (kind == 1 && write) writes[operand] = true;
+        };
+        uses_flags = writes_flags = false;
+        for (int i = 0; i < count; ++i) {
+            const Insn& in = list[i];
+            if (is_alu(in.opcode)) {
+                if (reads_dest(in.opcode)) use(in.src, in.a, false);
+                if (reads_src(in.opcode)) use(in.src, in.b, false);
+                use(in.dst, in.a, true);
+            } else if (in.opcode == 0x0e) {
+                use(in.src, in.a, false);
+                use(in.dst, in.b, false);
+                uses_flags = writes_flags = true;
+            } else if (in.opcode == 0x03 || in.opcode == 0x27) {
+                use(in.dst, in.a, true);
+            } else if (in.opcode == 0x26) {
+                use(in.src, in.a, false);
+            } else if (in.opcode >= 0x08 && in.opcode <= 0x0d) {
+                uses_flags = true;
+            }
+        }
+
+        slot_of.fill(-1);
+        slot_count = 0;
+        while (slot_count < CACHED_REGISTERS) {
+            int best = -1;
+            for (int r = 0; r < 256; ++r) {
+                if (slot_of[r] < 0 && uses[r] >= 2 && (best < 0 || uses[r] > uses[best])) best = r;
+            }
+            if (best < 0) break;
+            slot_of[best] = static_cast<int8_t>(slot_count);
+            slot_guest[slot_count] = static_cast<uint8_t>(best);
+            slot_dirty[slot_count] = writes[best];
+            ++slot_count;
+        }
+    }
+
+    void load_register(int dst, uint8_t reg) {
+        if (slot_of[reg] >= 0) alu_rr(0x89, dst, SLOT_REGS[slot_of[reg]]);
+        else movzx_load(dst, REGS, reg);
+    }
+
+    // Operand value into dst (rax or rcx); rdx is scratch
+    void fetch(int dst, uint8_t kind, uint8_t operand) {
+        switch (kind) {
+            case 0: mov_imm(dst, operand); break;
+            case 1: load_register(dst, operand); break;
+            case 2: movzx_load(dst, MEM, operand); break;
+            default: load_register(RDX, operand); movzx_load_index(dst, MEM, RDX); break;
+        }
+    }
+
+    // Store al; memory stores leave the block if they hit code
+    void store(uint8_t kind, uint8_t operand, uint8_t next_pc, uint32_t retired) {
+        switch (kind) {
+            case 0:
+                break;
+            case 1:
+                if (slot_of[operand] >= 0) movzx_rr8(SLOT_REGS[slot_of[operand]], RAX);
+                else store8(REGS, operand, RAX);
+                break;
+            case 2:
+                store8(MEM, operand, RAX);
+                cmp8_imm(CODE_MAP, operand, 0);
+                stubs.push_back({ jcc(CC_NE), Exit::CodeWrite, next_pc, retired, operand });
+                break;
+            default:
+                load_register(RDX, operand);
+                store8_index(MEM, RDX, RAX);
+                cmp8_imm_index(CODE_MAP, RDX, 0);
+                stubs.push_back({ jcc(CC_NE), Exit::CodeWrite, next_pc, retired, -1 });
+                break;
+        }
+    }
+
+    // Write cached registers and flags back before leaving the block
+    void leave() {
+        for (int s = 0; s < slot_count; ++s) {
+            if (slot_dirty[s]) store8(REGS, slot_guest[s], SLOT_REGS[s]);
+        }
+        if (writes_flags) {
+            store8(CTX, offsetof(Context, flag_equal), FLAG_EQ);
+            store8(CTX, offsetof(Context, flag_less), FLAG_LT);
+            store8(CTX, offsetof(Context, flag_more), FLAG_GT);
+        }
+    }
+
+    void retire(uint32_t count) {
+        if (count) add64_imm(RETIRED, static_cast<int32_t>(count));
+    }
+
+    // Continue at a fixed address, chaining straight into its block when possible
+    void exit_to(uint8_t target, uint32_t retired) {
+        leave();
+        retire(retired);
+        store8_imm(CTX, offsetof(Context, pc), target);
+        cmp64_mem(RETIRED, CTX, offsetof(Context, budget));
+        link(jcc(CC_AE), epilogue);
+        uint8_t* site = jmp();
+        if (blocks[target]) {
+            link(site, blocks[target]);
+        } else {
+            link(site, epilogue);
+            pending.push_back({ target, site });
+        }
+    }
+
+    // Continue at the address in eax (ret)
+    void exit_dynamic(uint32_t retired) {
+        leave();
+        retire(retired);
+        store8(CTX, offsetof(Context, pc), RAX);
+        cmp64_mem(RETIRED, CTX, offsetof(Context, budget));
+        link(jcc(CC_AE), epilogue);
+        load64(RCX, CTX, offsetof(Context, blocks));
+        byte(0x48); byte(0x8b); byte(0x04); byte(0xc1); // mov rax, [rcx + rax*8]
+        byte(0x48); byte(0x85); byte(0xc0); // test rax, rax
+        link(jcc(CC_E), epilogue);
+        byte(0xff); modrm_rr(4, RAX); // jmp rax
+    }
+
+    void exit_with(Exit exit, uint8_t pc, uint32_t retired) {
+        leave();
+        retire(retired);
+        store8_imm(CTX, offsetof(Context, pc), pc);
+        store8_imm(CTX, offsetof(Context, exit), static_cast<uint8_t>(exit));
+        link(jmp(), epilogue);
+    }
+
+    // sp -= 1 into edx and ctx; a full stack goes back to the interpreter to fault
+    void push_sp(const Insn& in, uint32_t retired) {
+        movzx_load(RDX, CTX, offsetof(Context, sp));
+        alu_rr(0x85, RDX, RDX);
+        stubs.push_back({ jcc(CC_E), Exit::Interpret, in.pc, retired, 0 });
+        inc_dec(1, RDX);
+        store8(CTX, offsetof(Context, sp), RDX);
+    }
+
+    // Top of stack into eax and sp += 1, as VirtualMachine::pop_stack(); an
+    // empty stack goes back to the interpreter to fault
+    void pop_value(const Insn& in, uint32_t retired) {
+        movzx_load(RDX, CTX, offsetof(Context, sp));
+        cmp_imm(RDX, 0xff);
+        stubs.push_back({ jcc(CC_E), Exit::Interpret, in.pc, retired, 0 });
+        movzx_load_index(RAX, MEM, RDX);
+        inc_dec(0, RDX);
+        store8(CTX, offsetof(Context, sp), RDX);
+    }
+
+    void emit(const Insn& in, uint32_t index) {
+        const uint32_t done = index + 1;
+        const uint8_t next = static_cast<uint8_t>(in.pc + in.length);
+
+        if (is_alu(in.opcode)) {
+            if (in.opcode == 0x04) {
+                fetch(RAX, in.src, in.b);
+            } else {
+                fetch(RAX, in.src, in.a);
+                if (reads_src(in.opcode)) fetch(RCX, in.src, in.b);
+            }
+            switch (in.opcode) {
+                case 0x10: alu_rr(0x01, RAX, RCX); break; // add
+                case 0x11: alu_rr(0x29, RAX, RCX); break; // sub
+                case 0x12: imul_rr(RAX, RCX); break; // mul
+                case 0x13: { // div, 0 when dividing by zero
+                    alu_rr(0x85, RCX, RCX);
+                    uint8_t* zero = jcc(CC_E);
+                    alu_rr(0x31, RDX, RDX);
+                    unary(6, RCX);
+                    uint8_t* done_site = jmp();
+                    link(zero, here());
+                    alu_rr(0x31, RAX, RAX);
+                    link(done_site, here());
+                    break;
+                }
+                case 0x20: alu_rr(0x21, RAX, RCX); break; // and
+                case 0x21: alu_rr(0x09, RAX, RCX); break; // or
+                case 0x22: alu_rr(0x31, RAX, RCX); break; // xor
+                case 0x23: unary(2, RAX); break; // not
+                case 0x24: alu_rr(0x09, RAX, RCX); unary(2, RAX); break; // nor
+                case 0x25: alu_rr(0x21, RAX, RCX); unary(2, RAX); break; // nand
+                default: break; // mov
+            }
+            store(in.dst, in.a, next, done);
+            return;
+        }
+
+        switch (in.opcode) {
+            case 0x03: // lea
+                mov_imm(RAX, in.b);
+                store(in.dst, in.a, next, done);
+                break;
+
+            case 0x05: // ret
+                pop_value(in, index);
+                exit_dynamic(done);
+                break;
+
+            case 0x06: // cal
+                push_sp(in, index);
+                mov_imm(RAX, next);
+                store8_index(MEM, RDX, RAX);
+                cmp8_imm_index(CODE_MAP, RDX, 0);
+                stubs.push_back({ jcc(CC_NE), Exit::CodeWrite, in.a, done, -1 });
+                exit_to(in.a, done);
+                break;
+
+            case 0x07: // jmp
+                exit_to(in.a, done);
+                break;
+
+            case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d: {
+                Reg flag = (in.opcode == 0x08 || in.opcode == 0x09) ? FLAG_LT
+                         : (in.opcode == 0x0a || in.opcode == 0x0b) ? FLAG_GT : FLAG_EQ;
+                bool when_set = in.opcode == 0x08 || in.opcode == 0x0b || in.opcode == 0x0d;
+                alu_rr(0x85, flag, flag);
+                uint8_t* not_taken = jcc(when_set ? CC_E : CC_NE);
+                exit_to(in.a, done);
+                link(not_taken, here());
+                exit_to(next, done);
+                break;
+            }
+
+            case 0x0e: // cmp
+                fetch(RAX, in.src, in.a);
+                fetch(RCX, in.dst, in.b);
+                alu_rr(0x39, RAX, RCX);
+                setcc(CC_E, FLAG_EQ);
+                setcc(CC_B, FLAG_LT);
+                setcc(CC_A, FLAG_GT);
+                break;
+
+            case 0x26: // push
+                fetch(RAX, in.src, in.a);
+                push_sp(in, index);
+                store8_index(MEM, RDX, RAX);
+                cmp8_imm_index(CODE_MAP, RDX, 0);
+                stubs.push_back({ jcc(CC_NE), Exit::CodeWrite, next, done, -1 });
+                break;
+
+            case 0x27: // pop
+                pop_value(in, index);
+                store(in.dst, in.a, next, done);
+                break;
+
+            case 0xff: // hlt
+                exit_with(Exit::Halt, next, done);
+                break;
+
+            default: // nop does nothing
+                break;
+        }
+    }
+
+    void compile(uint8_t start) {
+        Insn list[MAX_BLOCK_INSTRUCTIONS];
+        int count = 0;
+        uint8_t pc = start;
+        bool terminated = false;
+        while (count < MAX_BLOCK_INSTRUCTIONS) {
+            Insn in = read(pc);
+            if (!compilable(in) || breakpoints[pc]) break;
+            list[count++] = in;
+            pc = static_cast<uint8_t>(pc + in.length);
+            if (ends_block(in.opcode)) {
+                terminated = true;
+                break;
+            }
+        }
+        if (count == 0) return;
+
+        if (used + MAX_BLOCK_BYTES > BUFFER_SIZE) {
+            flush();
+        }
+        protect(PROT_READ | PROT_WRITE);
+
+        allocate(list, count);
+        stubs.clear();
+        const uint8_t* block = here();
+        for (int s = 0; s < slot_count; ++s) {
+            movzx_load(SLOT_REGS[s], REGS, slot_guest[s]);
+        }
+        if (uses_flags) {
+            movzx_load(FLAG_EQ, CTX, offsetof(Context, flag_equal));
+            movzx_load(FLAG_LT, CTX, offsetof(Context, flag_less));
+            movzx_load(FLAG_GT, CTX, offsetof(Context, flag_more));
+        }
+        for (int i = 0; i < count; ++i) {
+            emit(list[i], static_cast<uint32_t>(i));
+        }
+        if (!terminated) {
+            exit_to(pc, static_cast<uint32_t>(count));
+        }
+        for (const Stub& stub : stubs) {
+            link(stub.site, here());
+            if (stub.exit == Exit::CodeWrite) {
+                if (stub.written < 0) store8(CTX, offsetof(Context, written), RDX);
+                else store8_imm(CTX, offsetof(Context, written), static_cast<uint8_t>(stub.written));
+            }
+            exit_with(stub.exit, stub.pc, stub.retired);
+        }
+
+        for (int i = 0; i < count; ++i) {
+            for (uint8_t k = 0; k < list[i].length; ++k) {
+                uint8_t addr = static_cast<uint8_t>(list[i].pc + k);
+                if (!covered[addr]) {
+                    covered[addr] = true;
+                    ++code_map[addr];
+                }
+            }
+        }
+        blocks[start] = block;
+        for (size_t i = 0; i < pending.size();) {
+            if (pending[i].target == start) {
+                link(pending[i].site, block);
+                pending[i] = pending.back();
+                pending.pop_back();
+            } else {
+                ++i;
+            }
+        }
+        protect(PROT_READ | PROT_EXEC);
+    }
+};
+#endif
+
+#if NIGG8_PROFILE
+// Where a guest program spends its instructions. The interpreter only bumps
+// a per-pc counter for every instruction; opcode and mode counts are settled
+// from the decoded instruction at that pc whenever it leaves the decode cache
+// or the profile is finished. cal and ret move along a tree of call paths and
+// time each node; per-function and per-edge totals are derived from the tree
+// when the profile is written.
+class Profiler {
+public:
+    std::array<std::string, 256> names; // Function names by address, e.g. assembler labels
+
+    // Begin a fresh profile with the program about to run at entry
+    void start(uint8_t entry, uint64_t now) {
+        pc_hits.fill(0);
+        settled.fill(0);
+        opcodes.fill(0);
+        modes.fill(0);
+        pair_hits.assign(PAIR_SLOTS, 0);
+        last_opcode = NO_OPCODE;
+        nodes.assign(1, Node{ entry, 0, 0, 0, 0, 0 });
+        stack.assign(1, Frame{ 0, now });
+        dropped = 0;
+        first = end = now;
+    }
+
+    uint64_t* hits() { return pc_hits.data(); }
+
+    // Executions of each opcode right after another, at first << 8 | second;
+    // last_opcode is the first of the next pair, NO_OPCODE before any
+    static const unsigned NO_OPCODE = 0x100;
+    uint64_t* pairs() { return pair_hits.data(); }
+    unsigned last_opcode = NO_OPCODE;
+
+    // Charge the executions counted at pc so far to the instruction decoded
+    // there; mode is -1 for instructions without a mode byte
+    void settle(uint8_t pc, uint8_t opcode, int mode) {
+        uint64_t count = pc_hits[pc] - settled[pc];
+        if (count == 0) return;
+        opcodes[opcode] += count;
+        if (mode >= 0) modes[mode] += count;
+        settled[pc] = pc_hits[pc];
+    }
+
+    void call(uint8_t target, uint64_t now) {
+        if (stack.size() == MAX_DEPTH) {
+            ++dropped;
+            return;
+        }
+        const uint32_t n = child(stack.back().node, target);
+        ++nodes[n].calls;
+        stack.push_back({ n, now });
+    }
+
+    // A ret with no matching cal (the program pushed its own return address)
+    // leaves the shadow stack alone
+    void ret(uint64_t now) {
+        if (dropped) {
+            --dropped;
+            return;
+        }
+        if (stack.size() == 1) return;
+        nodes[stack.back().node].inclusive += now - stack.back().entered;
+        stack.pop_back();
+    }
+
+    void finish(uint64_t now) {
+        end = now;
+    }
+
+    void write_json(std::ostream& out) const {
+        const std::vector<uint64_t> inclusive = node_inclusive();
+        std::array<Total, 256> functions{};
+        std::vector<Total> edges(256 * 256);
+        for (uint32_t i = 0; i < nodes.size(); ++i) {
+            const Node& node = nodes[i];
+            Total& f = functions[node.function];
+            f.calls += node.calls;
+            f.exclusive += inclusive[i];
+            uint32_t n = i;
+            while (n != 0 && nodes[nodes[n].parent].function != node.function) n = nodes[n].parent;
+            if (n == 0) f.inclusive += inclusive[i]; // Outermost activation, so recursion counts once
+            if (i == 0) continue;
+            functions[nodes[node.parent].function].exclusive -= inclusive[i];
+            Total& edge = edges[nodes[node.parent].function << 8 | node.function];
+            edge.calls += node.calls;
+            edge.inclusive += inclusive[i];
+        }
+
+        out << "{\n  \"instructions\": " << end - first << ",\n";
+        write_counts(out, "opcodes", opcodes);
+        write_counts(out, "modes", modes);
+        write_counts(out, "pcs", pc_hits);
+        write_pairs(out);
+        out << "  \"functions\": [";
+        const char* separator = "\n";
+        for (size_t i = 0; i < functions.size(); ++i) {
+            const Total& f = functions[i];
+            if (f.calls == 0 && f.inclusive == 0) continue;
+            out << separator << "    {\"address\": " << i << ", \"name\": \"" << name(static_cast<uint8_t>(i))
+                << "\", \"calls\": " << f.calls << ", \"inclusive\": " << f.inclusive
+                << ", \"exclusive\": " << f.exclusive << "}";
+            separator = ",\n";
+        }
+        out << "\n  ],\n  \"calls\": [";
+        separator = "\n";
+        for (size_t i = 0; i < edges.size(); ++i) {
+            if (edges[i].calls == 0) continue;
+            out << separator << "    {\"caller\": \"" << name(static_cast<uint8_t>(i >> 8)) << "\", \"callee\": \""
+                << name(static_cast<uint8_t>(i)) << "\", \"calls\": " << edges[i].calls
+                << ", \"inclusive\": " << edges[i].inclusive << "}";
+            separator = ",\n";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    // One line per call stack, root first: "start;main;draw 1234"
+    void write_folded(std::ostream& out) const {
+        std::vector<uint64_t> self = node_inclusive();
+        for (uint32_t i = 1; i < nodes.size(); ++i) {
+            self[nodes[i].parent] -= self[i];
+        }
+        std::vector<std::pair<std::string, uint64_t>> lines;
+        for (uint32_t i = 0; i < nodes.size(); ++i) {
+            if (self[i] == 0) continue;
+            std::string line = name(nodes[i].function);
+            for (uint32_t n = i; n != 0;) {
+                n = nodes[n].parent;
+                line = name(nodes[n].function) + ';' + line;
+            }
+            lines.emplace_back(std::move(line), self[i]);
+        }
+        std::sort(lines.begin(), lines.end());
+        for (const auto& line : lines) {
+            out << line.first << ' ' << line.second << '\n';
+        }
+    }
+
+private:
+    static const size_t MAX_DEPTH = 256; // Deeper calls are counted as part of their caller
+
+    // One call path; node 0 is the entry point. Children are always created
+    // after their parent, so a parent's index is below its children's.
+    struct Node {
+        uint8_t function;
+        uint32_t parent;
+        uint32_t child, sibling; // First callee, next callee of parent (0 for none)
+        uint64_t calls;
+        uint64_t inclusive; // Instructions spent in returned calls of this path, callees included
+    };
+
+    struct Frame {
+        uint32_t node;
+        uint64_t entered;
+    };
+
+    struct Total {
+        uint64_t calls = 0;
+        uint64_t inclusive = 0;
+        uint64_t exclusive = 0;
+    };
+
+    std::array<uint64_t, 256> pc_hits{}, settled{}; // Executions per pc, and how many reached opcodes
+    std::array<uint64_t, 256> opcodes{};
+    std::array<uint64_t, 256> modes{}; // By mode byte: destination mode << 4 | source mode
+    static const size_t PAIR_SLOTS = (NO_OPCODE + 1) << 8;
+    std::vector<uint64_t> pair_hits = std::vector<uint64_t>(PAIR_SLOTS);
+    std::vector<Node> nodes;
+    std::vector<Frame> stack;
+    size_t dropped = 0;
+    uint64_t first = 0, end = 0;
+
+    // The node for calling function from parent, created on first use
+    uint32_t child(uint32_t parent, uint8_t function) {
+        for (uint32_t n = nodes[parent].child; n != 0; n = nodes[n].sibling) {
+            if (nodes[n].function == function) return n;
+        }
+        const uint32_t n = static_cast<uint32_t>(nodes.size());
+        nodes.push_back({ function, parent, 0, nodes[parent].child, 0, 0 });
+        nodes[parent].child = n;
+        return n;
+    }
+
+    // Inclusive instructions per node, with frames still on the stack counted up to the end
+    std::vector<uint64_t> node_inclusive() const {
+        std::vector<uint64_t> inclusive(nodes.size());
+        for (uint32_t i = 0; i < nodes.size(); ++i) {
+            inclusive[i] = nodes[i].inclusive;
+        }
+        for (const Frame& frame : stack) {
+            inclusive[frame.node] += end - frame.entered;
+        }
+        return inclusive;
+    }
+
+    std::string name(uint8_t address) const {
+        if (!names[address].empty()) return names[address];
+        static const char HEX[] = "0123456789abcdef";
+        return std::string("0x") + HEX[address >> 4] + HEX[address & 0xf];
+    }
+
+    // The most frequent opcode pairs, the candidates for fused handlers
+    void write_pairs(std::ostream& out) const {
+        static const size_t MAX_PAIRS = 32;
+        static const char HEX[] = "0123456789abcdef";
+        std::vector<std::pair<uint64_t, uint32_t>> top;
+        for (uint32_t i = 0; i < NO_OPCODE << 8; ++i) {
+            if (pair_hits[i]) top.emplace_back(pair_hits[i], i);
+        }
+        std::sort(top.begin(), top.end(), [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        if (top.size() > MAX_PAIRS) top.resize(MAX_PAIRS);
+        out << "  \"pairs\": [";
+        const char* separator = "\n";
+        for (const auto& pair : top) {
+            const uint32_t i = pair.second;
+            out << separator << "    {\"first\": \"0x" << HEX[(i >> 12) & 0xf] << HEX[(i >> 8) & 0xf]
+                << "\", \"second\": \"0x" << HEX[(i >> 4) & 0xf] << HEX[i & 0xf] << "\", \"count\": " << pair.first << "}";
+            separator = ",\n";
+        }
+        out << "\n  ],\n";
+    }
+
+    static void write_counts(std::ostream& out, const char* key, const std::array<uint64_t, 256>& counts) {
+        static const char HEX[] = "0123456789abcdef";
+        out << "  \"" << key << "\": {";
+        const char* separator = "";
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (counts[i] == 0) continue;
+            out << separator << "\"0x" << HEX[i >> 4] << HEX[i & 0xf] << "\": " << counts[i];
+            separator = ", ";
+        }
+        out << "},\n";
+    }
+};
+#endif
+
+// Hierarchical timing wheel over virtual cycles. Level n has 64 slots indexed
+// by bits 6n..6n+5 of a deadline, and a timer sits on the level of the highest
+// 6-bit group in which its deadline differs from the current time, so arming
+// and cancelling are O(1) and advancing only touches the slots it passes.
+// A bitmap per level finds the next deadline without scanning empty slots.
+class TimerWheel {
+public:
+    static const uint64_t NEVER = UINT64_MAX;
+
+    // Timers are numbered 0 to count - 1
+    explicit TimerWheel(size_t count) : timers(count), now(0) {
+        heads.fill(NONE);
+        occupied.fill(0);
+        due.reserve(count);
+    }
+
+    uint64_t time() const { return now; }
+    bool armed(size_t id) const { return timers[id].armed; }
+    uint64_t deadline(size_t id) const { return timers[id].armed ? timers[id].deadline : NEVER; }
+
+    // Arm timer id for deadline, replacing an earlier arming; a deadline that
+    // has passed fires on the next advance()
+    void schedule(size_t id, uint64_t deadline) {
+        cancel(id);
+        timers[id].deadline = std::max(deadline, now);
+        link(id);
+    }
+
+    void cancel(size_t id) {
+        if (timers[id].armed) unlink(id);
+    }
+
+    // Disarm everything and restart the clock at time
+    void clear(uint64_t time) {
+        for (size_t id = 0; id < timers.size(); ++id) cancel(id);
+        now = time;
+    }
+
+    // The earliest deadline armed, NEVER if none. Timers on a lower level are
+    // due before any on a higher one, and within a level lower slots first.
+    uint64_t next_deadline() const {
+        for (unsigned level = 0; level < LEVELS; ++level) {
+            if (!occupied[level]) continue;
+            uint64_t earliest = NEVER;
+            for (uint32_t id = heads[level * SLOTS + lowest_bit(occupied[level])]; id != NONE; id = timers[id].next) {
+                earliest = std::min(earliest, timers[id].deadline);
+            }
+            return earliest;
+        }
+        return NEVER;
+    }
+
+    // Move the clock to time, calling fire(id, deadline) for every timer due
+    // by then in deadline order; fire may arm timers again
+    template <typename Fire>
+    void advance(uint64_t time, Fire fire) {
+        if (time < now) return;
+        // Every slot that starts at or before time is emptied: due timers
+        // fire, the rest go back in on the level they belong to from time on
+        due.clear();
+        for (unsigned level = 0; level < LEVELS; ++level) {
+            const unsigned shift = (level + 1) * SLOT_BITS;
+            const uint64_t base = shift >= 64 ? 0 : now >> shift << shift;
+            for (uint64_t bits = occupied[level]; bits; bits &= bits - 1) {
+                const unsigned slot = lowest_bit(bits);
+                if ((base | static_cast<uint64_t>(slot) << (level * SLOT_BITS)) > time) break;
+                while (heads[level * SLOTS + slot] != NONE) {
+                    const uint32_t id = heads[level * SLOTS + slot];
+                    unlink(id);
+                    due.push_back(id);
+                }
+            }
+        }
+        now = time;
+        size_t kept = 0;
+        for (uint32_t id : due) {
+            if (timers[id].deadline > time) link(id);
+            else due[kept++] = id;
+        }
+        due.resize(kept);
+        std::sort(due.begin(), due.end(), [&](uint32_t x, uint32_t y) {
+            return timers[x].deadline != timers[y].deadline ? timers[x].deadline < timers[y].deadline : x < y;
+        });
+        for (uint32_t id : due) fire(static_cast<size_t>(id), timers[id].deadline);
+    }
+
+private:
+    static const unsigned SLOT_BITS = 6;
+    static const unsigned SLOTS = 1 << SLOT_BITS;
+    static const unsigned LEVELS = (64 + SLOT_BITS - 1) / SLOT_BITS;
+    static constexpr uint32_t NONE = UINT32_MAX; // Inline, since fill() binds it by reference
+
+    struct Timer {
+        uint64_t deadline = 0;
+        uint32_t prev = NONE, next = NONE; // Neighbours in the slot's list
+        uint16_t slot = 0; // level * SLOTS + slot index
+        bool armed = false;
+    };
+
+    std::vector<Timer> timers;
+    std::array<uint32_t, LEVELS * SLOTS> heads; // First timer of each slot
+    std::array<uint64_t, LEVELS> occupied; // Bit per non-empty slot
+    std::vector<uint32_t> due; // Scratch for advance()
+    uint64_t now;
+
+    static unsigned lowest_bit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<unsigned>(__builtin_ctzll(bits));
+#else
+        unsigned bit = 0;
+        while (!(bits >> bit & 1)) ++bit;
+        return bit;
+#endif
+    }
+
+    static unsigned highest_bit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - static_cast<unsigned>(__builtin_clzll(bits));
+#else
+        unsigned bit = 63;
+        while (!(bits >> bit & 1)) --bit;
+        return bit;
+#endif
+    }
+
+    void link(uint32_t id) {
+        Timer& t = timers[id];
+        const uint64_t differs = t.deadline ^ now;
+        const unsigned level = differs ? highest_bit(differs) / SLOT_BITS : 0;
+        const unsigned index = static_cast<unsigned>(t.deadline >> (level * SLOT_BITS)) & (SLOTS - 1);
+        t.slot = static_cast<uint16_t>(level * SLOTS + index);
+        t.prev = NONE;
+        t.next = heads[t.slot];
+        if (t.next != NONE) timers[t.next].prev = id;
+        heads[t.slot] = id;
+        occupied[level] |= uint64_t(1) << index;
+        t.armed = true;
+    }
+
+    void unlink(uint32_t id) {
+        Timer& t = timers[id];
+        if (t.prev != NONE) timers[t.prev].next = t.next;
+        else heads[t.slot] = t.next;
+        if (t.next != NONE) timers[t.next].prev = t.prev;
+        if (heads[t.slot] == NONE) occupied[t.slot / SLOTS] &= ~(uint64_t(1) << (t.slot % SLOTS));
+        t.armed = false;
+    }
+};
+
+// How VirtualMachine::run() paces execution
+enum class ClockMode {
+    Throttled, // Run at ClockConfig::frequency_hz, sleeping once per batch
+    Turbo      // No throttling, run as fast as the host allows
+};
+
+struct ClockConfig {
+    ClockMode mode = ClockMode::Throttled;
+    double frequency_hz = 16.0; // Target cycles per second when throttled
+    uint64_t batch_size = 0; // Cycles executed between sleeps (0 = derive from frequency)
+};
+
+enum class Engine {
+    Interpreter,
+    Jit // Basic-block compiler, see JitCompiler
+};
+
+// What the cores of a multi-core guest share: the 256 bytes their memory
+// operands address and one mailbox of bytes per core. Each core keeps code and
+// the stack in its own memory (see VirtualMachine::join()).
+// Every guest access to the bytes is atomic: plain loads and stores (and each
+// byte of mcpy/mcmp) are relaxed load()/store(), so another core sees them
+// eventually but in no promised order; only tas/cas (exchange() and
+// compare_exchange(), sequentially consistent) and the mailboxes (a send
+// happens before the receive that gets it) order the accesses around them.
+class SharedMemory {
+public:
+    static const size_t MAX_CORES = 64;
+    static const size_t MAILBOX_SIZE = 256; // Bytes queued per core before send() waits
+
+    explicit SharedMemory(size_t cores) : bytes(), core_count(cores), live(cores) {
+        if (cores == 0 || cores > MAX_CORES) {
+            throw std::runtime_error("Core count must be between 1 and " + std::to_string(MAX_CORES));
+        }
+        mailboxes.reset(new Mailbox[cores]);
+    }
+
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    uint8_t* data() { return bytes.data(); }
+    size_t cores() const { return core_count; }
+
+    // Relaxed atomic access to a guest byte, a plain mov on x86-64 and ARM
+    static uint8_t load(const uint8_t* byte) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __atomic_load_n(byte, __ATOMIC_RELAXED);
+#else
+        return *reinterpret_cast<const volatile uint8_t*>(byte);
+#endif
+    }
+
+    static void store(uint8_t* byte, uint8_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        __atomic_store_n(byte, value, __ATOMIC_RELAXED);
+#else
+        *reinterpret_cast<volatile uint8_t*>(byte) = value;
+#endif
+    }
+
+    // Atomic read-modify-write of a guest byte; both return the old value
+    static uint8_t exchange(uint8_t* byte, uint8_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __atomic_exchange_n(byte, value, __ATOMIC_SEQ_CST);
+#else
+        return static_cast<uint8_t>(InterlockedExchange8(reinterpret_cast<volatile char*>(byte), static_cast<char>(value)));
+#endif
+    }
+
+    static uint8_t compare_exchange(uint8_t* byte, uint8_t expected, uint8_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        __atomic_compare_exchange_n(byte, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return expected;
+#else
+        return static_cast<uint8_t>(InterlockedCompareExchange8(reinterpret_cast<volatile char*>(byte),
+                                                                static_cast<char>(value), static_cast<char>(expected)));
+#endif
+    }
+
+    // Queue value for core to. Waits while its mailbox is full, unless to has
+    // stopped (the value is dropped) or is the sender itself.
+    void send(size_t from, size_t to, uint8_t value) {
+        Mailbox& box = mailboxes[to];
+        std::unique_lock<std::mutex> guard(box.lock);
+        while (box.count == MAILBOX_SIZE && !box.stopped && to != from) box.changed.wait(guard);
+        if (box.count == MAILBOX_SIZE || box.stopped) return;
+        box.ring[(box.head + box.count++) % MAILBOX_SIZE] = value;
+        box.changed.notify_all();
+    }
+
+    // Next value sent to core, waiting for one; 0 once every other core has
+    // stopped and nothing is left
+    uint8_t receive(size_t core) {
+        Mailbox& box = mailboxes[core];
+        std::unique_lock<std::mutex> guard(box.lock);
+        while (box.count == 0 && live.load() > 1) box.changed.wait(guard);
+        if (box.count == 0) return 0;
+        const uint8_t value = box.ring[box.head];
+        box.head = (box.head + 1) % MAILBOX_SIZE;
+        --box.count;
+        box.changed.notify_all(); // A sender may wait for the space
+        return value;
+    }
+
+    // Values receive() can return without waiting, up to 255
+    uint8_t waiting(size_t core) {
+        Mailbox& box = mailboxes[core];
+        std::lock_guard<std::mutex> guard(box.lock);
+        return static_cast<uint8_t>(std::min<size_t>(box.count, 255));
+    }
+
+    // core has stopped running: wake the cores waiting to send to it, and the
+    // ones waiting to receive in case it was the last core that could send
+    void stop(size_t core) {
+        {
+            std::lock_guard<std::mutex> guard(mailboxes[core].lock);
+            mailboxes[core].stopped = true;
+        }
+        live.fetch_sub(1);
+        for (size_t i = 0; i < core_count; ++i) {
+            std::lock_guard<std::mutex> guard(mailboxes[i].lock);
+            mailboxes[i].changed.notify_all();
+        }
+    }
+
+private:
+    struct Mailbox {
+        std::mutex lock;
+        std::condition_variable changed;
+        std::array<uint8_t, MAILBOX_SIZE> ring{};
+        size_t head = 0, count = 0;
+        bool stopped = false;
+    };
+
+    alignas(64) std::array<uint8_t, 256> bytes;
+    std::unique_ptr<Mailbox[]> mailboxes;
+    size_t core_count;
+    std::atomic<size_t> live; // Cores that have not stopped
+};
+
+// Computed goto is a GCC/Clang extension; other compilers dispatch through a switch
+#if defined(__GNUC__) || defined(__clang__)
+#define NIGG8_THREADED_DISPATCH 1
+#else
+#define NIGG8_THREADED_DISPATCH 0
+#endif
+
+class VirtualMachine {
+private:
+    static const size_t MEMORY_SIZE = 256;
+    static const size_t NUM_REGISTERS = 256; // Covers all register IDs (0x01–0x24)
+    static const uint64_t BATCHES_PER_SECOND = 100; // Sleep granularity when throttled
+    static const uint64_t TURBO_SLICE = 1 << 20; // Cycles between presentation checks in turbo mode
+    static const uint8_t MAX_INSTRUCTION_LENGTH = 4;
+    static const uint8_t MAX_COVER_LENGTH = MAX_INSTRUCTION_LENGTH + 2; // A cmp and the jump fused into it
+    static const size_t OUT_BUFFER_SIZE = 4096; // Upper bound for set_output_buffer()
+    static const uint8_t TRAP_OPCODE = 0xfe; // Reserved; what decode() reads at a breakpoint
+
+    // Built-in out ports
+    static const uint8_t PORT_PRINT        = 0x00;
+    static const uint8_t PORT_DRAW_RECT    = 0x01;
+    static const uint8_t PORT_DRAW_CIRCLE  = 0x02;
+    static const uint8_t PORT_DRAW_LINE    = 0x03;
+    static const uint8_t PORT_BANK         = 0x04; // Data bank select, with set_banks()
+    static const uint8_t PORT_IRQ_TABLE    = 0x05; // Interrupt vector table address, turns interrupts on
+    static const uint8_t PORT_IRQ_MASK     = 0x06; // Bit n lets hardware line n interrupt
+    static const uint8_t PORT_TIMER        = 0x07; // timer << 6 | n: interrupt every 2^n cycles, n = 0 stops
+    static const uint8_t PORT_MAIL_SEND    = 0x08; // To the mailbox of the core PORT_MAIL_TARGET selected
+    static const uint8_t PORT_MAIL_TARGET  = 0x09; // Core number (modulo the core count) to send to
+
+    // Interrupt lines: 0-3 are the timers, IRQ_INPUT is raised while in has
+    // input to read; int n reaches every line's handler
+    static const size_t TIMER_COUNT = 4;
+    static const uint8_t IRQ_INPUT = 4;
+    static const uint8_t IRQ_LINES = 8;
+    static const uint64_t INPUT_POLL_CYCLES = 4096; // Longest slice while the input line may interrupt
+
+    // Built-in in ports; every other port reads input like port 0
+    static const uint8_t PORT_INPUT        = 0x00;
+    static const uint8_t PORT_INPUT_STATUS = 0x01; // Bytes in can read without blocking, up to 255
+    static const uint8_t PORT_MAIL_RECEIVE = 0x08; // Next byte sent to this core, waiting for one
+    static const uint8_t PORT_MAIL_WAITING = 0x09; // Bytes in the mailbox, up to 255
+    static const uint8_t PORT_CORE_ID      = 0x0a; // This core's number, from 0
+    static const uint8_t PORT_CORE_COUNT   = 0x0b;
+
+public:
+    // Receives bytes written to a port, in order and possibly many at once
+    using PortHandler = void (*)(void* context, const uint8_t* data, size_t size);
+
+    // When a port's handler gets what out wrote
+    enum class Buffering : uint8_t {
+        Full, // When the buffer fills or is flushed
+        Line, // Also as soon as a newline is written
+        None // After every byte, for ports whose effect must not lag behind
+    };
+
+    // Why the VM last stopped for a debugger
+    enum class Stop : uint8_t {
+        None, // Not for the debugger: hlt, a fault or the end of the budget
+        Breakpoint, // Before running the instruction at pc
+        Watchpoint // After an instruction stored to watch_address()
+    };
+
+    // Debugger register numbers past the register file (0-255)
+    static const unsigned DEBUG_PC = NUM_REGISTERS;
+    static const unsigned DEBUG_SP = NUM_REGISTERS + 1;
+    static const unsigned DEBUG_FLAGS = NUM_REGISTERS + 2; // e, l, m in bits 0-2
+    static const unsigned DEBUG_REGISTERS = NUM_REGISTERS + 3;
+
+private:
+    struct Port {
+        PortHandler handler; // nullptr drops the bytes
+        void* context;
+        Buffering buffering;
+    };
+
+    // Maps virtual cycles to wall time in a throttled run()
+    struct Pace {
+        std::chrono::steady_clock::time_point start;
+        uint64_t first_cycle;
+        double frequency_hz;
+
+        std::chrono::steady_clock::time_point time_at(uint64_t cycle) const {
+            std::chrono::duration<double> offset((cycle - first_cycle) / frequency_hz);
+            return start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset);
+        }
+
+        // Carry on from cycle at time, after waiting on the host while no
+        // virtual time passed
+        void resume(uint64_t cycle, std::chrono::steady_clock::time_point time) {
+            start = time;
+            first_cycle = cycle;
+        }
+    };
+
+    // Instruction bodies in execute_until(); mov and the ALU opcodes share Alu.
+    // CmpJl..CmpJe are a cmp fused with the conditional jump right after it.
+    enum class Handler : uint8_t {
+        Nop, Out, In, Lea, Alu, Ret, Cal, Jmp, Jl, Jnl, Jnm, Jm, Jne, Je,
+        Cmp, CmpJl, CmpJnl, CmpJnm, CmpJm, CmpJne, CmpJe,
+        Int, Iret, Push, Pop, BlockCopy, BlockCompare, TestAndSet, CompareSwap, Trap, Hlt, BadMode, Unknown,
+        Count
+    };
+
+    struct DecodedInstruction;
+    using AluHandler = bool (*)(VirtualMachine&, const DecodedInstruction&);
+
+    // The instruction at one address with its operand bytes already read and
+    // the mode byte split into source (low) and destination (high) nibbles.
+    // Kept at 16 bytes so indexing the cache stays a shift.
+    struct DecodedInstruction {
+        AluHandler alu; // Mode-specialized body for Handler::Alu
+        Handler op;
+        uint8_t opcode;
+        uint8_t src, dst; // Addressing modes 0–3
+        uint8_t a, b; // Operands in encoding order
+        uint8_t length; // Bytes including the opcode
+        bool valid;
+    };
+
+    // Guest state lives inline in the VM (no heap blocks to chase); the
+    // layout mirrors CoreState
+    std::array<uint8_t, MEMORY_SIZE> memory; // 256 bytes of RAM
+    std::array<uint8_t, NUM_REGISTERS> registers; // Register file (r1–r4, e1–e4, x1–x4/l1–l4)
+    uint8_t pc; // Program counter (8-bit address)
+    uint8_t sp; // Stack pointer
+    bool running; // VM state
+    bool flag_equal, flag_less, flag_more; // Comparison flags
+    Fault fault; // Why the VM last stopped, if not hlt
+    uint8_t fault_pc; // Address of the instruction that raised fault
+
+    // Interrupt controller. Until a vector table address is written to
+    // PORT_IRQ_TABLE it is off: int does nothing and hlt stops for good.
+    TimerWheel timers; // One timer per line 0 to TIMER_COUNT - 1, keyed on cycles
+    std::array<uint8_t, TIMER_COUNT> timer_exponents; // Period 2^n cycles, 0 when stopped
+    uint8_t timers_written; // Timers set through PORT_TIMER but not rearmed yet
+    uint8_t irq_table; // The handler of line n is at memory[irq_table + n]
+    uint8_t irq_mask; // Hardware lines allowed to interrupt
+    uint8_t irq_pending; // Timer lines that fired and were not delivered yet
+    bool irq_on;
+    bool irq_in_service; // In a handler: hardware interrupts wait for iret
+    bool irq_recheck; // Controller state changed: end the slice after this instruction
+    bool waiting; // Halted until an interrupt arrives
+    uint64_t interrupts; // Delivered, hardware and int
+    uint64_t idle_cycles; // Cycles spent waiting
+
+    ClockConfig clock;
+    uint64_t cycles; // Virtual time, independent of host speed
+    uint64_t instructions; // Instructions retired
+    uint64_t fused; // Instructions retired inside a fused handler, without a dispatch of their own
+    double host_seconds; // Wall time spent inside run()
+
+    std::istream* input; // Where in reads from
+    const uint8_t* input_bytes; // Read by in instead of input when set
+    size_t input_size, input_used;
+    bool input_replay; // input_bytes is an input log to replay
+    uint8_t replay_repeat; // Repeats left of the record before the Repeat being replayed
+    std::ostream* input_log; // Gets a record of everything the guest learns from input
+    std::array<uint8_t, 2> last_record; // Last record logged, while a Repeat may follow it
+    bool repeatable; // last_record is set
+    uint8_t repeat_run; // Repeats of last_record not logged yet
+    InputQueue* input_queue; // Read by in instead of input when set
+    uint64_t input_poll_at; // Cycle count at which line 4 is next sampled
+    bool input_raised; // Line 4 as last sampled
+    std::ostream* output; // Where out writes to
+    SimpleIO* device; // Drawing target for out ports, nullptr to skip drawing
+
+    // Bytes written by out, all for out_port, not yet handed to its handler.
+    // Writing to another port flushes first, so ports see bytes in program order.
+    std::array<Port, 256> ports;
+    std::array<uint8_t, OUT_BUFFER_SIZE> out_buffer;
+    size_t out_used;
+    size_t out_limit; // Flush once this many bytes are buffered
+    uint8_t out_port;
+
+    int verbosity;
+
+    std::array<DecodedInstruction, MEMORY_SIZE> decode_cache;
+    std::array<uint8_t, MEMORY_SIZE> code_map; // Cached instructions (and JIT blocks) covering each byte
+
+    // Debugger state. Breakpoints are patched into the decoded code rather
+    // than memory: decode() reads TRAP_OPCODE there, so guest loads see the
+    // real byte and nothing is checked per instruction. A watched byte holds
+    // an extra count in code_map, which routes stores to it through
+    // invalidate_code() on both engines.
+    std::array<bool, MEMORY_SIZE> breakpoints;
+    std::array<bool, MEMORY_SIZE> watchpoints;
+    Stop stop;
+    uint8_t watched; // Address of the store behind Stop::Watchpoint
+
+    // Memory operands go through data_bank, the selected bank: memory itself for
+    // bank 0, else a slice of bank_store. Kept as a pointer so the unbanked
+    // path costs the same as indexing memory.
+    std::vector<uint8_t> bank_store; // Banks 1 and up
+    size_t bank_count;
+    uint8_t* data_bank;
+    const uint8_t* bank_code_map; // code_map for bank 0
+    SharedMemory* shared; // Bank 0 of memory operands on the cores of a multi-core guest
+    uint8_t core_id;
+    uint8_t mail_target; // Core PORT_MAIL_SEND writes to
+    uint8_t* coverage; // Edge bitmap of COVERAGE_BYTES, nullptr when not tracing
+    uint8_t coverage_prev; // pc of the last instruction traced
+#if NIGG8_PROFILE
+    Profiler* profiler; // Fed by the interpreter when set
+#endif
+#if NIGG8_JIT
+    std::unique_ptr<JitCompiler> jit; // Set when running on Engine::Jit
+#endif
+
+public:
+    VirtualMachine() : memory(), registers(),
+                       pc(0), sp(0xff), running(false),
+                       flag_equal(false), flag_less(false), flag_more(false),
+                       fault(Fault::None), fault_pc(0),
+                       timers(TIMER_COUNT), timer_exponents(), timers_written(0), irq_table(0), irq_mask(0), irq_pending(0),
+                       irq_on(false), irq_in_service(false), irq_recheck(false), waiting(false), interrupts(0), idle_cycles(0),
+                       cycles(0), instructions(0), fused(0), host_seconds(0.0),
+                       input(&std::cin), input_bytes(nullptr), input_size(0), input_used(0), input_replay(false),
+                       replay_repeat(0), input_log(nullptr), last_record(), repeatable(false), repeat_run(0),
+                       input_queue(nullptr), input_poll_at(0), input_raised(false),
+                       output(&std::cout), device(&io),
+                       ports(), out_used(0), out_limit(OUT_BUFFER_SIZE), out_port(PORT_PRINT),
+                       verbosity(0),
+                       decode_cache(), code_map(), breakpoints(), watchpoints(), stop(Stop::None), watched(0), bank_count(1), data_bank(memory.data()), bank_code_map(code_map.data()),
+                       shared(nullptr), core_id(0), mail_target(0), coverage(nullptr), coverage_prev(0) {
+#if NIGG8_PROFILE
+        profiler = nullptr;
+#endif
+        register_port(PORT_PRINT, print_port, this, Buffering::Line);
+        register_port(PORT_DRAW_RECT, draw_rect_port, this);
+        register_port(PORT_DRAW_CIRCLE, draw_circle_port, this);
+        register_port(PORT_DRAW_LINE, draw_line_port, this);
+        register_port(PORT_IRQ_TABLE, irq_table_port, this, Buffering::None);
+        register_port(PORT_IRQ_MASK, irq_mask_port, this, Buffering::None);
+        register_port(PORT_TIMER, timer_port, this, Buffering::None);
+        register_port(PORT_MAIL_SEND, mail_send_port, this, Buffering::None);
+        register_port(PORT_MAIL_TARGET, mail_target_port, this, Buffering::None);
+    }
+
+    // Ports hold pointers back to this VM
+    VirtualMachine(const VirtualMachine&) = delete;
+    VirtualMachine& operator=(const VirtualMachine&) = delete;
+
+    // Route out to a port through handler; nullptr makes the port drop its bytes
+    void register_port(uint8_t port, PortHandler handler, void* context, Buffering buffering = Buffering::Full) {
+        flush_output();
+        ports[port] = { handler, context, buffering };
+    }
+
+    // Ports of the interrupt controller, to keep when dropping guest output
+    static bool interrupt_port(uint8_t port) {
+        return port >= PORT_IRQ_TABLE && port <= PORT_TIMER;
+    }
+
+    // Back memory operands with count 256-byte banks, selected by writing the
+    // bank number to port 4 (modulo count). Bank 0 is the main memory, which
+    // code and the stack always use, so 1 (the default) is plain memory.
+    void set_banks(size_t count) {
+        if (count == 0 || count > 256) {
+            throw std::runtime_error("Bank count must be between 1 and 256");
+        }
+        if (shared && count > 1) {
+            throw std::runtime_error("Memory banks are not available on multi-core guests");
+        }
+        bank_store.assign((count - 1) * MEMORY_SIZE, 0);
+        bank_count = count;
+        select_bank(0);
+        if (count > 1) {
+            register_port(PORT_BANK, bank_port, this, Buffering::None);
+        } else {
+            register_port(PORT_BANK, nullptr, nullptr);
+        }
+    }
+
+    // Make this VM core id of a multi-core guest: memory operands (and mcpy,
+    // mcmp, tas and cas) address the shared memory, while code, the stack and
+    // the interrupt vector table stay in memory, private to the core. Cores
+    // see each other's stores but never run them as code. The mailbox ports
+    // reach the other cores. nullptr makes it a lone core again.
+    void join(SharedMemory* memory_shared, uint8_t id) {
+        if (memory_shared && bank_count > 1) {
+            throw std::runtime_error("Memory banks are not available on multi-core guests");
+        }
+        shared = memory_shared;
+        core_id = shared ? id : 0;
+        mail_target = shared ? static_cast<uint8_t>((id + 1) % shared->cores()) : 0;
+        select_bank(0);
+    }
+
+    // Buffer up to bytes of out before handing them on; 1 disables buffering
+    void set_output_buffer(size_t bytes) {
+        if (bytes == 0 || bytes > OUT_BUFFER_SIZE) {
+            throw std::runtime_error("Output buffer must be between 1 and " + std::to_string(OUT_BUFFER_SIZE) + " bytes");
+        }
+        flush_output();
+        out_limit = bytes;
+    }
+
+    // Hand everything buffered by out to its port
+    void flush_output() {
+        if (out_used == 0) return;
+        const Port& p = ports[out_port];
+        size_t size = out_used;
+        out_used = 0;
+        if (p.handler) p.handler(p.context, out_buffer.data(), size);
+    }
+
+    // Redirect guest I/O, e.g. to give each VM of a batch its own streams
+    void set_io(std::istream& in, std::ostream& out, SimpleIO* display) {
+        flush_output();
+        input = &in;
+        output = &out;
+        device = display;
+    }
+
+    // Make in read from queue, parking while it is empty, instead of the input
+    // stream; nullptr goes back to the stream. set_input_bytes() takes precedence.
+    void set_input_queue(InputQueue* queue) {
+        input_queue = queue;
+    }
+
+    // Where in has got to in the bytes given to set_input_bytes() or
+    // replay_input()
+    struct InputPosition {
+        size_t used;
+        uint8_t repeat; // Inside a Repeat record
+    };
+    InputPosition input_position() const { return { input_used, replay_repeat }; }
+    void seek_input(InputPosition position) {
+        input_used = std::min(position.used, input_size);
+        replay_repeat = position.repeat;
+    }
+
+    // What the guest learns from host input, each a record of the input log:
+    // the kind, then the value (8 bytes little-endian for Wake, else one).
+    // The in values and port 1 reads; Repeat n stands for n more copies of the
+    // (two-byte) record before it, so a guest polling port 1 in a loop does
+    // not fill the log. Then samples of line 4, whether input may still come
+    // for a hlt and the cycles a wait lasted before input ended it.
+    enum class Observation : uint8_t { In, Status, Repeat, Line, Open, Wake };
+
+    // Append a record of every observation to log, so the run can be replayed
+    // with replay_input(); nullptr stops, after writing what is pending
+    void record_input(std::ostream* log) {
+        if (input_log) flush_repeat();
+        input_log = log;
+        repeatable = false;
+    }
+
+    // Make the guest see what a log written through record_input() holds
+    // instead of host input. Past its end, input has ended; a record that
+    // does not match what the run asks for is an error. data must outlive
+    // the runs using it; nullptr goes back to the input stream.
+    void replay_input(const uint8_t* data, size_t size) {
+        set_input_bytes(data, size);
+        input_replay = data != nullptr;
+    }
+
+    static const size_t COVERAGE_BYTES = MEMORY_SIZE * MEMORY_SIZE / 8; // One bit per edge
+
+    // Make in read from data (0 once it runs out) instead of the input stream;
+    // nullptr goes back to the stream. data must outlive the runs using it.
+    void set_input_bytes(const uint8_t* data, size_t size) {
+        input_bytes = data;
+        input_size = size;
+        input_used = 0;
+        input_replay = false;
+        replay_repeat = 0;
+    }
+
+    // Record each executed (previous pc, pc) pair as bit prev * 256 + pc of
+    // bitmap, which holds COVERAGE_BYTES bytes. Tracing runs on the
+    // interpreter; nullptr turns it off.
+    void set_coverage(uint8_t* bitmap) {
+        coverage = bitmap;
+        coverage_prev = 0;
+    }
+
+#if NIGG8_PROFILE
+    // Profile everything run from now on into p, starting at the current pc
+    // (so after load_program). Profiling runs on the interpreter; nullptr
+    // turns it off.
+    void set_profiler(Profiler* p) {
+        profiler = p;
+        if (p) p->start(pc, instructions);
+    }
+
+    // Bring the profiler's counters up to date before reading them
+    void finish_profile() {
+        if (!profiler) return;
+        for (size_t i = 0; i < MEMORY_SIZE; ++i) {
+            if (decode_cache[i].valid) settle_profile(static_cast<uint8_t>(i));
+        }
+        profiler->finish(instructions);
+    }
+#endif
+
+    void set_clock(const ClockConfig& config) {
+        if (config.mode == ClockMode::Throttled && !(config.frequency_hz > 0.0)) {
+            throw std::runtime_error("Clock frequency must be positive");
+        }
+        clock = config;
+    }
+
+    void set_engine(Engine engine) {
+#if NIGG8_JIT
+        if (engine == Engine::Jit) {
+            if (!jit) jit.reset(new JitCompiler(memory.data(), registers.data(), code_map.data(), breakpoints.data()));
+        } else {
+            jit.reset();
+        }
+#else
+        if (engine == Engine::Jit) {
+            throw std::runtime_error("JIT is not supported on this host");
+        }
+#endif
+    }
+
+    uint8_t program_counter() const { return pc; }
+    uint64_t cycle_count() const { return cycles; }
+    uint64_t instruction_count() const { return instructions; }
+    uint8_t fault_address() const { return fault_pc; } // Instruction behind the last fault
+    Stop stop_reason() const { return stop; }
+    uint8_t watch_address() const { return watched; }
+
+    // Stop before running the instruction at addr, on either engine. Setting
+    // one only drops the code cached over addr, and runs cost nothing extra
+    // until it is reached.
+    void set_breakpoint(uint8_t addr, bool on) {
+        if (breakpoints[addr] == on) return;
+        breakpoints[addr] = on;
+        drop_code(addr);
+    }
+
+    // Stop after any instruction that stores to addr in main memory (bank 0)
+    void set_watchpoint(uint8_t addr, bool on) {
+        if (watchpoints[addr] == on) return;
+        watchpoints[addr] = on;
+        if (on) ++code_map[addr];
+        else --code_map[addr];
+    }
+
+    // Memory as the guest sees it, for a debugger; breakpoints do not show
+    uint8_t peek(uint8_t addr) const { return memory[addr]; }
+
+    // Store from outside the guest: cached code is dropped as for a guest
+    // store, but watchpoints do not fire
+    void poke(uint8_t addr, uint8_t value) {
+        memory[addr] = value;
+        if (code_map[addr]) drop_code(addr);
+    }
+
+    // Register id of the register file, or DEBUG_PC, DEBUG_SP or DEBUG_FLAGS
+    uint8_t debug_register(unsigned id) const {
+        switch (id) {
+            case DEBUG_PC: return pc;
+            case DEBUG_SP: return sp;
+            case DEBUG_FLAGS: return static_cast<uint8_t>(flag_equal | flag_less << 1 | flag_more << 2);
+            default:
+                if (id >= NUM_REGISTERS) throw std::runtime_error("No register " + std::to_string(id));
+                return registers[id];
+        }
+    }
+
+    void set_debug_register(unsigned id, uint8_t value) {
+        switch (id) {
+            case DEBUG_PC: pc = value; break;
+            case DEBUG_SP: sp = value; break;
+            case DEBUG_FLAGS:
+                flag_equal = value & 1;
+                flag_less = (value >> 1) & 1;
+                flag_more = (value >> 2) & 1;
+                break;
+            default:
+                if (id >= NUM_REGISTERS) throw std::runtime_error("No register " + std::to_string(id));
+                registers[id] = value;
+                break;
+        }
+    }
+
+    // The state as core_step() sees it, to check the engines against it
+    CoreState core_state() const {
+        CoreState s;
+        s.memory = memory;
+        s.registers = registers;
+        s.pc = pc;
+        s.sp = sp;
+        s.flag_equal = flag_equal;
+        s.flag_less = flag_less;
+        s.flag_more = flag_more;
+        s.running = running;
+        s.fault = fault;
+        s.fault_pc = fault_pc;
+        s.instructions = instructions;
+        s.cycles = cycles;
+        return s;
+    }
+
+    // One line: pc, sp, the flags that are set (e, l, m) and the named registers
+    void dump_state(std::ostream& out) const {
+        static const char HEX[] = "0123456789abcdef";
+        static const char BANKS[] = { 'r', 'e', 'x' };
+        std::string line = "pc ";
+        line += HEX[pc >> 4];
+        line += HEX[pc & 0xf];
+        line += " sp ";
+        line += HEX[sp >> 4];
+        line += HEX[sp & 0xf];
+        line += " flags ";
+        line += flag_equal ? 'e' : '-';
+        line += flag_less ? 'l' : '-';
+        line += flag_more ? 'm' : '-';
+        for (int bank = 0; bank < 3; ++bank) {
+            for (int i = 1; i <= 4; ++i) {
+                uint8_t value = registers[bank << 4 | i];
+                line += ' ';
+                line += BANKS[bank];
+                line += static_cast<char>('0' + i);
+                line += ' ';
+                line += HEX[value >> 4];
+                line += HEX[value & 0xf];
+            }
+        }
+        out << line << '\n';
+    }
+
+    // Load program into memory
+    void load_program(const ProgramImage& program) {
+        std::copy(program.memory.begin(), program.memory.end(), memory.begin());
+        invalidate_all();
+        std::fill(bank_store.begin(), bank_store.end(), 0);
+        select_bank(0);
+        reset_interrupts();
+        pc = program.entry;
+        sp = program.stack_pointer;
+        coverage_prev = 0;
+
+        // Debug: Print out loaded program
+        if (verbosity > 0) {
+            StreamFormat format(std::cerr);
+            for (size_t i = 0; i < program.size; ++i) {
+                std::cerr << std::hex << std::setw(2) << std::setfill('0') << (int)program.memory[i] << " ";
+            }
+            std::cerr << std::dec << std::endl;
+        }
+    }
+
+    // 1 or more dumps loaded programs to stderr
+    void set_verbosity(int level) {
+        verbosity = level;
+    }
+
+    // Architectural state: memory, registers, pc, sp, flags, running, fault and
+    // the interrupt controller, whose timers (and the next sample of line 4)
+    // are kept as cycles left so they resume relative to the cycle count at
+    // restore. Banks other than 0 and the bank selection are not part of it.
+    // Memory and registers are kept in 16-byte pages that snapshots share:
+    // a snapshot taken against a parent reuses every parent page that still
+    // matches, so forking after a short run only copies what the run wrote.
+    class Snapshot {
+    public:
+        static const size_t PAGE_SIZE = 16;
+        static const size_t MEMORY_PAGES = MEMORY_SIZE / PAGE_SIZE;
+        static const size_t PAGE_COUNT = (MEMORY_SIZE + NUM_REGISTERS) / PAGE_SIZE; // Memory pages first
+        using Page = std::array<uint8_t, PAGE_SIZE>;
+
+        // Power-on state: everything zero, sp at the top
+        Snapshot() {
+            pages.fill(zero_page());
+        }
+
+        // Compact blob: "N8SS", version, pc, sp, flag bits, fault, a bitmap of the
+        // pages that are not all zero (little-endian), then those pages and the
+        // interrupt controller: flag bits, vector table, mask, pending lines,
+        // then per timer its exponent and cycles left (8 bytes little-endian),
+        // then the cycles until line 4 is next sampled (8 bytes)
+        std::vector<uint8_t> serialize() const {
+            uint32_t present = 0;
+            for (size_t i = 0; i < PAGE_COUNT; ++i) {
+                if (pages[i] != zero_page()) present |= 1u << i;
+            }
+            std::vector<uint8_t> blob(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + sizeof(SNAPSHOT_MAGIC));
+            blob.push_back(SNAPSHOT_VERSION);
+            blob.push_back(pc);
+            blob.push_back(sp);
+            blob.push_back(static_cast<uint8_t>(flag_equal | flag_less << 1 | flag_more << 2 | running << 3));
+            blob.push_back(static_cast<uint8_t>(fault));
+            for (int i = 0; i < 4; ++i) {
+                blob.push_back(static_cast<uint8_t>(present >> (8 * i)));
+            }
+            for (size_t i = 0; i < PAGE_COUNT; ++i) {
+                if (present & (1u << i)) blob.insert(blob.end(), pages[i]->begin(), pages[i]->end());
+            }
+            blob.push_back(static_cast<uint8_t>(irq_on | irq_in_service << 1 | waiting << 2 | input_raised << 3));
+            blob.push_back(irq_table);
+            blob.push_back(irq_mask);
+            blob.push_back(irq_pending);
+            for (size_t t = 0; t < TIMER_COUNT; ++t) {
+                blob.push_back(timer_exponents[t]);
+                for (int i = 0; i < 8; ++i) {
+                    blob.push_back(static_cast<uint8_t>(timer_left[t] >> (8 * i)));
+                }
+            }
+            for (int i = 0; i < 8; ++i) {
+                blob.push_back(static_cast<uint8_t>(input_poll_left >> (8 * i)));
+            }
+            return blob;
+        }
+
+        static Snapshot deserialize(const uint8_t* data, size_t size) {
+            if (size < HEADER_SIZE || std::memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+                throw std::runtime_error("Not a snapshot");
+            }
+            if (data[4] != SNAPSHOT_VERSION && data[4] != 1) { // Version 1 had no interrupt controller
+                throw std::runtime_error("Unsupported snapshot version: " + std::to_string(data[4]));
+            }
+            if (data[8] > static_cast<uint8_t>(Fault::StackOverflow)) {
+                throw std::runtime_error("Corrupt snapshot");
+            }
+            Snapshot s;
+            s.pc = data[5];
+            s.sp = data[6];
+            s.flag_equal = data[7] & 1;
+            s.flag_less = (data[7] >> 1) & 1;
+            s.flag_more = (data[7] >> 2) & 1;
+            s.running = (data[7] >> 3) & 1;
+            s.fault = static_cast<Fault>(data[8]);
+            uint32_t present = data[9] | data[10] << 8 | data[11] << 16 | static_cast<uint32_t>(data[12]) << 24;
+            size_t offset = HEADER_SIZE;
+            for (size_t i = 0; i < PAGE_COUNT; ++i) {
+                if (!(present & (1u << i))) continue;
+                if (size - offset < PAGE_SIZE) {
+                    throw std::runtime_error("Truncated snapshot");
+                }
+                auto page = std::make_shared<Page>();
+                std::copy(data + offset, data + offset + PAGE_SIZE, page->begin());
+                s.pages[i] = std::move(page);
+                offset += PAGE_SIZE;
+            }
+            if (data[4] != 1) {
+                if (size - offset < CONTROLLER_SIZE) {
+                    throw std::runtime_error("Truncated snapshot");
+                }
+                const uint8_t* c = data + offset;
+                s.irq_on = c[0] & 1;
+                s.irq_in_service = (c[0] >> 1) & 1;
+                s.waiting = (c[0] >> 2) & 1;
+                s.input_raised = (c[0] >> 3) & 1;
+                s.irq_table = c[1];
+                s.irq_mask = c[2];
+                s.irq_pending = c[3];
+                for (size_t t = 0; t < TIMER_COUNT; ++t) {
+                    const uint8_t* timer = c + 4 + t * 9;
+                    s.timer_exponents[t] = timer[0];
+                    s.timer_left[t] = 0;
+                    for (int i = 0; i < 8; ++i) {
+                        s.timer_left[t] |= static_cast<uint64_t>(timer[1 + i]) << (8 * i);
+                    }
+                }
+                const uint8_t* poll = c + 4 + TIMER_COUNT * 9;
+                for (int i = 0; i < 8; ++i) {
+                    s.input_poll_left |= static_cast<uint64_t>(poll[i]) << (8 * i);
+                }
+                offset += CONTROLLER_SIZE;
+            }
+            if (offset != size) {
+                throw std::runtime_error("Corrupt snapshot");
+            }
+            return s;
+        }
+
+        static Snapshot deserialize(const std::vector<uint8_t>& blob) {
+            return deserialize(blob.data(), blob.size());
+        }
+
+        // Pages held by this snapshot that other does not share
+        size_t unshared_pages(const Snapshot& other) const {
+            size_t count = 0;
+            for (size_t i = 0; i < PAGE_COUNT; ++i) {
+                if (pages[i] != other.pages[i]) ++count;
+            }
+            return count;
+        }
+
+    private:
+        friend class VirtualMachine;
+
+        static constexpr uint8_t SNAPSHOT_MAGIC[4] = { 'N', '8', 'S', 'S' };
+        static constexpr uint8_t SNAPSHOT_VERSION = 2;
+        static constexpr size_t HEADER_SIZE = 13;
+        static constexpr size_t CONTROLLER_SIZE = 4 + TIMER_COUNT * 9 + 8;
+
+        // One page of zeros shared by everything, so empty state costs nothing
+        static const std::shared_ptr<const Page>& zero_page() {
+            static const std::shared_ptr<const Page> zero = std::make_shared<Page>();
+            return zero;
+        }
+
+        std::array<std::shared_ptr<const Page>, PAGE_COUNT> pages;
+        uint8_t pc = 0, sp = 0xff;
+        bool flag_equal = false, flag_less = false, flag_more = false;
+        bool running = false;
+        Fault fault = Fault::None;
+        bool irq_on = false, irq_in_service = false, waiting = false;
+        uint8_t irq_table = 0, irq_mask = 0, irq_pending = 0;
+        std::array<uint8_t, TIMER_COUNT> timer_exponents{};
+        std::array<uint64_t, TIMER_COUNT> timer_left{}; // Cycles until due, TimerWheel::NEVER when stopped
+        bool input_raised = false;
+        uint64_t input_poll_left = 0; // Cycles until line 4 is sampled
+    };
+
+    Snapshot snapshot() const {
+        return capture(nullptr);
+    }
+
+    // Fork: like snapshot(), but pages that still match parent are shared with it
+    Snapshot snapshot(const Snapshot& parent) const {
+        return capture(&parent);
+    }
+
+    // Put the VM back into a snapshotted state. Only memory that differs is
+    // rewritten, so cached and compiled code survives a restore of the same code.
+    void restore(const Snapshot& s) {
+        for (size_t i = 0; i < Snapshot::MEMORY_PAGES; ++i) {
+            const uint8_t* page = s.pages[i]->data();
+            uint8_t* current = memory.data() + i * Snapshot::PAGE_SIZE;
+            if (std::memcmp(page, current, Snapshot::PAGE_SIZE) == 0) continue;
+            for (size_t k = 0; k < Snapshot::PAGE_SIZE; ++k) {
+                if (current[k] != page[k]) write_memory(static_cast<uint8_t>(i * Snapshot::PAGE_SIZE + k), page[k]);
+            }
+        }
+        for (size_t i = Snapshot::MEMORY_PAGES; i < Snapshot::PAGE_COUNT; ++i) {
+            std::memcpy(registers.data() + (i - Snapshot::MEMORY_PAGES) * Snapshot::PAGE_SIZE, s.pages[i]->data(), Snapshot::PAGE_SIZE);
+        }
+        pc = s.pc;
+        sp = s.sp;
+        flag_equal = s.flag_equal;
+        flag_less = s.flag_less;
+        flag_more = s.flag_more;
+        running = s.running;
+        fault = s.fault;
+        coverage_prev = 0;
+        reset_interrupts();
+        irq_on = s.irq_on;
+        irq_in_service = s.irq_in_service;
+        waiting = s.waiting;
+        irq_table = s.irq_table;
+        irq_mask = s.irq_mask;
+        irq_pending = s.irq_pending;
+        timer_exponents = s.timer_exponents;
+        for (size_t t = 0; t < TIMER_COUNT; ++t) {
+            if (s.timer_left[t] != TimerWheel::NEVER) timers.schedule(t, cycles + s.timer_left[t]);
+        }
+        input_raised = s.input_raised;
+        input_poll_at = cycles + s.input_poll_left;
+    }
+
+    // Return to power-on state with program loaded, so one VM can serve many runs
+    void reset(const ProgramImage& program) {
+        // Only bytes that differ from the last run drop cached code, so rerunning
+        // the same program keeps its decoded and compiled instructions
+        for (size_t i = 0; i < MEMORY_SIZE; ++i) {
+            if (memory[i] != program.memory[i]) {
+                write_memory(static_cast<uint8_t>(i), program.memory[i]);
+            }
+        }
+        std::fill(registers.begin(), registers.end(), 0);
+        std::fill(bank_store.begin(), bank_store.end(), 0);
+        select_bank(0);
+        pc = program.entry;
+        sp = program.stack_pointer;
+        running = false;
+        flag_equal = flag_less = flag_more = false;
+        fault = Fault::None;
+        cycles = 0;
+        instructions = 0;
+        fused = 0;
+        interrupts = 0;
+        idle_cycles = 0;
+        host_seconds = 0.0;
+        reset_interrupts();
+        out_used = 0;
+        coverage_prev = 0;
+    }
+
+    // Run without throttling until hlt or until max_cycles more cycles have
+    // elapsed. Returns false if the budget ran out first.
+    bool run_for(uint64_t max_cycles) {
+        running = true;
+        fault = Fault::None; // A reused VM must not report the last run's fault
+        stop = Stop::None;
+        auto start = std::chrono::steady_clock::now();
+        const uint64_t limit = max_cycles > UINT64_MAX - cycles ? UINT64_MAX : cycles + max_cycles;
+        try {
+            while (running && cycles < limit) {
+                execute(limit);
+            }
+        } catch (...) {
+            flush_output();
+            throw;
+        }
+        flush_output();
+        host_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (fault != Fault::None) {
+            throw std::runtime_error(fault_message());
+        }
+        return !running;
+    }
+
+    // Run the instruction at pc on the interpreter, stepping over a breakpoint
+    // there, and take an interrupt that came due. Returns false once the VM
+    // stopped (hlt, or a watchpoint with stop_reason()).
+    bool step() {
+        const uint8_t at = pc;
+        const bool patched = breakpoints[at];
+        set_breakpoint(at, false);
+        running = true;
+        stop = Stop::None;
+        fault = Fault::None;
+        try {
+            if (waiting) {
+                idle(cycles + 1, nullptr);
+            } else {
+                execute_until(cycles + 1);
+                if (irq_on) service_interrupts();
+                else irq_recheck = false;
+            }
+        } catch (...) {
+            set_breakpoint(at, patched);
+            flush_output();
+            throw;
+        }
+        set_breakpoint(at, patched);
+        flush_output();
+        if (fault != Fault::None) {
+            throw std::runtime_error(fault_message());
+        }
+        return running;
+    }
+
+    // Run the VM until hlt, paced by the configured clock
+    void run() {
+        running = true;
+        fault = Fault::None;
+        stop = Stop::None;
+        auto start = std::chrono::steady_clock::now();
+
+        try {
+            if (clock.mode == ClockMode::Turbo) {
+                // Virtual time is not tied to the wall clock, so waiting for a
+                // timer takes no time at all; only waiting for input blocks
+                while (running) {
+                    if (waiting) idle(TimerWheel::NEVER, nullptr);
+                    else execute(cycles + TURBO_SLICE);
+                    flush_output();
+                    if (device) device->present_if_due();
+                }
+            } else {
+                // Deadlines are derived from virtual cycles rather than measured per
+                // instruction, so sleep rounding never accumulates into drift.
+                uint64_t batch = clock.batch_size;
+                if (batch == 0) {
+                    batch = static_cast<uint64_t>(clock.frequency_hz / BATCHES_PER_SECOND);
+                    if (batch == 0) batch = 1;
+                }
+                // A waiting guest sleeps until its next timer, waking at least
+                // once per virtual second to keep the display serviced
+                const uint64_t max_idle = std::max<uint64_t>(static_cast<uint64_t>(clock.frequency_hz), batch);
+                Pace pace = { start, cycles, clock.frequency_hz };
+                while (running) {
+                    if (waiting) idle(cycles + max_idle, &pace);
+                    else execute(cycles + batch);
+                    flush_output();
+                    if (device) device->present_if_due();
+                    std::this_thread::sleep_until(pace.time_at(cycles));
+                }
+            }
+        } catch (...) {
+            flush_output();
+            throw;
+        }
+
+        host_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (device) device->present();
+
+        if (fault != Fault::None) {
+            throw std::runtime_error(fault_message());
+        }
+    }
+
+    // Print achieved throughput for the time spent in run()
+    void report(std::ostream& out) const {
+        StreamFormat format(out);
+        double ips = host_seconds > 0.0 ? instructions / host_seconds : 0.0;
+        out << std::dec << "Executed " << instructions << " instructions (" << cycles << " cycles) in "
+            << std::fixed << std::setprecision(3) << host_seconds << " s, "
+            << std::setprecision(0) << ips << " instructions/s" << std::endl;
+        if (fused) {
+            out << "Fused " << fused << " cmp/jump pairs, saving " << std::setprecision(1)
+                << 100.0 * fused / instructions << "% of instruction dispatches" << std::endl;
+        }
+        if (interrupts || idle_cycles) {
+            out << "Delivered " << interrupts << " interrupts, idle for " << std::setprecision(1)
+                << (cycles ? 100.0 * idle_cycles / cycles : 0.0) << "% of cycles" << std::endl;
+        }
+    }
+
+private:
+    Snapshot capture(const Snapshot* parent) const {
+        Snapshot s;
+        for (size_t i = 0; i < Snapshot::PAGE_COUNT; ++i) {
+            const uint8_t* data = i < Snapshot::MEMORY_PAGES
+                ? memory.data() + i * Snapshot::PAGE_SIZE
+                : registers.data() + (i - Snapshot::MEMORY_PAGES) * Snapshot::PAGE_SIZE;
+            if (parent && std::memcmp(parent->pages[i]->data(), data, Snapshot::PAGE_SIZE) == 0) {
+                s.pages[i] = parent->pages[i];
+            } else if (std::memcmp(Snapshot::zero_page()->data(), data, Snapshot::PAGE_SIZE) != 0) {
+                auto page = std::make_shared<Snapshot::Page>();
+                std::copy(data, data + Snapshot::PAGE_SIZE, page->begin());
+                s.pages[i] = std::move(page);
+            }
+        }
+        s.pc = pc;
+        s.sp = sp;
+        s.flag_equal = flag_equal;
+        s.flag_less = flag_less;
+        s.flag_more = flag_more;
+        s.running = running;
+        s.fault = fault;
+        s.irq_on = irq_on;
+        s.irq_in_service = irq_in_service;
+        s.waiting = waiting;
+        s.irq_table = irq_table;
+        s.irq_mask = irq_mask;
+        s.irq_pending = irq_pending;
+        s.timer_exponents = timer_exponents;
+        for (size_t t = 0; t < TIMER_COUNT; ++t) {
+            const uint64_t due = timers.deadline(t);
+            s.timer_left[t] = due == TimerWheel::NEVER ? due : due - std::min(due, cycles);
+        }
+        s.input_raised = input_raised;
+        s.input_poll_left = input_poll_at - std::min(input_poll_at, cycles);
+        return s;
+    }
+
+    // Returns true when value reached port's handler right away, so that the
+    // handler may have changed VM state
+    bool write_port(uint8_t port, uint8_t value) {
+        if (out_used != 0 && port != out_port) flush_output();
+        out_port = port;
+        out_buffer[out_used++] = value;
+        const Buffering buffering = ports[port].buffering;
+        if (out_used >= out_limit || buffering == Buffering::None || (value == '\n' && buffering == Buffering::Line)) {
+            flush_output();
+            return true;
+        }
+        return false;
+    }
+
+    static void print_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        vm.output->write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+    }
+
+    static void draw_rect_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        if (!vm.device) return;
+        for (size_t i = 0; i < size; ++i) vm.device->draw_rect(50, 50, data[i], data[i], RGB(0, 0, 255));
+    }
+
+    static void draw_circle_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        if (!vm.device) return;
+        for (size_t i = 0; i < size; ++i) vm.device->draw_circle(100, 100, data[i], RGB(255, 0, 0));
+    }
+
+    static void draw_line_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        if (!vm.device) return;
+        for (size_t i = 0; i < size; ++i) vm.device->draw_line(10, 10, 10 + data[i], 10 + data[i], RGB(0, 255, 0));
+    }
+
+    // Fetch value based on addressing mode (low nibble of the mode byte)
+    uint8_t fetch_operand(uint8_t kind, uint8_t operand) const {
+        switch (kind) {
+            case 0: return operand; // Immediate
+            case 1: return registers[operand]; // Register
+            case 2: return SharedMemory::load(data_bank + operand); // Memory
+            default: return SharedMemory::load(data_bank + registers[operand]); // Register indirect
+        }
+    }
+
+    // Store value based on addressing mode (high nibble of the mode byte)
+    void store_operand(uint8_t kind, uint8_t dest, uint8_t value) {
+        switch (kind) {
+            case 0: break; // Immediate: nothing to store to
+            case 1: registers[dest] = value; break; // Register
+            case 2: write_data(dest, value); break; // Memory
+            default: write_data(registers[dest], value); break; // Register indirect
+        }
+    }
+
+    // Every guest store goes through here so stale decodes of the byte are dropped
+    void write_memory(uint8_t addr, uint8_t value) {
+        memory[addr] = value;
+        if (code_map[addr]) {
+            invalidate_code(addr);
+        }
+    }
+
+    // The stack grows down and sp points at the last value pushed: cal, push
+    // and interrupts store at --sp, ret, pop and iret read at sp++, so 0xff
+    // (the initial sp) is never a slot. Callers check sp first (0 is full,
+    // 0xff is empty). core_step() and the JIT's pop_value() follow the same
+    // convention.
+    void push_stack(uint8_t value) { write_memory(--sp, value); }
+    uint8_t pop_stack() { return memory[sp++]; }
+
+    // Store through a memory operand, into the selected bank. Other banks never
+    // hold code, so their bank_code_map is all zeros. Relaxed atomic, as the
+    // bank may be SharedMemory.
+    void write_data(uint8_t addr, uint8_t value) {
+        SharedMemory::store(data_bank + addr, value);
+        if (bank_code_map[addr]) {
+            invalidate_code(addr);
+        }
+    }
+
+    void select_bank(size_t bank) {
+        static const std::array<uint8_t, MEMORY_SIZE> no_code{};
+        bank %= bank_count;
+        if (bank == 0 && shared) {
+            data_bank = shared->data();
+            bank_code_map = no_code.data();
+        } else if (bank == 0) {
+            data_bank = memory.data();
+            bank_code_map = code_map.data();
+        } else {
+            data_bank = bank_store.data() + (bank - 1) * MEMORY_SIZE;
+            bank_code_map = no_code.data();
+        }
+    }
+
+    // What in reads from PORT_INPUT_STATUS: how many values in can read
+    // without waiting. For a plain stream that is only what it has buffered.
+    uint8_t input_status() const {
+        size_t count = 0;
+        if (input_bytes) {
+            count = input_size - input_used;
+        } else if (input_queue) {
+            count = input_queue->available();
+        } else if (input->rdbuf()) {
+            count = static_cast<size_t>(std::max<std::streamsize>(input->rdbuf()->in_avail(), 0));
+        }
+        return static_cast<uint8_t>(std::min<size_t>(count, 255));
+    }
+
+    // What in reads from the input ports: the next value (0 once input is
+    // exhausted) or, for PORT_INPUT_STATUS, input_status()
+    uint8_t read_input(bool status) {
+        if (status) {
+            return static_cast<uint8_t>(observe(Observation::Status, [&] { return input_status(); }, 0));
+        }
+        return static_cast<uint8_t>(observe(Observation::In, [&]() -> uint8_t {
+            uint8_t value = 0;
+            if (input_bytes) {
+                if (input_used < input_size) value = input_bytes[input_used++];
+            } else {
+                flush_output(); // Prompts must be visible before blocking on input
+                if (input_queue) value = input_queue->pop();
+                else *input >> value;
+            }
+            return value;
+        }, 0));
+    }
+
+    // host(), logged while recording; while replaying, the recorded value
+    // instead, or past_end once the log has run out
+    template <typename Host>
+    uint64_t observe(Observation kind, Host host, uint64_t past_end) {
+        if (input_replay) return replay_observation(kind, past_end);
+        const uint64_t value = host();
+        if (input_log) log_observation(kind, value);
+        return value;
+    }
+
+    // A record that matches the one before it only adds to a Repeat. After a
+    // Repeat the next record is written out again, so a Repeat always
+    // follows the record it repeats.
+    void log_observation(Observation kind, uint64_t value) {
+        const uint8_t record[2] = { static_cast<uint8_t>(kind), static_cast<uint8_t>(value) };
+        if (kind != Observation::Wake && repeatable && last_record[0] == record[0] && last_record[1] == record[1]) {
+            if (++repeat_run == 255) flush_repeat();
+            return;
+        }
+        flush_repeat();
+        input_log->put(static_cast<char>(kind));
+        for (int i = 0; i < (kind == Observation::Wake ? 8 : 1); ++i) {
+            input_log->put(static_cast<char>(value >> (8 * i)));
+        }
+        repeatable = kind != Observation::Wake;
+        last_record = { record[0], record[1] };
+    }
+
+    void flush_repeat() {
+        if (!repeat_run) return;
+        input_log->put(static_cast<char>(Observation::Repeat));
+        input_log->put(static_cast<char>(repeat_run));
+        repeat_run = 0;
+        repeatable = false;
+    }
+
+    uint64_t replay_observation(Observation kind, uint64_t past_end) {
+        if (!replay_repeat && input_used < input_size && input_bytes[input_used] == static_cast<uint8_t>(Observation::Repeat)) {
+            if (input_size - input_used < 2 || input_bytes[input_used + 1] == 0 || input_used < 2) {
+                throw std::runtime_error("Corrupt input log");
+            }
+            replay_repeat = input_bytes[input_used + 1];
+            input_used += 2;
+        }
+        if (replay_repeat) {
+            const uint8_t* repeated = input_bytes + input_used - 4; // The record before the Repeat
+            if (repeated[0] != static_cast<uint8_t>(kind)) diverged();
+            --replay_repeat;
+            return repeated[1];
+        }
+        if (input_used == input_size) return past_end;
+        if (input_bytes[input_used] != static_cast<uint8_t>(kind)) diverged();
+        const size_t size = kind == Observation::Wake ? 8 : 1;
+        if (input_size - input_used - 1 < size) {
+            throw std::runtime_error("Truncated input log");
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; ++i) value |= static_cast<uint64_t>(input_bytes[input_used + 1 + i]) << (8 * i);
+        input_used += 1 + size;
+        return value;
+    }
+
+    [[noreturn]] void diverged() const {
+        throw std::runtime_error("Replay diverged from the input log at offset " + std::to_string(input_used));
+    }
+
+    static void bank_port(void* context, const uint8_t* data, size_t size) {
+        static_cast<VirtualMachine*>(context)->select_bank(data[size - 1]);
+    }
+
+    // What in reads from the mailbox and core ports. A lone core has no one to
+    // hear from, so its mailbox stays empty.
+    uint8_t core_port(uint8_t port) {
+        switch (port) {
+            case PORT_MAIL_RECEIVE:
+                if (!shared) return 0;
+                flush_output(); // As for in, output must not wait behind a blocked receive
+                return shared->receive(core_id);
+            case PORT_MAIL_WAITING: return shared ? shared->waiting(core_id) : 0;
+            case PORT_CORE_ID: return core_id;
+            default: return static_cast<uint8_t>(shared ? shared->cores() : 1);
+        }
+    }
+
+    static void mail_send_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        if (!vm.shared) return;
+        for (size_t i = 0; i < size; ++i) vm.shared->send(vm.core_id, vm.mail_target, data[i]);
+    }
+
+    static void mail_target_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        if (vm.shared) vm.mail_target = static_cast<uint8_t>(data[size - 1] % vm.shared->cores());
+    }
+
+    // Instructions that overwrite all three flags and cannot fault
+    static bool writes_flags(Handler op) {
+        return op >= Handler::Cmp && op <= Handler::CmpJe;
+    }
+
+    // Bytes a cache entry depends on: its own, plus the jump's for a fused cmp
+    static uint8_t cover_length(const DecodedInstruction& d) {
+        return d.length + (d.op > Handler::Cmp && d.op <= Handler::CmpJe ? 2 : 0);
+    }
+
+    // Called for every store to a byte marked in code_map
+    void invalidate_code(uint8_t addr) {
+        if (watchpoints[addr]) watch_hit(addr);
+        drop_code(addr);
+    }
+
+    // Drop every cached instruction whose bytes cover addr
+    void drop_code(uint8_t addr) {
+        for (uint8_t back = 0; back < MAX_COVER_LENGTH; ++back) {
+            uint8_t start = static_cast<uint8_t>(addr - back);
+            DecodedInstruction& d = decode_cache[start];
+            const uint8_t cover = cover_length(d);
+            if (d.valid && cover > back) {
+#if NIGG8_PROFILE
+                if (profiler) settle_profile(start);
+#endif
+                d.valid = false;
+                for (uint8_t i = 0; i < cover; ++i) {
+                    --code_map[static_cast<uint8_t>(start + i)];
+                }
+            }
+        }
+#if NIGG8_JIT
+        if (jit) jit->invalidate(addr);
+#endif
+    }
+
+    void invalidate_all() {
+#if NIGG8_PROFILE
+        if (profiler) finish_profile();
+#endif
+        for (DecodedInstruction& d : decode_cache) {
+            d.valid = false;
+        }
+        // Rebuilt from scratch, so the JIT's counts are dropped, not uncounted
+        code_map.fill(0);
+#if NIGG8_JIT
+        if (jit) jit->forget();
+#endif
+        for (size_t i = 0; i < MEMORY_SIZE; ++i) {
+            if (watchpoints[i]) ++code_map[i];
+        }
+    }
+
+    // A store reached a watched byte: stop once the storing instruction is
+    // done. The interpreter only looks at its budget between instructions, so
+    // the cache is emptied instead, and the next dispatch goes through
+    // decode(), which hands out a one-shot Trap.
+    void watch_hit(uint8_t addr) {
+        stop = Stop::Watchpoint;
+        watched = addr;
+        running = false;
+        invalidate_all();
+    }
+
+    std::string fault_message() const {
+        switch (fault) {
+            case Fault::InvalidOperandMode: return "Invalid operand mode";
+            case Fault::InvalidDestinationMode: return "Invalid destination mode";
+            case Fault::UnknownOpcode: return "Unknown opcode: " + std::to_string(memory[fault_pc]);
+            case Fault::StackUnderflow: return "Stack underflow";
+            case Fault::StackOverflow: return "Stack overflow";
+            default: return "No fault";
+        }
+    }
+
+#if NIGG8_PROFILE
+    void settle_profile(uint8_t addr) {
+        const DecodedInstruction& d = decode_cache[addr];
+        profiler->settle(addr, d.opcode, d.length > 2 ? d.dst << 4 | d.src : -1);
+    }
+#endif
+
+    // Coverage and profiling hook into the interpreter, so they keep the JIT off
+    bool instrumented() const {
+#if NIGG8_PROFILE
+        if (profiler) return true;
+#endif
+        return coverage != nullptr;
+    }
+
+    void trap(Fault f, uint8_t at) {
+        fault = f;
+        fault_pc = at;
+        running = false;
+    }
+
+    // Compile-time counterparts of fetch_operand/store_operand
+    template <uint8_t Kind>
+    uint8_t fetch(uint8_t operand) const {
+        if constexpr (Kind == 0) return operand;
+        else if constexpr (Kind == 1) return registers[operand];
+        else if constexpr (Kind == 2) return SharedMemory::load(data_bank + operand);
+        else return SharedMemory::load(data_bank + registers[operand]);
+    }
+
+    template <uint8_t Kind>
+    void store(uint8_t dest, uint8_t value) {
+        if constexpr (Kind == 1) registers[dest] = value;
+        else if constexpr (Kind == 2) write_data(dest, value);
+        else if constexpr (Kind == 3) write_data(registers[dest], value);
+    }
+
+    // Operations behind Handler::Alu. All take (dest, src) and write dest;
+    // reads_dest/reads_src say which operands are actually fetched.
+    struct OpMov  { static const bool reads_dest = false, reads_src = true;  static uint8_t apply(uint8_t, uint8_t b) { return b; } };
+    struct OpAdd  { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return a + b; } };
+    struct OpSub  { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return a - b; } };
+    struct OpMul  { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return a * b; } };
+    struct OpDiv  { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return b == 0 ? 0 : a / b; } }; // Division by zero yields 0
+    struct OpAnd  { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return a & b; } };
+    struct OpOr   { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return a | b; } };
+    struct OpXor  { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return a ^ b; } };
+    struct OpNot  { static const bool reads_dest = true,  reads_src = false; static uint8_t apply(uint8_t a, uint8_t) { return ~a; } };
+    struct OpNor  { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return ~(a | b); } };
+    struct OpNand { static const bool reads_dest = true,  reads_src = true;  static uint8_t apply(uint8_t a, uint8_t b) { return ~(a & b); } };
+
+    // One instance per (operation, source mode, destination mode). Like the
+    // original opcodes, the source mode is also used to read the destination.
+    template <typename Op, uint8_t Src, uint8_t Dst>
+    static bool alu(VirtualMachine& vm, const DecodedInstruction& d) {
+        uint8_t a = 0, b = 0;
+        if constexpr (Op::reads_dest) a = vm.fetch<Src>(d.a);
+        if constexpr (Op::reads_src) b = vm.fetch<Src>(d.b);
+        vm.store<Dst>(d.a, Op::apply(a, b));
+        return true;
+    }
+
+    // The Alu handler traps with Fault::InvalidOperandMode on false
+    static bool alu_invalid_mode(VirtualMachine&, const DecodedInstruction&) {
+        return false;
+    }
+
+    template <typename Op, size_t Mode>
+    static constexpr AluHandler alu_entry() {
+        if constexpr ((Mode & 0x0f) > 3 || (Mode >> 4) > 3) return &alu_invalid_mode;
+        else return &alu<Op, Mode & 0x0f, (Mode >> 4)>;
+    }
+
+    template <typename Op, size_t... Modes>
+    static constexpr std::array<AluHandler, 256> make_alu_table(std::index_sequence<Modes...>) {
+        return {{ alu_entry<Op, Modes>()... }};
+    }
+
+    // Specialized handler for Op under the given mode byte
+    template <typename Op>
+    static AluHandler alu_handler(uint8_t mode) {
+        static constexpr std::array<AluHandler, 256> table = make_alu_table<Op>(std::make_index_sequence<256>());
+        return table[mode];
+    }
+
+    // Decode the instruction at addr into decode_cache[addr]
+    void decode(uint8_t addr) {
+        DecodedInstruction& d = decode_cache[addr];
+        if (stop == Stop::Watchpoint) {
+            // watch_hit() emptied the cache to get here: stop before this
+            // instruction. The entry is not counted in code_map, as Trap drops it.
+            d = { nullptr, Handler::Trap, TRAP_OPCODE, 0, 0, 0, 0, 1, true };
+            return;
+        }
+        uint8_t opcode = breakpoints[addr] ? TRAP_OPCODE : memory[addr];
+        uint8_t next = memory[static_cast<uint8_t>(addr + 1)];
+        bool has_mode = true;
+
+        d.opcode = opcode;
+        d.length = instruction_length(opcode);
+        d.alu = nullptr;
+        switch (opcode) {
+            case 0x00: d.op = Handler::Nop; break;
+            case 0x01: d.op = Handler::Out; break;
+            case 0x02: d.op = Handler::In; break;
+            case 0x03: d.op = Handler::Lea; break;
+            case 0x04: d.op = Handler::Alu; d.alu = alu_handler<OpMov>(next); break;
+            case 0x05: d.op = Handler::Ret; break;
+            case 0x06: d.op = Handler::Cal; break;
+            case 0x07: d.op = Handler::Jmp; break;
+            case 0x08: d.op = Handler::Jl; break;
+            case 0x09: d.op = Handler::Jnl; break;
+            case 0x0a: d.op = Handler::Jnm; break;
+            case 0x0b: d.op = Handler::Jm; break;
+            case 0x0c: d.op = Handler::Jne; break;
+            case 0x0d: d.op = Handler::Je; break;
+            case 0x0e: d.op = Handler::Cmp; break;
+            case 0x0f: d.op = Handler::Nop; break; // The original one-byte int, still unassigned
+            case 0x10: d.op = Handler::Alu; d.alu = alu_handler<OpAdd>(next); break;
+            case 0x11: d.op = Handler::Alu; d.alu = alu_handler<OpSub>(next); break;
+            case 0x12: d.op = Handler::Alu; d.alu = alu_handler<OpMul>(next); break;
+            case 0x13: d.op = Handler::Alu; d.alu = alu_handler<OpDiv>(next); break;
+            case 0x14: d.op = Handler::Int; break;
+            case 0x15: d.op = Handler::Iret; break;
+            case 0x20: d.op = Handler::Alu; d.alu = alu_handler<OpAnd>(next); break;
+            case 0x21: d.op = Handler::Alu; d.alu = alu_handler<OpOr>(next); break;
+            case 0x22: d.op = Handler::Alu; d.alu = alu_handler<OpXor>(next); break;
+            case 0x23: d.op = Handler::Alu; d.alu = alu_handler<OpNot>(next); break;
+            case 0x24: d.op = Handler::Alu; d.alu = alu_handler<OpNor>(next); break;
+            case 0x25: d.op = Handler::Alu; d.alu = alu_handler<OpNand>(next); break;
+            case 0x26: d.op = Handler::Push; break;
+            case 0x27: d.op = Handler::Pop; break;
+            case 0x30: d.op = Handler::BlockCopy; break;
+            case 0x31: d.op = Handler::BlockCompare; break;
+            case 0x32: d.op = Handler::TestAndSet; break;
+            case 0x33: d.op = Handler::CompareSwap; break;
+            case TRAP_OPCODE: d.op = breakpoints[addr] ? Handler::Trap : Handler::Unknown; break;
+            case 0xff: d.op = Handler::Hlt; break;
+            default: d.op = Handler::Unknown; break;
+        }
+        if (d.length <= 2) {
+            has_mode = false;
+            d.src = d.dst = 0;
+            d.a = next; // Jump/call target
+            d.b = 0;
+        } else {
+            d.src = next & 0x0f;
+            d.dst = next >> 4;
+            d.a = memory[static_cast<uint8_t>(addr + 2)];
+            d.b = memory[static_cast<uint8_t>(addr + 3)];
+        }
+        if (has_mode && d.op != Handler::Alu && (d.src > 3 || d.dst > 3)) {
+            d.op = Handler::BadMode; // Alu tables route bad modes to their own trap
+        }
+
+        // A cmp directly followed by a conditional jump runs as one handler.
+        // The jump keeps its own entry for code that jumps straight to it, and
+        // the cmp's entry also covers the jump's bytes, so rewriting the jump
+        // drops the fused entry too.
+        if (d.op == Handler::Cmp) {
+            const uint8_t jump = static_cast<uint8_t>(addr + d.length);
+            const uint8_t jump_opcode = memory[jump];
+            if (jump_opcode >= 0x08 && jump_opcode <= 0x0d && !breakpoints[jump]) {
+                if (!decode_cache[jump].valid) decode(jump);
+                static const Handler FUSED[] = { Handler::CmpJl, Handler::CmpJnl, Handler::CmpJnm,
+                                                 Handler::CmpJm, Handler::CmpJne, Handler::CmpJe };
+                d.op = FUSED[jump_opcode - 0x08];
+            }
+        }
+
+        d.valid = true;
+        const uint8_t cover = cover_length(d);
+        for (uint8_t i = 0; i < cover; ++i) {
+            ++code_map[static_cast<uint8_t>(addr + i)];
+        }
+    }
+
+    // Execute up to cycle_limit on the selected engine. With the interrupt
+    // controller on, slices also end at the next timer deadline (and when
+    // line 4 is next sampled, while input may interrupt) so interrupts are taken
+    // between slices, and a waiting guest idles instead.
+    void execute(uint64_t cycle_limit) {
+        if (waiting) {
+            idle(cycle_limit, nullptr);
+            return;
+        }
+        uint64_t limit = cycle_limit;
+        if (irq_on) {
+            limit = std::min(limit, timers.next_deadline());
+            if ((irq_mask >> IRQ_INPUT & 1) && !irq_in_service) limit = std::min(limit, input_poll_at);
+        }
+#if NIGG8_JIT
+        if (jit && !instrumented()) {
+            execute_jit(limit);
+        } else
+#endif
+        {
+            execute_until(limit);
+        }
+        if (irq_on) service_interrupts();
+        else irq_recheck = false; // Mask or timer written before the table: nothing to deliver yet
+    }
+
+    void reset_interrupts() {
+        timers.clear(cycles);
+        timer_exponents.fill(0);
+        timers_written = 0;
+        irq_table = irq_mask = irq_pending = 0;
+        irq_on = irq_in_service = irq_recheck = waiting = false;
+        input_poll_at = cycles;
+        input_raised = false;
+    }
+
+    static void irq_table_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        vm.irq_table = data[size - 1];
+        vm.irq_on = true;
+        vm.irq_recheck = true;
+    }
+
+    static void irq_mask_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        vm.irq_mask = data[size - 1];
+        vm.irq_recheck = true;
+    }
+
+    // The timer is rearmed from the cycle count in service_interrupts(),
+    // which runs right after this instruction
+    static void timer_port(void* context, const uint8_t* data, size_t size) {
+        VirtualMachine& vm = *static_cast<VirtualMachine*>(context);
+        for (size_t i = 0; i < size; ++i) {
+            const size_t timer = data[i] >> 6;
+            vm.timer_exponents[timer] = data[i] & 0x3f;
+            vm.timers_written |= static_cast<uint8_t>(1u << timer);
+        }
+        vm.irq_recheck = true;
+    }
+
+    // Between slices: rearm timers written to, latch the lines of timers that
+    // came due and deliver the lowest unmasked line that is raised, unless a
+    // handler is already running. A periodic timer keeps its phase, skipping
+    // periods that passed while nobody looked.
+    void service_interrupts() {
+        const bool recheck = irq_recheck;
+        irq_recheck = false;
+        for (size_t t = 0; timers_written; ++t) {
+            if (!(timers_written >> t & 1)) continue;
+            timers_written &= static_cast<uint8_t>(~(1u << t));
+            if (timer_exponents[t] == 0) {
+                timers.cancel(t);
+            } else {
+                const uint64_t period = uint64_t(1) << timer_exponents[t];
+                if (period < TimerWheel::NEVER - cycles) timers.schedule(t, cycles + period);
+                else timers.cancel(t);
+            }
+        }
+        timers.advance(cycles, [&](size_t t, uint64_t due) {
+            irq_pending |= static_cast<uint8_t>(1u << t);
+            const uint64_t period = uint64_t(1) << timer_exponents[t];
+            const uint64_t late = (cycles - due) / period + 1;
+            if (late > (TimerWheel::NEVER - due) / period) return; // Never again in 64 bits of cycles
+            timers.schedule(t, due + late * period);
+        });
+        if (!running || irq_in_service) return;
+        const uint8_t raised = (irq_pending | (input_line(recheck) ? 1u << IRQ_INPUT : 0u)) & irq_mask;
+        if (!raised) return;
+        uint8_t line = 0;
+        while (!(raised >> line & 1)) ++line;
+        irq_pending &= static_cast<uint8_t>(~(1u << line));
+        waiting = false;
+        if (!enter_interrupt(line, pc)) trap(Fault::StackOverflow, pc);
+    }
+
+    // Line 4, while unmasked. Input is sampled only every INPUT_POLL_CYCLES
+    // and after an instruction that asked for a recheck (in, iret, a port of
+    // the controller), not wherever a batch or run_for() slice happened to
+    // end, so a replay looks at the same points as the recording did.
+    bool input_line(bool recheck) {
+        if (!(irq_mask >> IRQ_INPUT & 1)) return false;
+        if (recheck || cycles >= input_poll_at) {
+            input_raised = observe(Observation::Line, [&] { return input_status() != 0; }, 0) != 0;
+            input_poll_at = cycles + INPUT_POLL_CYCLES;
+        }
+        return input_raised;
+    }
+
+    // Push the return address and the flags and continue at the handler of
+    // line, holding hardware interrupts until iret. The flags byte is e, l, m
+    // in bits 0-2 and whether a handler was running in bit 3, so handlers
+    // can nest through int. False if the stack has no room.
+    bool enter_interrupt(uint8_t line, uint8_t& at) {
+        if (sp < 2) return false;
+        push_stack(at);
+        push_stack(static_cast<uint8_t>(flag_equal | flag_less << 1 | flag_more << 2 | irq_in_service << 3));
+        irq_in_service = true;
+        at = memory[static_cast<uint8_t>(irq_table + line)];
+        ++interrupts;
+        return true;
+    }
+
+    // iret: undo enter_interrupt(); false if the stack holds too little
+    bool return_from_interrupt(uint8_t& at) {
+        if (sp > 0xfd) return false;
+        const uint8_t flags = pop_stack();
+        at = pop_stack();
+        flag_equal = flags & 1;
+        flag_less = (flags >> 1) & 1;
+        flag_more = (flags >> 2) & 1;
+        irq_in_service = (flags >> 3) & 1;
+        irq_recheck = true; // Lines held during the handler may be delivered now
+        return true;
+    }
+
+    // hlt: stop, or with the controller on and a line that could still
+    // interrupt, wait for that interrupt (and continue after the hlt)
+    void halt() {
+        if (irq_on && can_wake()) waiting = true;
+        else running = false;
+    }
+
+    bool can_wake() {
+        if (irq_in_service) return false; // Only iret lets hardware lines through
+        uint8_t lines = irq_pending;
+        for (size_t t = 0; t < TIMER_COUNT; ++t) {
+            if (timers.armed(t) || (timers_written >> t & 1)) lines |= static_cast<uint8_t>(1u << t);
+        }
+        if (lines & irq_mask) return true;
+        return (irq_mask >> IRQ_INPUT & 1) && observe(Observation::Open, [&] { return input_open(); }, 0) != 0;
+    }
+
+    // Whether in may still get input beyond what it has now. For a plain
+    // stream this waits for the next character, as in would.
+    bool input_open() {
+        if (input_bytes) return input_used < input_size;
+        if (input_queue) return !input_queue->drained();
+        return input->rdbuf() && input->peek() != std::char_traits<char>::eof();
+    }
+
+    // Wait for input that may interrupt, or until the cycle count reaches
+    // until, whichever comes first. Returns the cycles that pass: none when
+    // input came first. Without pace, only a wait with no end (until is
+    // NEVER) blocks. Input from the queue can cut a paced sleep short; a
+    // plain stream cannot be waited on with a timeout and is looked at on waking.
+    uint64_t wait_for_wake(uint64_t until, Pace* pace) {
+        if (until == TimerWheel::NEVER) {
+            if (input_bytes) return 0; // Never grows
+            if (input_queue) input_queue->wait();
+            else input->peek();
+            return 0;
+        }
+        const uint64_t full = until - cycles;
+        if (input_bytes) return full;
+        if (!pace) return full;
+        if (input_queue && !input_queue->drained() && input_queue->wait_until(pace->time_at(until))) {
+            pace->resume(cycles, std::chrono::steady_clock::now());
+            return 0;
+        }
+        std::this_thread::sleep_until(pace->time_at(until));
+        return full;
+    }
+
+    // Let a waiting guest's virtual time pass without executing anything: up
+    // to its next timer or cycle_limit, whichever is first, or until input
+    // arrives if that may interrupt. With pace (a throttled run) the host
+    // sleeps through the matching wall time; without it a timer is reached at
+    // once and only waiting for input blocks. A guest nothing can wake halts.
+    // Cycles only ever move to until, never by the wall clock, so timers fire
+    // at the same points in every run: input that cuts the wait short takes
+    // no virtual time, and pace carries on from there.
+    void idle(uint64_t cycle_limit, Pace* pace) {
+        service_interrupts();
+        if (!waiting || !running) return;
+        if (!can_wake()) {
+            waiting = false;
+            running = false;
+            return;
+        }
+        flush_output();
+        const uint64_t before = cycles;
+        const uint64_t until = std::min(cycle_limit, timers.next_deadline());
+        if (irq_mask >> IRQ_INPUT & 1) {
+            // How long the wait lasts depends on when input arrives, so it
+            // goes through the input log; line 4 is sampled straight after
+            cycles += observe(Observation::Wake, [&] { return wait_for_wake(until, pace); },
+                              until == TimerWheel::NEVER ? 0 : until - cycles);
+            irq_recheck = true;
+        } else {
+            if (pace) std::this_thread::sleep_until(pace->time_at(until));
+            cycles = until;
+        }
+        idle_cycles += cycles - before;
+        service_interrupts();
+    }
+
+#if NIGG8_JIT
+    // Run compiled blocks, stepping the interpreter over whatever the JIT leaves
+    // to it. A block only checks the budget as it ends, so the last
+    // instructions before cycle_limit go through the interpreter instead.
+    void execute_jit(uint64_t cycle_limit) {
+        JitCompiler::Context& ctx = jit->context();
+        while (running && !waiting && !irq_recheck && cycles < cycle_limit) {
+            if (cycle_limit - cycles < JitCompiler::MAX_BLOCK_INSTRUCTIONS) {
+                execute_until(cycle_limit);
+                continue;
+            }
+            if (data_bank != memory.data()) { // Compiled code only addresses bank 0
+                execute_until(cycle_limit);
+                continue;
+            }
+            const uint8_t* block = jit->block_at(pc);
+            if (!block) {
+                execute_until(cycles + 1);
+                continue;
+            }
+
+            ctx.budget = cycle_limit - cycles - JitCompiler::MAX_BLOCK_INSTRUCTIONS + 1;
+            ctx.sp = sp;
+            ctx.flag_equal = flag_equal;
+            ctx.flag_less = flag_less;
+            ctx.flag_more = flag_more;
+            ctx.exit = JitCompiler::Exit::Dispatch;
+            jit->enter(block);
+            sp = ctx.sp;
+            flag_equal = ctx.flag_equal;
+            flag_less = ctx.flag_less;
+            flag_more = ctx.flag_more;
+            retire(ctx.pc, ctx.retired);
+
+            switch (ctx.exit) {
+                case JitCompiler::Exit::Halt:
+                    halt();
+                    break;
+                case JitCompiler::Exit::CodeWrite:
+                    invalidate_code(ctx.written);
+                    break;
+                case JitCompiler::Exit::Interpret:
+                    execute_until(cycles + 1);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+#endif
+
+    // Execute a single instruction
+    void execute_instruction() {
+        execute_until(cycles + 1);
+    }
+
+    // Execute instructions until hlt or until the cycle counter reaches cycle_limit.
+    // Each handler ends by dispatching the next instruction itself (threaded code)
+    // on compilers with computed goto, or by looping back to a switch elsewhere.
+    void execute_until(uint64_t cycle_limit) {
+        if (coverage) {
+            interpret<true, false>(cycle_limit);
+#if NIGG8_PROFILE
+        } else if (profiler) {
+            interpret<false, true>(cycle_limit);
+#endif
+        } else {
+            interpret<false, false>(cycle_limit);
+        }
+    }
+
+    // Traced instances record every (previous pc, pc) edge in the coverage
+    // bitmap, Profiled ones feed the profiler; <false, false> is the plain
+    // interpreter
+    template <bool Traced, bool Profiled>
+    void interpret(uint64_t cycle_limit) {
+        const DecodedInstruction* d;
+        DecodedInstruction* const cache = decode_cache.data();
+        uint64_t budget = cycle_limit > cycles ? cycle_limit - cycles : 0;
+        uint64_t retired = 0;
+        uint64_t fused_here = 0; // Of retired, those run by a fused handler
+        uint64_t stalled = 0; // Cycles taken beyond one per instruction
+#define VM_STALL(extra) \
+        do { \
+            const uint64_t stall = (extra); \
+            stalled += stall; \
+            budget = budget - retired > stall ? budget - stall : retired; \
+        } while (0)
+
+        // pc and the retired count stay in locals while the loop runs (guest byte
+        // stores could otherwise alias the members) and are written back on exit
+        uint8_t pc = this->pc;
+        uint8_t prev = coverage_prev;
+#if NIGG8_PROFILE
+        uint64_t* const hits = Profiled ? profiler->hits() : nullptr;
+        uint64_t* const pair_hits = Profiled ? profiler->pairs() : nullptr;
+        unsigned last_opcode = Profiled ? profiler->last_opcode : 0;
+#define VM_PROFILE(statement) if (Profiled) { statement; }
+#else
+#define VM_PROFILE(statement)
+#endif
+
+        try {
+
+#if NIGG8_THREADED_DISPATCH
+        static const void* const labels[] = { // Same order as Handler
+            &&op_Nop, &&op_Out, &&op_In, &&op_Lea, &&op_Alu, &&op_Ret, &&op_Cal,
+            &&op_Jmp, &&op_Jl, &&op_Jnl, &&op_Jnm, &&op_Jm, &&op_Jne, &&op_Je,
+            &&op_Cmp, &&op_CmpJl, &&op_CmpJnl, &&op_CmpJnm, &&op_CmpJm, &&op_CmpJne, &&op_CmpJe,
+            &&op_Int, &&op_Iret, &&op_Push, &&op_Pop, &&op_BlockCopy, &&op_BlockCompare, &&op_TestAndSet, &&op_CompareSwap, &&op_Trap, &&op_Hlt,
+            &&op_BadMode, &&op_Unknown
+        };
+        static_assert(sizeof(labels) / sizeof(labels[0]) == static_cast<size_t>(Handler::Count),
+                      "dispatch table out of sync with Handler");
+
+#define VM_HANDLER(name) op_##name:
+#define VM_NEXT() \
+        do { \
+            if (retired == budget) goto done; \
+            d = &cache[pc]; \
+            if (!d->valid) { \
+                decode(pc); \
+            } \
+            if (Traced) prev = trace_edge(prev, pc); \
+            VM_PROFILE(++hits[pc]; ++pair_hits[last_opcode << 8 | d->opcode]; last_opcode = d->opcode) \
+            pc = static_cast<uint8_t>(pc + d->length); \
+            ++retired; \
+            goto *labels[static_cast<size_t>(d->op)]; \
+        } while (0)
+
+        VM_NEXT();
+#else
+#define VM_HANDLER(name) case Handler::name:
+#define VM_NEXT() continue
+
+        for (;;) {
+            if (retired == budget) goto done;
+            d = &cache[pc];
+            if (!d->valid) {
+                decode(pc);
+            }
+            if (Traced) prev = trace_edge(prev, pc);
+            VM_PROFILE(++hits[pc]; ++pair_hits[last_opcode << 8 | d->opcode]; last_opcode = d->opcode)
+            pc = static_cast<uint8_t>(pc + d->length);
+            ++retired;
+
+            switch (d->op) {
+#endif
+            VM_HANDLER(Nop) {
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Out) {
+                if (write_port(d->b, fetch_operand(d->src, d->a)) && irq_recheck) {
+                    budget = retired; // The interrupt controller looks next
+                }
+                VM_NEXT();
+            }
+
+            VM_HANDLER(In) {
+                const bool mailbox = d->b >= PORT_MAIL_RECEIVE && d->b <= PORT_CORE_COUNT;
+                const uint8_t value = mailbox ? core_port(d->b) : read_input(d->b == PORT_INPUT_STATUS);
+                store_operand(d->dst, d->a, value);
+                if (!mailbox && irq_on && (irq_mask >> IRQ_INPUT & 1)) {
+                    irq_recheck = true; // Line 4 may have dropped
+                    budget = retired;
+                }
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Lea) {
+                store_operand(d->dst, d->a, d->b);
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Alu) { // mov, add, sub, mul, div, and, or, xor, not, nor, nand
+                if (!d->alu(*this, *d)) {
+                    trap(Fault::InvalidOperandMode, address_of(d));
+                    goto done;
+                }
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Ret) {
+                if (sp >= 0xff) {
+                    trap(Fault::StackUnderflow, address_of(d));
+                    goto done;
+                }
+                pc = pop_stack();
+                VM_PROFILE(profiler->ret(instructions + retired))
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Cal) {
+                if (sp == 0) {
+                    trap(Fault::StackOverflow, address_of(d));
+                    goto done;
+                }
+                push_stack(pc);
+                pc = d->a;
+                VM_PROFILE(profiler->call(d->a, instructions + retired))
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Jmp) {
+                pc = d->a;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Jl) {
+                if (flag_less) pc = d->a;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Jnl) {
+                if (!flag_less) pc = d->a;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Jnm) {
+                if (!flag_more) pc = d->a;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Jm) {
+                if (flag_more) pc = d->a;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Jne) {
+                if (!flag_equal) pc = d->a;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Je) {
+                if (flag_equal) pc = d->a;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Cmp) {
+                uint8_t val1 = fetch_operand(d->src, d->a);
+                uint8_t val2 = fetch_operand(d->dst, d->b);
+                flag_equal = (val1 == val2);
+                flag_less = (val1 < val2);
+                flag_more = (val1 > val2);
+                VM_NEXT();
+            }
+
+            // cmp and the jump at pc in one dispatch, branching on the compared
+            // values directly. The flags are only stored when something could
+            // see them: they are skipped when the next instruction is another
+            // cmp that is sure to run (within the budget, and cmp cannot fault)
+            // and overwrites them all. With no budget left for the jump, only
+            // the cmp runs.
+#define VM_CMP_JUMP(name, taken) \
+            VM_HANDLER(name) { \
+                uint8_t val1 = fetch_operand(d->src, d->a); \
+                uint8_t val2 = fetch_operand(d->dst, d->b); \
+                if (retired != budget) { \
+                    if (Traced) prev = trace_edge(prev, pc); \
+                    VM_PROFILE(++hits[pc]; ++pair_hits[last_opcode << 8 | cache[pc].opcode]; last_opcode = cache[pc].opcode) \
+                    ++retired; \
+                    ++fused_here; \
+                    pc = (taken) ? cache[pc].a : static_cast<uint8_t>(pc + 2); \
+                    if (retired != budget && cache[pc].valid && writes_flags(cache[pc].op)) VM_NEXT(); \
+                } \
+                flag_equal = (val1 == val2); \
+                flag_less = (val1 < val2); \
+                flag_more = (val1 > val2); \
+                VM_NEXT(); \
+            }
+
+            VM_CMP_JUMP(CmpJl, val1 < val2)
+            VM_CMP_JUMP(CmpJnl, !(val1 < val2))
+            VM_CMP_JUMP(CmpJnm, !(val1 > val2))
+            VM_CMP_JUMP(CmpJm, val1 > val2)
+            VM_CMP_JUMP(CmpJne, val1 != val2)
+            VM_CMP_JUMP(CmpJe, val1 == val2)
+#undef VM_CMP_JUMP
+
+            VM_HANDLER(Int) { // int n (modulo 8); nothing while the controller is off
+                if (irq_on && !enter_interrupt(d->a & (IRQ_LINES - 1), pc)) {
+                    trap(Fault::StackOverflow, address_of(d));
+                    goto done;
+                }
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Iret) { // Nothing while the controller is off
+                if (irq_on) {
+                    if (!return_from_interrupt(pc)) {
+                        trap(Fault::StackUnderflow, address_of(d));
+                        goto done;
+                    }
+                    budget = retired;
+                }
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Push) {
+                uint8_t value = fetch_operand(d->src, d->a);
+                if (sp == 0) {
+                    trap(Fault::StackOverflow, address_of(d));
+                    goto done;
+                }
+                push_stack(value);
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Pop) {
+                if (sp >= 0xff) {
+                    trap(Fault::StackUnderflow, address_of(d));
+                    goto done;
+                }
+                uint8_t value = pop_stack();
+                store_operand(d->dst, d->a, value);
+                VM_NEXT();
+            }
+
+            // mcpy and mcmp also take a cycle per BLOCK_BYTES_PER_CYCLE bytes,
+            // which come out of what is left of the budget
+            VM_HANDLER(BlockCopy) {
+                if (d->dst < 2) {
+                    trap(Fault::InvalidDestinationMode, address_of(d));
+                    goto done;
+                }
+                const uint8_t count = registers[BLOCK_COUNT_REGISTER];
+                block_copy(d->dst == 2 ? d->a : registers[d->a], d->src, d->b, count);
+                VM_STALL(block_cycles(count));
+                VM_NEXT();
+            }
+
+            VM_HANDLER(BlockCompare) {
+                if (d->dst < 2) {
+                    trap(Fault::InvalidOperandMode, address_of(d));
+                    goto done;
+                }
+                const uint8_t count = registers[BLOCK_COUNT_REGISTER];
+                const int order = block_compare(d->dst == 2 ? d->a : registers[d->a], d->src, d->b, count);
+                flag_equal = order == 0;
+                flag_less = order < 0;
+                flag_more = order > 0;
+                VM_STALL(block_cycles(count));
+                VM_NEXT();
+            }
+
+            // tas and cas write the byte atomically, so cores sharing memory can
+            // build locks on them; the flags compare its old value with 0 or r1
+            VM_HANDLER(TestAndSet) {
+                if (d->dst < 2) {
+                    trap(Fault::InvalidDestinationMode, address_of(d));
+                    goto done;
+                }
+                const uint8_t addr = d->dst == 2 ? d->a : registers[d->a];
+                const uint8_t old = SharedMemory::exchange(data_bank + addr, 1);
+                if (bank_code_map[addr]) invalidate_code(addr);
+                flag_equal = old == 0;
+                flag_less = false;
+                flag_more = old != 0;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(CompareSwap) {
+                if (d->dst < 2) {
+                    trap(Fault::InvalidDestinationMode, address_of(d));
+                    goto done;
+                }
+                const uint8_t addr = d->dst == 2 ? d->a : registers[d->a];
+                const uint8_t value = fetch_operand(d->src, d->b);
+                const uint8_t expected = registers[ATOMIC_EXPECTED_REGISTER];
+                const uint8_t old = SharedMemory::compare_exchange(data_bank + addr, expected, value);
+                if (old != expected) {
+                    registers[ATOMIC_EXPECTED_REGISTER] = old; // Ready for the retry
+                } else if (bank_code_map[addr]) {
+                    invalidate_code(addr);
+                }
+                flag_equal = old == expected;
+                flag_less = old < expected;
+                flag_more = old > expected;
+                VM_NEXT();
+            }
+
+            VM_HANDLER(Trap) { // Stops before the instruction, so it does not retire
+                pc = address_of(d);
+                --retired;
+                if (stop == Stop::Watchpoint) cache[pc].valid = false;
+                else stop = Stop::Breakpoint;
+                running = false;
+                goto done;
+            }
+
+            VM_HANDLER(Hlt) {
+                halt();
+                goto done;
+            }
+
+            VM_HANDLER(BadMode) {
+                // in, lea and pop only store, so they report the destination mode.
+                // pop has already checked and moved the stack pointer by then.
+                if (d->opcode == 0x27) {
+                    if (sp >= 0xff) {
+                        trap(Fault::StackUnderflow, address_of(d));
+                        goto done;
+                    }
+                    ++sp;
+                }
+                bool store_only = d->opcode == 0x02 || d->opcode == 0x03 || d->opcode == 0x27;
+                trap(store_only ? Fault::InvalidDestinationMode : Fault::InvalidOperandMode, address_of(d));
+                goto done;
+            }
+
+            VM_HANDLER(Unknown) {
+                trap(Fault::UnknownOpcode, address_of(d));
+                goto done;
+            }
+#if !NIGG8_THREADED_DISPATCH
+                default:
+                    break;
+            }
+        }
+#endif
+        } catch (...) {
+            coverage_prev = prev;
+            fused += fused_here;
+            VM_PROFILE(profiler->last_opcode = last_opcode)
+            retire(pc, retired, stalled);
+            throw;
+        }
+
+    done:
+        coverage_prev = prev;
+        fused += fused_here;
+        VM_PROFILE(profiler->last_opcode = last_opcode)
+        retire(pc, retired, stalled);
+#undef VM_HANDLER
+#undef VM_NEXT
+#undef VM_PROFILE
+#undef VM_STALL
+    }
+
+    // mcpy: count bytes from the block at src (src_kind 2 or 3), or copies of
+    // the byte src names (0 or 1), to the selected bank at dst. Blocks wrap at
+    // the end of memory, and overlapping ones copy as if the source were read
+    // in full first.
+    void block_copy(uint8_t dst, uint8_t src_kind, uint8_t src, uint8_t count) {
+        if (count == 0) return;
+        uint8_t* const m = data_bank;
+        const bool wraps = dst + count > MEMORY_SIZE;
+        const unsigned head = wraps ? MEMORY_SIZE - dst : count; // Bytes before the wrap
+        if (shared) {
+            // Other cores access these bytes too, so copy them one atomic byte
+            // at a time instead of with memmove/memset
+            uint8_t copy[MEMORY_SIZE];
+            const uint8_t from = src_kind >= 2 ? (src_kind == 2 ? src : registers[src]) : 0;
+            const uint8_t value = src_kind >= 2 ? 0 : fetch_operand(src_kind, src);
+            for (unsigned i = 0; i < count; ++i) {
+                copy[i] = src_kind >= 2 ? SharedMemory::load(m + static_cast<uint8_t>(from + i)) : value;
+            }
+            for (unsigned i = 0; i < count; ++i) SharedMemory::store(m + static_cast<uint8_t>(dst + i), copy[i]);
+        } else if (src_kind >= 2) {
+            const uint8_t from = src_kind == 2 ? src : registers[src];
+            if (!wraps && from + count <= MEMORY_SIZE) {
+                std::memmove(m + dst, m + from, count);
+            } else {
+                uint8_t copy[MEMORY_SIZE];
+                for (unsigned i = 0; i < count; ++i) copy[i] = m[static_cast<uint8_t>(from + i)];
+                for (unsigned i = 0; i < count; ++i) m[static_cast<uint8_t>(dst + i)] = copy[i];
+            }
+        } else {
+            const uint8_t value = fetch_operand(src_kind, src);
+            std::memset(m + dst, value, head);
+            std::memset(m, value, count - head);
+        }
+        // Drop code that was overwritten; the OR over the map has no early exit
+        // so it vectorizes, and the usual data-only block skips the byte loop
+        uint8_t covered = 0;
+        for (unsigned i = 0; i < head; ++i) covered |= bank_code_map[dst + i];
+        for (unsigned i = 0; i < count - head; ++i) covered |= bank_code_map[i];
+        if (!covered) return;
+        for (unsigned i = 0; i < count; ++i) {
+            const uint8_t addr = static_cast<uint8_t>(dst + i);
+            if (bank_code_map[addr]) invalidate_code(addr);
+        }
+    }
+
+    // mcmp: order of the block at first against the block or byte src names
+    // (as for block_copy), by the first byte that differs
+    int block_compare(uint8_t first, uint8_t src_kind, uint8_t src, uint8_t count) const {
+        const uint8_t* const m = data_bank;
+        if (src_kind < 2) {
+            const uint8_t value = fetch_operand(src_kind, src);
+            for (unsigned i = 0; i < count; ++i) {
+                const uint8_t byte = SharedMemory::load(m + static_cast<uint8_t>(first + i));
+                if (byte != value) return byte < value ? -1 : 1;
+            }
+            return 0;
+        }
+        if (shared) { // Byte by byte, atomically, as other cores may be storing
+            const uint8_t second = src_kind == 2 ? src : registers[src];
+            for (unsigned i = 0; i < count; ++i) {
+                const uint8_t a = SharedMemory::load(m + static_cast<uint8_t>(first + i));
+                const uint8_t b = SharedMemory::load(m + static_cast<uint8_t>(second + i));
+                if (a != b) return a < b ? -1 : 1;
+            }
+            return 0;
+        }
+        // memcmp over the longest stretches where neither block wraps
+        const size_t size = MEMORY_SIZE;
+        size_t at = first, second = src_kind == 2 ? src : registers[src];
+        size_t left = count;
+        while (left) {
+            const size_t chunk = std::min({ left, size - at, size - second });
+            const int order = std::memcmp(m + at, m + second, chunk);
+            if (order != 0) return order;
+            at = (at + chunk) % size;
+            second = (second + chunk) % size;
+            left -= chunk;
+        }
+        return 0;
+    }
+
+    uint8_t address_of(const DecodedInstruction* d) const {
+        return static_cast<uint8_t>(d - decode_cache.data());
+    }
+
+    // Set the bit for the edge prev -> pc and return pc as the next prev
+    uint8_t trace_edge(uint8_t prev, uint8_t pc) {
+        const unsigned edge = static_cast<unsigned>(prev) << 8 | pc;
+        coverage[edge >> 3] |= static_cast<uint8_t>(1u << (edge & 7));
+        return pc;
+    }
+
+    // Write back the state execute_until() keeps in locals
+    void retire(uint8_t next_pc, uint64_t count, uint64_t stalled = 0) {
+        this->pc = next_pc;
+        instructions += count;
+        cycles += count + stalled;
+    }
+};
+
+// Runs one program against many input sets on a pool of worker threads. Every
+// worker owns a single VM that is reset between runs and appends guest output
+// to its own arena, so a run costs a reset instead of fresh allocations. Runs
+// are split evenly up front; a worker that runs dry steals half of the
+// remaining range of another worker.
+class BatchRunner {
+public:
+    enum class Status : uint8_t { Halted, Fault, Limit };
+
+    struct Result {
+        Status status;
+        uint8_t pc;
+        uint64_t instructions;
+        uint32_t worker; // Arena holding the output
+        size_t output_offset, output_length;
+        std::string error;
+    };
+
+    BatchRunner(const ProgramImage& program, Engine engine, uint64_t max_cycles, unsigned threads, size_t banks = 1)
+        : program(program), engine(engine), max_cycles(max_cycles), banks(banks),
+          workers(threads ? threads : 1) {}
+
+    // Run once per input; each input is what the guest reads through in
+    void run(const std::string& text, const std::vector<std::pair<size_t, size_t>>& inputs) {
+        results.assign(inputs.size(), Result());
+        std::vector<WorkQueue> queues(workers.size());
+        const size_t share = inputs.size() / workers.size();
+        const size_t extra = inputs.size() % workers.size();
+        size_t next = 0;
+        for (size_t w = 0; w < queues.size(); ++w) {
+            queues[w].next = next;
+            next += share + (w < extra ? 1 : 0);
+            queues[w].end = next;
+        }
+
+        std::vector<std::thread> threads;
+        for (size_t w = 1; w < workers.size(); ++w) {
+            threads.emplace_back([&, w] { work(static_cast<uint32_t>(w), queues, text, inputs); });
+        }
+        work(0, queues, text, inputs);
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+
+    // One line per run: index, status, instructions, pc, output as hex, error
+    void write(std::ostream& out) const {
+        static const char* const STATUS[] = { "halted", "fault", "limit" };
+        static const char HEX[] = "0123456789abcdef";
+        std::string line;
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& r = results[i];
+            const std::string& arena = workers[r.worker].output;
+            line.clear();
+            line += std::to_string(i);
+            line += '\t';
+            line += STATUS[static_cast<int>(r.status)];
+            line += '\t';
+            line += std::to_string(r.instructions);
+            line += '\t';
+            line += HEX[r.pc >> 4];
+            line += HEX[r.pc & 0xf];
+            line += '\t';
+            for (size_t k = 0; k < r.output_length; ++k) {
+                uint8_t b = static_cast<uint8_t>(arena[r.output_offset + k]);
+                line += HEX[b >> 4];
+                line += HEX[b & 0xf];
+            }
+            line += '\t';
+            line += r.error;
+            line += '\n';
+            out << line;
+        }
+    }
+
+    const std::vector<Result>& result_list() const { return results; }
+
+private:
+    // Read-only view of one input, reused for every run on a worker
+    struct InputBuffer : std::streambuf {
+        void reset(const char* data, size_t size) {
+            char* p = const_cast<char*>(data);
+            setg(p, p, p + size);
+        }
+    };
+
+    // Appends everything the guest writes to the worker's output arena
+    struct OutputBuffer : std::streambuf {
+        std::string* arena = nullptr;
+
+        int_type overflow(int_type c) override {
+            if (c != traits_type::eof()) arena->push_back(static_cast<char>(c));
+            return c;
+        }
+
+        std::streamsize xsputn(const char* data, std::streamsize size) override {
+            arena->append(data, static_cast<size_t>(size));
+            return size;
+        }
+    };
+
+    struct Worker {
+        std::string output;
+    };
+
+    // Runs [next, end) not yet claimed by anyone
+    struct WorkQueue {
+        std::mutex lock;
+        size_t next = 0, end = 0;
+    };
+
+    const ProgramImage& program;
+    Engine engine;
+    uint64_t max_cycles;
+    size_t banks;
+    std::vector<Worker> workers;
+    std::vector<Result> results;
+
+    static bool take(WorkQueue& queue, size_t& index) {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.next == queue.end) return false;
+        index = queue.next++;
+        return true;
+    }
+
+    // Move the upper half of some other queue into ours
+    static bool steal(std::vector<WorkQueue>& queues, size_t self) {
+        for (size_t k = 1; k < queues.size(); ++k) {
+            WorkQueue& victim = queues[(self + k) % queues.size()];
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> guard(victim.lock);
+                size_t remaining = victim.end - victim.next;
+                if (remaining == 0) continue;
+                begin = victim.end - (remaining + 1) / 2;
+                end = victim.end;
+                victim.end = begin;
+            }
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            queues[self].next = begin;
+            queues[self].end = end;
+            return true;
+        }
+        return false;
+    }
+
+    void work(uint32_t self, std::vector<WorkQueue>& queues, const std::string& text,
+              const std::vector<std::pair<size_t, size_t>>& inputs) {
+        Worker& worker = workers[self];
+        worker.output.clear();
+        InputBuffer in_buffer;
+        OutputBuffer out_buffer;
+        out_buffer.arena = &worker.output;
+        std::istream in(&in_buffer);
+        std::ostream out(&out_buffer);
+
+        VirtualMachine vm;
+        vm.set_engine(engine);
+        vm.set_banks(banks);
+        vm.set_io(in, out, nullptr);
+
+        size_t index;
+        for (;;) {
+            if (!take(queues[self], index)) {
+                if (!steal(queues, self)) break;
+                continue;
+            }
+            Result& r = results[index];
+            in_buffer.reset(text.data() + inputs[index].first, inputs[index].second);
+            in.clear();
+            out.clear();
+            r.worker = self;
+            r.output_offset = worker.output.size();
+            try {
+                vm.reset(program);
+                r.status = vm.run_for(max_cycles) ? Status::Halted : Status::Limit;
+            } catch (const std::exception& e) {
+                r.status = Status::Fault;
+                r.error = e.what();
+            }
+            r.pc = vm.program_counter();
+            r.instructions = vm.instruction_count();
+            r.output_length = worker.output.size() - r.output_offset;
+        }
+    }
+};
+
+// Runs one program on several cores sharing a SharedMemory, each core a
+// VirtualMachine on its own host thread (see VirtualMachine::join()). Every
+// core starts at the entry point; they tell themselves apart through
+// PORT_CORE_ID. The shared memory starts out as a copy of the program.
+class MultiCore {
+public:
+    MultiCore(const ProgramImage& program, size_t count)
+        : shared(count), errors(count), host_seconds(0.0) {
+        std::copy(program.memory.begin(), program.memory.end(), shared.data());
+        for (size_t i = 0; i < count; ++i) {
+            cores.emplace_back(new VirtualMachine);
+            cores[i]->join(&shared, static_cast<uint8_t>(i));
+            cores[i]->load_program(program);
+        }
+    }
+
+    size_t size() const { return cores.size(); }
+    VirtualMachine& core(size_t i) { return *cores[i]; }
+    SharedMemory& memory() { return shared; }
+
+    // Why core i stopped, if not hlt (or the cycle limit)
+    const std::string& error(size_t i) const { return errors[i]; }
+
+    // Run every core until it stops, paced by its clock, or for at most
+    // max_cycles cycles each. A fault stops only its own core. Runs once:
+    // stopped cores stay stopped for the others' mailboxes.
+    void run(uint64_t max_cycles = UINT64_MAX) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < cores.size(); ++i) {
+            threads.emplace_back([this, i, max_cycles] { run_core(i, max_cycles); });
+        }
+        run_core(0, max_cycles);
+        for (std::thread& t : threads) {
+            t.join();
+        }
+        host_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    uint64_t instruction_count() const {
+        uint64_t total = 0;
+        for (const auto& core : cores) total += core->instruction_count();
+        return total;
+    }
+
+    // Each core's report, then the combined throughput
+    void report(std::ostream& out) const {
+        for (size_t i = 0; i < cores.size(); ++i) {
+            out << "Core " << i << ": ";
+            cores[i]->report(out);
+        }
+        const uint64_t total = instruction_count();
+        StreamFormat format(out);
+        out << std::dec << "All " << cores.size() << " cores: " << total << " instructions in " << std::fixed
+            << std::setprecision(3) << host_seconds << " s, " << std::setprecision(0)
+            << (host_seconds > 0.0 ? total / host_seconds : 0.0) << " instructions/s" << std::endl;
+    }
+
+private:
+    SharedMemory shared;
+    std::vector<std::unique_ptr<VirtualMachine>> cores;
+    std::vector<std::string> errors;
+    double host_seconds;
+
+    void run_core(size_t i, uint64_t max_cycles) {
+        try {
+            if (max_cycles == UINT64_MAX) cores[i]->run();
+            else cores[i]->run_for(max_cycles);
+        } catch (const std::exception& e) {
+            errors[i] = e.what();
+        }
+        shared.stop(i);
+    }
+};
+
+// Input logs written by --record hold everything a run learned from input:
+//    0  magic "N8RL"
+//    4  version
+//    5  ProgramImage::checksum() of the recorded program (little-endian)
+//    9  the records of VirtualMachine::record_input(), in order
+// Version 1 logs held only the in values, one byte each.
+const uint8_t INPUT_LOG_MAGIC[4] = { 'N', '8', 'R', 'L' };
+const uint8_t INPUT_LOG_VERSION = 2;
+const size_t INPUT_LOG_HEADER_SIZE = 9;
+
+void write_input_log_header(std::ostream& out, const ProgramImage& program) {
+    uint32_t checksum = program.checksum();
+    uint8_t header[INPUT_LOG_HEADER_SIZE];
+    std::memcpy(header, INPUT_LOG_MAGIC, sizeof(INPUT_LOG_MAGIC));
+    header[4] = INPUT_LOG_VERSION;
+    for (int i = 0; i < 4; ++i) {
+        header[5 + i] = static_cast<uint8_t>(checksum >> (8 * i));
+    }
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+}
+
+// The records of a log made for program, for VirtualMachine::replay_input()
+std::vector<uint8_t> read_input_log(const std::string& path, const ProgramImage& program) {
+    MappedFile file(path);
+    const uint8_t* data = file.data();
+    if (file.size() < INPUT_LOG_HEADER_SIZE || std::memcmp(data, INPUT_LOG_MAGIC, sizeof(INPUT_LOG_MAGIC)) != 0) {
+        throw std::runtime_error("Not an input log: " + path);
+    }
+    if (data[4] != INPUT_LOG_VERSION && data[4] != 1) {
+        throw std::runtime_error("Unsupported input log version: " + std::to_string(data[4]));
+    }
+    uint32_t checksum = data[5] | data[6] << 8 | data[7] << 16 | static_cast<uint32_t>(data[8]) << 24;
+    if (checksum != program.checksum()) {
+        throw std::runtime_error("Input log was recorded with a different program");
+    }
+    if (data[4] == 1) {
+        std::vector<uint8_t> records;
+        for (size_t i = INPUT_LOG_HEADER_SIZE; i < file.size(); ++i) {
+            records.push_back(static_cast<uint8_t>(VirtualMachine::Observation::In));
+            records.push_back(data[i]);
+        }
+        return records;
+    }
+    return std::vector<uint8_t>(data + INPUT_LOG_HEADER_SIZE, data + file.size());
+}
+
+// Replays a recorded run and moves through it by instruction count. Going
+// forward forks a checkpoint every interval instructions (sharing unchanged
+// pages with the previous one), so seeking anywhere re-executes at most
+// interval instructions from the closest checkpoint before the target.
+class Timeline {
+public:
+    Timeline(const ProgramImage& program, std::vector<uint8_t> inputs, uint64_t interval)
+        : inputs(std::move(inputs)), interval(interval ? interval : 1), position(0), end(UINT64_MAX) {
+        static std::istream no_input(nullptr);
+        static std::ostream no_output(nullptr);
+        vm.set_io(no_input, no_output, nullptr);
+        for (int port = 0; port < 256; ++port) {
+            if (!VirtualMachine::interrupt_port(static_cast<uint8_t>(port))) {
+                vm.register_port(static_cast<uint8_t>(port), nullptr, nullptr);
+            }
+        }
+        vm.load_program(program);
+        vm.replay_input(this->inputs.data(), this->inputs.size());
+        checkpoints.push_back({ vm.snapshot(), vm.input_position() });
+    }
+
+    // Instructions retired before the current state
+    uint64_t instruction() const { return position; }
+
+    // Where the program stopped (hlt or a fault), if it has been reached
+    bool finished() const { return position == end; }
+    const std::string& fault() const { return error; }
+
+    const VirtualMachine& machine() const { return vm; }
+
+    // Move to the state after target instructions, or to the end of the run
+    // if it stops earlier
+    void seek(uint64_t target) {
+        if (target > end) target = end;
+        const size_t nearest = static_cast<size_t>(std::min<uint64_t>(target / interval, checkpoints.size() - 1));
+        const uint64_t at = nearest * interval;
+        if (position > target || position < at) {
+            vm.restore(checkpoints[nearest].state);
+            vm.seek_input(checkpoints[nearest].input);
+            position = at;
+            error.clear();
+        }
+        while (position < target) {
+            const uint64_t boundary = (position / interval + 1) * interval;
+            const uint64_t stop = std::min(target, boundary);
+            if (!advance(stop - position)) break;
+            if (position == boundary && boundary / interval == checkpoints.size()) {
+                checkpoints.push_back({ vm.snapshot(checkpoints.back().state), vm.input_position() });
+            }
+        }
+    }
+
+private:
+    struct Checkpoint {
+        VirtualMachine::Snapshot state;
+        VirtualMachine::InputPosition input; // How far into the input log
+    };
+
+    VirtualMachine vm;
+    std::vector<uint8_t> inputs;
+    uint64_t interval;
+    uint64_t position;
+    uint64_t end; // Instruction count where the run stops, UINT64_MAX until reached
+    std::string error;
+    std::vector<Checkpoint> checkpoints; // checkpoints[i] is the state after i * interval instructions
+
+    // Run count more instructions; false once the program has stopped
+    bool advance(uint64_t count) {
+        const uint64_t before = vm.instruction_count();
+        bool stopped;
+        try {
+            stopped = vm.run_for(count);
+        } catch (const std::exception& e) {
+            error = e.what();
+            stopped = true;
+        }
+        position += vm.instruction_count() - before;
+        if (stopped) end = position;
+        return !stopped;
+    }
+};
+
+#ifndef _WIN32
+// Local endpoints: a TCP port on 127.0.0.1 when the name is a number, else
+// the path of a Unix socket
+struct LocalAddress {
+    sockaddr_storage storage;
+    socklen_t size;
+    bool tcp;
+
+    explicit LocalAddress(const std::string& endpoint) : storage(), size(0) {
+        tcp = !endpoint.empty() && endpoint.find_first_not_of("0123456789") == std::string::npos;
+        if (tcp) {
+            if (endpoint.size() > 5 || std::stoul(endpoint) > 65535) {
+                throw std::runtime_error("Port out of range: " + endpoint);
+            }
+            sockaddr_in& addr = reinterpret_cast<sockaddr_in&>(storage);
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(static_cast<uint16_t>(std::stoul(endpoint)));
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            size = sizeof(addr);
+        } else {
+            sockaddr_un& addr = reinterpret_cast<sockaddr_un&>(storage);
+            if (endpoint.empty() || endpoint.size() >= sizeof(addr.sun_path)) {
+                throw std::runtime_error("Bad socket path: " + endpoint);
+            }
+            addr.sun_family = AF_UNIX;
+            std::memcpy(addr.sun_path, endpoint.c_str(), endpoint.size() + 1);
+            size = sizeof(addr);
+        }
+    }
+
+    const sockaddr* get() const { return reinterpret_cast<const sockaddr*>(&storage); }
+};
+
+// Listen for local clients on endpoint, replacing a stale Unix socket
+int listen_local(const std::string& endpoint) {
+    const LocalAddress address(endpoint);
+    const int fd = socket(address.storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    if (address.tcp) {
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    } else {
+        unlink(endpoint.c_str());
+    }
+    if (bind(fd, address.get(), address.size) != 0 || listen(fd, 64) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to listen on " + endpoint + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+int connect_local(const std::string& endpoint) {
+    const LocalAddress address(endpoint);
+    const int fd = socket(address.storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    if (connect(fd, address.get(), address.size) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to connect to " + endpoint + ": " + std::strerror(errno));
+    }
+    if (address.tcp) {
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+// Blocking socket I/O of exactly size bytes; false once the peer is gone
+bool read_full(int fd, void* data, size_t size) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    while (size) {
+        const ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool write_full(int fd, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size) {
+        const ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Serves one debugger over the GDB remote serial protocol, in the subset an
+// 8-bit guest needs: ? g G p P m M s c, Z0/Z1 breakpoints and Z2 write
+// watchpoints (and z to remove them), D to detach and k to kill; Ctrl-C
+// stops a continue. Registers are one byte each: 0-255 the register file,
+// then pc, sp and the flags (VirtualMachine::DEBUG_PC and on). Addresses
+// are those of main memory. Continuing runs unthrottled on the VM's engine,
+// in slices between which the socket is checked for Ctrl-C.
+class DebugServer {
+public:
+    DebugServer(VirtualMachine& vm, const std::string& endpoint)
+        : vm(vm), endpoint(endpoint), listener(listen_local(endpoint)), client(-1),
+          buffered(0), consumed(0), last_stop("S05"), finished(false) {}
+
+    ~DebugServer() {
+        if (client >= 0) ::close(client);
+        ::close(listener);
+        if (endpoint.find_first_not_of("0123456789") != std::string::npos) unlink(endpoint.c_str());
+    }
+
+    DebugServer(const DebugServer&) = delete;
+    DebugServer& operator=(const DebugServer&) = delete;
+
+    // Wait for a debugger and serve it until it kills the guest or goes away,
+    // false, or detaches, true: the guest should then run on without it
+    bool serve(std::ostream& log) {
+        log << "Waiting for a debugger on " << endpoint << std::endl;
+        do {
+            client = accept(listener, nullptr, nullptr);
+        } while (client < 0 && errno == EINTR);
+        if (client < 0) {
+            throw std::runtime_error("Failed to accept a debugger");
+        }
+        const int on = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Fails harmlessly on a Unix socket
+        log << "Debugger attached" << std::endl;
+
+        std::string packet;
+        while (receive(packet)) {
+            if (packet == "k") {
+                return false;
+            }
+            if (packet == "D") {
+                send("OK");
+                for (int addr = 0; addr < 256; ++addr) {
+                    vm.set_breakpoint(static_cast<uint8_t>(addr), false);
+                    vm.set_watchpoint(static_cast<uint8_t>(addr), false);
+                }
+                log << "Debugger detached" << std::endl;
+                return !finished;
+            }
+            std::string reply;
+            try {
+                reply = handle(packet, log);
+            } catch (const std::exception&) {
+                reply = "E01"; // Malformed numbers and out of range registers
+            }
+            send(reply);
+        }
+        return false;
+    }
+
+private:
+    static const uint64_t SLICE = 1 << 16; // Cycles between checks for Ctrl-C
+
+    VirtualMachine& vm;
+    std::string endpoint;
+    int listener;
+    int client;
+    char buffer[4096];
+    size_t buffered, consumed;
+    std::string last_stop; // Reply to ?
+    bool finished; // The guest stopped for good: hlt or a fault
+
+    // The reply to a packet, empty for anything unsupported
+    std::string handle(const std::string& packet, std::ostream& log) {
+        const char kind = packet[0];
+        const std::string args = packet.substr(1);
+        if (kind == '?') {
+            return last_stop;
+        } else if (kind == 'g') {
+            std::string reply;
+            for (unsigned id = 0; id < VirtualMachine::DEBUG_REGISTERS; ++id) reply += hex_byte(vm.debug_register(id));
+            return reply;
+        } else if (kind == 'G') {
+            if (args.size() != 2 * VirtualMachine::DEBUG_REGISTERS) return "E01";
+            for (unsigned id = 0; id < VirtualMachine::DEBUG_REGISTERS; ++id) vm.set_debug_register(id, parse_byte(args, 2 * id));
+            return "OK";
+        } else if (kind == 'p') {
+            return hex_byte(vm.debug_register(static_cast<unsigned>(std::stoul(args, nullptr, 16))));
+        } else if (kind == 'P') {
+            const size_t equals = args.find('=');
+            vm.set_debug_register(static_cast<unsigned>(std::stoul(args.substr(0, equals), nullptr, 16)),
+                                  parse_byte(args, equals + 1));
+            return "OK";
+        } else if (kind == 'm' || kind == 'M') {
+            const size_t comma = args.find(',');
+            const unsigned long addr = std::stoul(args.substr(0, comma), nullptr, 16);
+            const unsigned long size = std::stoul(args.substr(comma + 1), nullptr, 16);
+            if (comma == std::string::npos || addr + size > 256) return "E01";
+            std::string reply;
+            if (kind == 'm') {
+                for (unsigned long i = 0; i < size; ++i) reply += hex_byte(vm.peek(static_cast<uint8_t>(addr + i)));
+                return reply;
+            }
+            const size_t colon = args.find(':');
+            if (colon == std::string::npos || args.size() - colon - 1 != 2 * size) return "E01";
+            for (unsigned long i = 0; i < size; ++i) vm.poke(static_cast<uint8_t>(addr + i), parse_byte(args, colon + 1 + 2 * i));
+            return "OK";
+        } else if (kind == 's' || kind == 'c') {
+            if (!args.empty()) vm.set_debug_register(VirtualMachine::DEBUG_PC, static_cast<uint8_t>(std::stoul(args, nullptr, 16)));
+            if (!finished) last_stop = resume(kind == 's', log);
+            return last_stop;
+        } else if (kind == 'Z' || kind == 'z') {
+            // Z type,addr,kind: the kind of a watchpoint is its length
+            const size_t first = args.find(','), second = args.find(',', first + 1);
+            if (first == std::string::npos || second == std::string::npos) return "E01";
+            const unsigned long type = std::stoul(args.substr(0, first), nullptr, 16);
+            const unsigned long addr = std::stoul(args.substr(first + 1, second - first - 1), nullptr, 16);
+            const unsigned long size = std::stoul(args.substr(second + 1), nullptr, 16);
+            if (type > 2) return ""; // Read and access watchpoints would need a check on every load
+            if (addr > 0xff || (type == 2 && addr + size > 256)) return "E01";
+            if (type < 2) {
+                vm.set_breakpoint(static_cast<uint8_t>(addr), kind == 'Z');
+            } else {
+                for (unsigned long i = 0; i < size; ++i) vm.set_watchpoint(static_cast<uint8_t>(addr + i), kind == 'Z');
+            }
+            return "OK";
+        } else if (packet.compare(0, 10, "qSupported") == 0) {
+            return "PacketSize=400";
+        } else if (packet == "qAttached") {
+            return "1";
+        } else if (kind == 'H' || kind == 'T') {
+            return "OK"; // There is just the one thread
+        }
+        return "";
+    }
+
+    // Step or continue and return the stop reply. A continue first steps
+    // over a breakpoint at pc, then runs until anything stops the guest.
+    std::string resume(bool single, std::ostream& log) {
+        bool halted;
+        try {
+            halted = !vm.step();
+            while (!single && !halted && vm.stop_reason() == VirtualMachine::Stop::None) {
+                halted = vm.run_for(SLICE);
+                if (!halted && interrupted()) return "S02";
+            }
+        } catch (const std::exception& e) {
+            log << "Error: " << e.what() << std::endl;
+            finished = true;
+            return "S04";
+        }
+        switch (vm.stop_reason()) {
+            case VirtualMachine::Stop::Breakpoint: return "S05";
+            case VirtualMachine::Stop::Watchpoint: return "T05watch:" + hex_byte(vm.watch_address()) + ";";
+            default: break;
+        }
+        if (halted) {
+            finished = true;
+            return "W00";
+        }
+        return "S05";
+    }
+
+    // Whether the debugger sent Ctrl-C (or hung up) while the guest ran
+    bool interrupted() {
+        pollfd fd = { client, POLLIN, 0 };
+        if (consumed == buffered && poll(&fd, 1, 0) <= 0) return false;
+        for (int c; (c = get(false)) >= 0;) {
+            if (c == 0x03) return true;
+        }
+        return consumed == buffered && buffered == 0; // Hung up
+    }
+
+    // Next byte from the client, -1 once it is gone or, without wait, when
+    // nothing has arrived yet
+    int get(bool wait = true) {
+        if (consumed == buffered) {
+            if (!wait) {
+                pollfd fd = { client, POLLIN, 0 };
+                if (poll(&fd, 1, 0) <= 0) return -1;
+            }
+            ssize_t n;
+            do {
+                n = recv(client, buffer, sizeof(buffer), 0);
+            } while (n < 0 && errno == EINTR);
+            consumed = 0;
+            buffered = n > 0 ? static_cast<size_t>(n) : 0;
+            if (buffered == 0) return -1;
+        }
+        return static_cast<unsigned char>(buffer[consumed++]);
+    }
+
+    // Payload of the next packet with a good checksum, acknowledging it;
+    // false once the client is gone. Acks and a stray Ctrl-C are skipped.
+    bool receive(std::string& packet) {
+        for (;;) {
+            int c = get();
+            if (c < 0) return false;
+            if (c != '$') continue;
+            packet.clear();
+            unsigned sum = 0;
+            while ((c = get()) >= 0 && c != '#') {
+                packet += static_cast<char>(c);
+                sum += static_cast<unsigned>(c);
+            }
+            const int high = get(), low = get();
+            if (low < 0) return false;
+            const bool good = hex_digit(high) >= 0 && hex_digit(low) >= 0
+                && static_cast<unsigned>(hex_digit(high) << 4 | hex_digit(low)) == (sum & 0xff);
+            write_all(good ? "+" : "-");
+            if (good && !packet.empty()) return true;
+        }
+    }
+
+    void send(const std::string& payload) {
+        unsigned sum = 0;
+        for (char c : payload) sum += static_cast<unsigned char>(c);
+        write_all("$" + payload + "#" + hex_byte(static_cast<uint8_t>(sum)));
+    }
+
+    void write_all(const std::string& data) {
+        write_full(client, data.data(), data.size()); // If the client is gone, the next receive() notices
+    }
+
+    static std::string hex_byte(uint8_t value) {
+        static const char HEX[] = "0123456789abcdef";
+        return { HEX[value >> 4], HEX[value & 0xf] };
+    }
+
+    static int hex_digit(int c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static uint8_t parse_byte(const std::string& text, size_t at) {
+        const int high = at + 1 < text.size() ? hex_digit(text[at]) : -1;
+        const int low = high >= 0 ? hex_digit(text[at + 1]) : -1;
+        if (low < 0) {
+            throw std::runtime_error("Bad hex byte");
+        }
+        return static_cast<uint8_t>(high << 4 | low);
+    }
+};
+
+// Runs jobs for local clients on a pool of VMs, so a job costs a reset
+// instead of a process start, I/O setup and program load. A job is a
+// program (an image or raw binary, as in a file) or the checksum of one sent
+// before, the bytes in reads (0 once they run out) and an instruction budget.
+// Programs are cached by ProgramImage::checksum(), and a job goes to an idle
+// VM that last ran the same program when there is one, so the code it
+// decoded (or compiled) is reused: reset() only rewrites bytes that differ.
+//
+// Requests and replies, multi-byte fields little-endian:
+//    0  magic "N8RQ"                      0  magic "N8RS"
+//    4  type (RequestType)                4  status (Status)
+//    5  program checksum, for Cached      5  program checksum
+//    9  image size, for Image             9  pc, sp, flags (e, l, m in bits 0-2)
+//   13  input size                       12  r1-r4, e1-e4, x1-x4
+//   17  instruction budget, 0 for max  24  instructions, cycles (8 bytes each)
+//   25  image, then input                40  microseconds from request to reply
+//                                        44  output size (4), message size (2)
+//                                        50  output, then the fault or error
+// A Stats request is the header alone; its reply carries the counters as
+// text in the message.
+class ExecutionServer {
+public:
+    enum class RequestType : uint8_t { Image, Cached, Stats };
+    enum class Status : uint8_t { Halted, Fault, Limit, UnknownProgram, BadRequest };
+
+    static const size_t REQUEST_HEADER_SIZE = 25;
+    static const size_t REPLY_HEADER_SIZE = 50;
+    static const size_t MAX_IMAGE = 1 << 16;
+    static const size_t MAX_INPUT_BYTES = 1 << 20;
+    static constexpr size_t MAX_OUTPUT = 1 << 20; // Output past this is dropped
+
+    struct Reply {
+        Status status;
+        uint32_t program;
+        uint8_t pc, sp, flags;
+        std::array<uint8_t, 12> registers;
+        uint64_t instructions, cycles;
+        uint32_t micros;
+        std::string output, message;
+    };
+
+    ExecutionServer(const std::string& endpoint, Engine engine, uint64_t max_instructions, unsigned workers)
+        : endpoint(endpoint), max_instructions(max_instructions), slot_count(workers ? workers : 1),
+          slots(new Slot[slot_count]), idle(slot_count), uses(0),
+          requests(0), failed(0), warm(0), instructions(0), latencies(), latency_next(0),
+          started(std::chrono::steady_clock::now()), last_report(started), last_requests(0), last_instructions(0) {
+        for (size_t i = 0; i < slot_count; ++i) {
+            VirtualMachine& vm = slots[i].vm;
+            vm.set_engine(engine);
+            vm.set_io(std::cin, std::cout, nullptr); // in reads the job's bytes; print goes to the slot
+            vm.register_port(0, collect_output, &slots[i]);
+        }
+        listener = listen_local(endpoint);
+    }
+
+    ~ExecutionServer() {
+        {
+            std::lock_guard<std::mutex> guard(connections_lock);
+            for (const Connection& c : connections) shutdown(c.fd, SHUT_RDWR);
+        }
+        for (Connection& c : connections) c.thread.join();
+        ::close(listener);
+        if (endpoint.find_first_not_of("0123456789") != std::string::npos) unlink(endpoint.c_str());
+    }
+
+    ExecutionServer(const ExecutionServer&) = delete;
+    ExecutionServer& operator=(const ExecutionServer&) = delete;
+
+    // Accept clients until the process is stopped, each on its own thread;
+    // a client may send any number of requests, one after the other
+    void serve(std::ostream& log) {
+        log << "Serving on " << endpoint << " with " << slot_count << " VMs" << std::endl;
+        for (;;) {
+            const int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                throw std::runtime_error("Failed to accept a client");
+            }
+            const int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Fails harmlessly on a Unix socket
+            std::lock_guard<std::mutex> guard(connections_lock);
+            for (size_t i = 0; i < connections.size();) { // Reap clients that left
+                if (connections[i].done->load()) {
+                    connections[i].thread.join();
+                    connections[i] = std::move(connections.back());
+                    connections.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+            auto done = std::make_shared<std::atomic<bool>>(false);
+            connections.push_back({ fd, done, std::thread([this, fd, done] {
+                client(fd);
+                ::close(fd);
+                done->store(true);
+            }) });
+        }
+    }
+
+    // Request encoding, for clients
+    static std::string request(RequestType type, uint32_t program, const std::vector<uint8_t>& image,
+                               const uint8_t* input, size_t input_size, uint64_t budget) {
+        std::string out("N8RQ");
+        out += static_cast<char>(type);
+        put(out, program, 4);
+        put(out, type == RequestType::Image ? image.size() : 0, 4);
+        put(out, input_size, 4);
+        put(out, budget, 8);
+        if (type == RequestType::Image) out.append(image.begin(), image.end());
+        if (input_size) out.append(reinterpret_cast<const char*>(input), input_size);
+        return out;
+    }
+
+    // Read one reply from fd; false if the server went away
+    static bool read_reply(int fd, Reply& reply) {
+        uint8_t h[REPLY_HEADER_SIZE];
+        if (!read_full(fd, h, sizeof(h))) return false;
+        if (std::memcmp(h, "N8RS", 4) != 0 || h[4] > static_cast<uint8_t>(Status::BadRequest)) {
+            throw std::runtime_error("Not a server reply");
+        }
+        reply.status = static_cast<Status>(h[4]);
+        reply.program = static_cast<uint32_t>(get(h + 5, 4));
+        reply.pc = h[9];
+        reply.sp = h[10];
+        reply.flags = h[11];
+        std::copy(h + 12, h + 24, reply.registers.begin());
+        reply.instructions = get(h + 24, 8);
+        reply.cycles = get(h + 32, 8);
+        reply.micros = static_cast<uint32_t>(get(h + 40, 4));
+        reply.output.resize(get(h + 44, 4));
+        reply.message.resize(get(h + 48, 2));
+        return read_full(fd, &reply.output[0], reply.output.size())
+            && read_full(fd, &reply.message[0], reply.message.size());
+    }
+
+private:
+    static const size_t MAX_PROGRAMS = 4096; // Cached programs; the oldest goes first
+    static constexpr size_t LATENCY_WINDOW = 1 << 16; // Requests the percentiles are taken over
+
+    // A pooled VM, set up once, and what its last job left behind
+    struct Slot {
+        VirtualMachine vm;
+        std::string output;
+        uint32_t program = 0; // Checksum of the last program run
+        bool loaded = false;
+        bool busy = false;
+        uint64_t last_use = 0;
+    };
+
+    struct Connection {
+        int fd;
+        std::shared_ptr<std::atomic<bool>> done;
+        std::thread thread;
+    };
+
+    std::string endpoint;
+    uint64_t max_instructions;
+    int listener;
+
+    size_t slot_count;
+    std::unique_ptr<Slot[]> slots;
+    std::mutex pool_lock;
+    std::condition_variable slot_freed;
+    size_t idle;
+    uint64_t uses;
+
+    std::mutex programs_lock;
+    std::unordered_map<uint32_t, std::shared_ptr<const ProgramImage>> programs;
+    std::deque<uint32_t> program_order;
+
+    std::mutex connections_lock;
+    std::vector<Connection> connections;
+
+    // Counters, under stats_lock
+    std::mutex stats_lock;
+    uint64_t requests, failed, warm, instructions;
+    std::array<uint32_t, LATENCY_WINDOW> latencies; // Microseconds, the last LATENCY_WINDOW requests
+    size_t latency_next;
+    std::chrono::steady_clock::time_point started, last_report;
+    uint64_t last_requests, last_instructions; // At last_report
+
+    static void put(std::string& out, uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) out += static_cast<char>(value >> (8 * i));
+    }
+
+    static uint64_t get(const uint8_t* data, int bytes) {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; ++i) value |= static_cast<uint64_t>(data[i]) << (8 * i);
+        return value;
+    }
+
+    static void collect_output(void* context, const uint8_t* data, size_t size) {
+        std::string& output = static_cast<Slot*>(context)->output;
+        output.append(reinterpret_cast<const char*>(data), std::min(size, MAX_OUTPUT - std::min(MAX_OUTPUT, output.size())));
+    }
+
+    // Serve one client until it hangs up or sends something malformed
+    void client(int fd) {
+        uint8_t header[REQUEST_HEADER_SIZE];
+        std::vector<uint8_t> body;
+        while (read_full(fd, header, sizeof(header))) {
+            const auto start = std::chrono::steady_clock::now();
+            const size_t image_size = get(header + 9, 4);
+            const size_t input_size = get(header + 13, 4);
+            if (std::memcmp(header, "N8RQ", 4) != 0 || header[4] > static_cast<uint8_t>(RequestType::Stats)
+                || image_size > MAX_IMAGE || input_size > MAX_INPUT_BYTES) {
+                Reply reply = Reply();
+                reply.status = Status::BadRequest;
+                reply.message = "Malformed request";
+                const std::string data = encode(reply);
+                write_full(fd, data.data(), data.size());
+                return; // The stream cannot be trusted past this
+            }
+            body.resize(image_size + input_size);
+            if (!read_full(fd, body.data(), body.size())) return;
+
+            Reply reply = Reply();
+            const RequestType type = static_cast<RequestType>(header[4]);
+            if (type == RequestType::Stats) {
+                reply.message = statistics();
+            } else {
+                run(type, static_cast<uint32_t>(get(header + 5, 4)), body.data(), image_size,
+                    body.data() + image_size, input_size, get(header + 17, 8), reply);
+            }
+            const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            reply.micros = static_cast<uint32_t>(std::min<int64_t>(elapsed.count(), UINT32_MAX));
+            if (type != RequestType::Stats) record(reply);
+            const std::string data = encode(reply);
+            if (!write_full(fd, data.data(), data.size())) return;
+        }
+    }
+
+    void run(RequestType type, uint32_t checksum, const uint8_t* image, size_t image_size,
+             const uint8_t* input, size_t input_size, uint64_t budget, Reply& reply) {
+        std::shared_ptr<const ProgramImage> program;
+        try {
+            if (type == RequestType::Image) {
+                program = std::make_shared<const ProgramImage>(parse_program(image, image_size));
+                checksum = program->checksum();
+                remember(checksum, program);
+            } else {
+                std::lock_guard<std::mutex> guard(programs_lock);
+                auto found = programs.find(checksum);
+                if (found != programs.end()) program = found->second;
+            }
+        } catch (const std::exception& e) {
+            reply.status = Status::BadRequest;
+            reply.message = e.what();
+            return;
+        }
+        reply.program = checksum;
+        if (!program) {
+            reply.status = Status::UnknownProgram;
+            return;
+        }
+
+        Slot& slot = acquire(checksum);
+        if (slot.loaded && slot.program == checksum) {
+            std::lock_guard<std::mutex> guard(stats_lock);
+            ++warm;
+        }
+        VirtualMachine& vm = slot.vm;
+        slot.output.clear();
+        try {
+            vm.reset(*program);
+            vm.set_input_bytes(input, input_size);
+            reply.status = run_budget(vm, budget ? std::min(budget, max_instructions) : max_instructions) ? Status::Halted : Status::Limit;
+        } catch (const std::exception& e) {
+            reply.status = Status::Fault;
+            reply.message = e.what();
+        }
+        vm.set_input_bytes(nullptr, 0);
+        reply.pc = vm.program_counter();
+        reply.sp = vm.debug_register(VirtualMachine::DEBUG_SP);
+        reply.flags = vm.debug_register(VirtualMachine::DEBUG_FLAGS);
+        for (int bank = 0; bank < 3; ++bank) {
+            for (int i = 0; i < 4; ++i) reply.registers[bank * 4 + i] = vm.debug_register(static_cast<unsigned>(bank << 4 | (i + 1)));
+        }
+        reply.instructions = vm.instruction_count();
+        reply.cycles = vm.cycle_count();
+        reply.output.swap(slot.output);
+        slot.program = checksum;
+        slot.loaded = true;
+        release(slot);
+    }
+
+    // Run until hlt or until budget instructions have retired; false if the
+    // budget ran out. run_for() counts cycles, which mcpy stalls and waiting
+    // in hlt add to, so it is given what is left of the budget until that
+    // is spent. A guest that waits out a whole slice without retiring an
+    // instruction has run out too.
+    static bool run_budget(VirtualMachine& vm, uint64_t budget) {
+        const uint64_t start = vm.instruction_count();
+        for (;;) {
+            const uint64_t done = vm.instruction_count() - start;
+            if (done >= budget) return false;
+            if (vm.run_for(budget - done)) return true;
+            if (vm.instruction_count() - start == done) return false;
+        }
+    }
+
+    void remember(uint32_t checksum, const std::shared_ptr<const ProgramImage>& program) {
+        std::lock_guard<std::mutex> guard(programs_lock);
+        auto found = programs.find(checksum);
+        if (found != programs.end()) {
+            found->second = program; // A resent program is authoritative
+            return;
+        }
+        if (programs.size() == MAX_PROGRAMS) {
+            programs.erase(program_order.front());
+            program_order.pop_front();
+        }
+        programs.emplace(checksum, program);
+        program_order.push_back(checksum);
+    }
+
+    // An idle VM, preferably one that last ran program, else the one idle
+    // longest; waits while every VM is busy
+    Slot& acquire(uint32_t program) {
+        std::unique_lock<std::mutex> guard(pool_lock);
+        slot_freed.wait(guard, [&] { return idle > 0; });
+        Slot* best = nullptr;
+        for (size_t i = 0; i < slot_count; ++i) {
+            Slot& slot = slots[i];
+            if (slot.busy) continue;
+            const bool matches = slot.loaded && slot.program == program;
+            if (!best || (matches && !(best->loaded && best->program == program))
+                || (matches == (best->loaded && best->program == program) && slot.last_use < best->last_use)) {
+                best = &slot;
+            }
+        }
+        best->busy = true;
+        best->last_use = ++uses;
+        --idle;
+        return *best;
+    }
+
+    void release(Slot& slot) {
+        {
+            std::lock_guard<std::mutex> guard(pool_lock);
+            slot.busy = false;
+            ++idle;
+        }
+        slot_freed.notify_one();
+    }
+
+    void record(const Reply& reply) {
+        std::lock_guard<std::mutex> guard(stats_lock);
+        ++requests;
+        if (reply.status == Status::UnknownProgram || reply.status == Status::BadRequest) ++failed;
+        instructions += reply.instructions;
+        latencies[latency_next++ % LATENCY_WINDOW] = reply.micros;
+    }
+
+    // One line: totals since the start, latency percentiles over the last
+    // LATENCY_WINDOW requests and throughput since the previous report
+    std::string statistics() {
+        std::lock_guard<std::mutex> guard(stats_lock);
+        const size_t count = std::min<size_t>(latency_next, LATENCY_WINDOW);
+        std::vector<uint32_t> window(latencies.begin(), latencies.begin() + count);
+        auto percentile = [&](double p) -> uint32_t {
+            if (window.empty()) return 0;
+            const size_t rank = static_cast<size_t>(p * (window.size() - 1));
+            std::nth_element(window.begin(), window.begin() + rank, window.end());
+            return window[rank];
+        };
+        const auto now = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(now - last_report).count();
+        std::ostringstream line;
+        line << "requests " << requests << " failed " << failed << " warm " << warm
+             << " programs " << cached_programs()
+             << " p50_us " << percentile(0.50) << " p99_us " << percentile(0.99)
+             << std::fixed << std::setprecision(0)
+             << " requests_per_s " << (seconds > 0.0 ? (requests - last_requests) / seconds : 0.0)
+             << " instructions_per_s " << (seconds > 0.0 ? (instructions - last_instructions) / seconds : 0.0)
+             << std::setprecision(3) << " uptime_s " << std::chrono::duration<double>(now - started).count();
+        last_report = now;
+        last_requests = requests;
+        last_instructions = instructions;
+        return line.str();
+    }
+
+    size_t cached_programs() {
+        std::lock_guard<std::mutex> guard(programs_lock);
+        return programs.size();
+    }
+
+    static std::string encode(const Reply& reply) {
+        std::string out("N8RS");
+        out += static_cast<char>(reply.status);
+        put(out, reply.program, 4);
+        out += static_cast<char>(reply.pc);
+        out += static_cast<char>(reply.sp);
+        out += static_cast<char>(reply.flags);
+        out.append(reply.registers.begin(), reply.registers.end());
+        put(out, reply.instructions, 8);
+        put(out, reply.cycles, 8);
+        put(out, reply.micros, 4);
+        put(out, reply.output.size(), 4);
+        const size_t message = std::min<size_t>(reply.message.size(), 0xffff);
+        put(out, message, 2);
+        out += reply.output;
+        out.append(reply.message, 0, message);
+        return out;
+    }
+};
+
+// Load generator for an ExecutionServer: connections clients on their own
+// threads send requests runs between them, each client's first with the
+// program image and the rest by checksum. Reports the latency the clients
+// saw, the throughput and the server's own counters.
+class LoadGenerator {
+public:
+    LoadGenerator(const std::string& endpoint, const ProgramImage& program, uint64_t budget)
+        : endpoint(endpoint), budget(budget), statuses(), lost(0), seconds(0.0) {
+        image = encode_image({ { 0, SectionKind::Bytes, 256, std::vector<uint8_t>(program.memory.begin(), program.memory.end()) } },
+                             program.entry, program.stack_pointer);
+        checksum = program.checksum();
+    }
+
+    // inputs are (offset, size) slices of text, used in turn
+    void run(uint64_t runs, unsigned connections, const std::string& text,
+             const std::vector<std::pair<size_t, size_t>>& inputs) {
+        connections = std::max(1u, connections);
+        std::vector<std::vector<uint32_t>> latencies(connections);
+        std::vector<std::array<uint64_t, 5>> counts(connections);
+        std::vector<uint64_t> failures(connections, 0);
+        std::vector<std::string> errors(connections);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned c = 0; c < connections; ++c) {
+            threads.emplace_back([&, c] {
+                counts[c].fill(0);
+                try {
+                    const int fd = connect_local(endpoint);
+                    bool sent_image = false;
+                    for (uint64_t i = c; i < runs; i += connections) {
+                        const std::pair<size_t, size_t> input = inputs.empty() ? std::make_pair(size_t(0), size_t(0))
+                                                                               : inputs[i % inputs.size()];
+                        const uint8_t* data = reinterpret_cast<const uint8_t*>(text.data()) + input.first;
+                        ExecutionServer::Reply reply;
+                        const auto sent = std::chrono::steady_clock::now();
+                        for (int attempt = 0; attempt < 2; ++attempt) { // Resend the image if it fell out of the cache
+                            const std::string req = ExecutionServer::request(
+                                sent_image ? ExecutionServer::RequestType::Cached : ExecutionServer::RequestType::Image,
+                                checksum, image, data, input.second, budget);
+                            if (!write_full(fd, req.data(), req.size()) || !ExecutionServer::read_reply(fd, reply)) {
+                                ::close(fd);
+                                throw std::runtime_error("Server closed the connection");
+                            }
+                            sent_image = true;
+                            if (reply.status != ExecutionServer::Status::UnknownProgram) break;
+                            sent_image = false;
+                        }
+                        const auto elapsed = std::chrono::steady_clock::now() - sent;
+                        latencies[c].push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+                        ++counts[c][static_cast<size_t>(reply.status)];
+                    }
+                    ::close(fd);
+                } catch (const std::exception& e) {
+                    errors[c] = e.what();
+                }
+            });
+        }
+        for (std::thread& t : threads) t.join();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        all.clear();
+        statuses.fill(0);
+        for (unsigned c = 0; c < connections; ++c) {
+            all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+            for (size_t s = 0; s < statuses.size(); ++s) statuses[s] += counts[c][s];
+            if (!errors[c].empty()) error = errors[c];
+        }
+        lost = runs - all.size();
+        std::sort(all.begin(), all.end());
+
+        // The server's counters, over the same stretch as ours when nothing else ran
+        try {
+            const int fd = connect_local(endpoint);
+            const std::string req = ExecutionServer::request(ExecutionServer::RequestType::Stats, 0, {}, nullptr, 0, 0);
+            ExecutionServer::Reply reply;
+            if (write_full(fd, req.data(), req.size()) && ExecutionServer::read_reply(fd, reply)) server = reply.message;
+            ::close(fd);
+        } catch (const std::exception& e) {
+            if (error.empty()) error = e.what();
+        }
+    }
+
+    void write(std::ostream& out) const {
+        auto percentile = [&](double p) -> uint32_t {
+            return all.empty() ? 0 : all[static_cast<size_t>(p * (all.size() - 1))];
+        };
+        out << std::dec << "requests " << all.size() << " halted " << statuses[0] << " fault " << statuses[1]
+            << " limit " << statuses[2] << " failed " << statuses[3] + statuses[4] + lost
+            << " p50_us " << percentile(0.50) << " p99_us " << percentile(0.99)
+            << std::fixed << std::setprecision(0) << " requests_per_s " << (seconds > 0.0 ? all.size() / seconds : 0.0)
+            << std::setprecision(3) << " seconds " << seconds << std::endl;
+        if (!server.empty()) out << "server " << server << std::endl;
+        if (!error.empty()) out << "error " << error << std::endl;
+    }
+
+    // Whether every request got a reply and none was refused
+    bool ok() const {
+        return lost == 0 && statuses[3] == 0 && statuses[4] == 0 && error.empty();
+    }
+
+private:
+    std::string endpoint;
+    uint64_t budget;
+    std::vector<uint8_t> image;
+    uint32_t checksum;
+    std::vector<uint32_t> all; // Latencies in microseconds, sorted
+    std::array<uint64_t, 5> statuses; // Replies per ExecutionServer::Status
+    uint64_t lost; // Requests without a reply
+    double seconds;
+    std::string server, error;
+};
+
+#endif
+
+// Coverage-guided fuzzing of what a program reads through in. One VM is
+// restored from a snapshot of the loaded program before every execution, so
+// an iteration costs a restore of the bytes the last run changed. Inputs that
+// reach an edge no earlier input did join the corpus; faults are kept as
+// crashes, one per fault and address.
+class Fuzzer {
+public:
+    static const size_t MAX_INPUT_BYTES = 256;
+
+    struct Crash {
+        std::string error;
+        uint8_t pc; // Faulting instruction
+        std::vector<uint8_t> input;
+    };
+
+    Fuzzer(const ProgramImage& program, uint64_t max_cycles, uint64_t seed)
+        : max_cycles(max_cycles), rng(seed ? seed : 0x9e3779b97f4a7c15ull),
+          trace(), seen(), executions(0), hangs(0) {
+        static std::istream no_input(nullptr);
+        static std::ostream no_output(nullptr);
+        vm.set_io(no_input, no_output, nullptr);
+        for (int port = 0; port < 256; ++port) {
+            if (!VirtualMachine::interrupt_port(static_cast<uint8_t>(port))) {
+                vm.register_port(static_cast<uint8_t>(port), nullptr, nullptr);
+            }
+        }
+        vm.load_program(program);
+        base = vm.snapshot();
+        vm.set_coverage(reinterpret_cast<uint8_t*>(trace.data()));
+    }
+
+    // Execute input once; returns true if it reached new edges, which also
+    // adds it to the corpus
+    bool run_input(const uint8_t* data, size_t size) {
+        vm.restore(base);
+        trace.fill(0);
+        vm.set_input_bytes(data, size);
+        try {
+            if (!vm.run_for(max_cycles)) ++hangs;
+        } catch (const std::exception& e) {
+            record_crash(e.what(), data, size);
+        }
+        vm.set_input_bytes(nullptr, 0);
+        ++executions;
+
+        bool fresh = false;
+        for (size_t i = 0; i < trace.size(); ++i) {
+            if (trace[i] & ~seen[i]) {
+                seen[i] |= trace[i];
+                fresh = true;
+            }
+        }
+        if (fresh) corpus.emplace_back(data, data + size);
+        return fresh;
+    }
+
+    // Seeds always join the corpus so mutation can start from them
+    void add_seed(const uint8_t* data, size_t size) {
+        if (!run_input(data, size)) corpus.emplace_back(data, data + size);
+    }
+
+    // Mutate corpus entries for the given number of executions, printing
+    // progress to log about once a second
+    void fuzz(uint64_t iterations, std::ostream& log) {
+        if (corpus.empty()) add_seed(nullptr, 0);
+        auto start = std::chrono::steady_clock::now();
+        auto last = start;
+        std::vector<uint8_t> input;
+        for (uint64_t i = 0; i < iterations; ++i) {
+            mutate(input);
+            run_input(input.data(), input.size());
+            if ((i & 0x3ff) == 0) {
+                auto now = std::chrono::steady_clock::now();
+                if (now - last >= std::chrono::seconds(1)) {
+                    last = now;
+                    report(log, std::chrono::duration<double>(now - start).count());
+                }
+            }
+        }
+        report(log, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // One line per crash: index, pc, error, input as hex
+    void write(std::ostream& out) const {
+        static const char HEX[] = "0123456789abcdef";
+        std::string line;
+        for (size_t i = 0; i < crash_list.size(); ++i) {
+            const Crash& c = crash_list[i];
+            line.clear();
+            line += std::to_string(i);
+            line += '\t';
+            line += HEX[c.pc >> 4];
+            line += HEX[c.pc & 0xf];
+            line += '\t';
+            line += c.error;
+            line += '\t';
+            for (uint8_t b : c.input) {
+                line += HEX[b >> 4];
+                line += HEX[b & 0xf];
+            }
+            line += '\n';
+            out << line;
+        }
+    }
+
+    const std::vector<Crash>& crashes() const { return crash_list; }
+
+    size_t edge_count() const {
+        size_t count = 0;
+        for (uint64_t word : seen) {
+            for (; word; word &= word - 1) ++count;
+        }
+        return count;
+    }
+
+private:
+    VirtualMachine vm;
+    VirtualMachine::Snapshot base;
+    uint64_t max_cycles;
+    uint64_t rng;
+    std::array<uint64_t, VirtualMachine::COVERAGE_BYTES / 8> trace; // This execution
+    std::array<uint64_t, VirtualMachine::COVERAGE_BYTES / 8> seen; // Every execution so far
+    std::vector<std::vector<uint8_t>> corpus;
+    std::vector<Crash> crash_list;
+    std::unordered_map<std::string, size_t> crash_index; // Error and pc to crash_list
+    uint64_t executions, hangs;
+
+    uint64_t next_random() { // xorshift64*
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return rng * 0x2545f4914f6cdd1dull;
+    }
+
+    size_t below(size_t n) {
+        return static_cast<size_t>(next_random() % n);
+    }
+
+    void record_crash(const std::string& error, const uint8_t* data, size_t size) {
+        std::string key = error;
+        key += '@';
+        key += static_cast<char>(vm.fault_address());
+        if (!crash_index.emplace(key, crash_list.size()).second) return;
+        crash_list.push_back({ error, vm.fault_address(), std::vector<uint8_t>(data, data + size) });
+    }
+
+    // A random corpus entry with a few stacked byte-level changes
+    void mutate(std::vector<uint8_t>& input) {
+        static const uint8_t INTERESTING[] = { 0x00, 0x01, 0x0a, 0x20, 0x30, 0x7f, 0x80, 0xfe, 0xff };
+        input = corpus[below(corpus.size())];
+        const size_t changes = 1 + below(4);
+        for (size_t k = 0; k < changes; ++k) {
+            switch (below(6)) {
+                case 0: // Flip a bit
+                    if (!input.empty()) input[below(input.size())] ^= static_cast<uint8_t>(1u << below(8));
+                    break;
+                case 1: // Random byte
+                    if (!input.empty()) input[below(input.size())] = static_cast<uint8_t>(next_random());
+                    break;
+                case 2: // Interesting byte
+                    if (!input.empty()) input[below(input.size())] = INTERESTING[below(sizeof(INTERESTING))];
+                    break;
+                case 3: // Insert a byte
+                    if (input.size() < MAX_INPUT_BYTES) {
+                        input.insert(input.begin() + below(input.size() + 1), static_cast<uint8_t>(next_random()));
+                    }
+                    break;
+                case 4: // Delete a byte
+                    if (!input.empty()) input.erase(input.begin() + below(input.size()));
+                    break;
+                default: { // Splice in the tail of another entry
+                    const std::vector<uint8_t>& other = corpus[below(corpus.size())];
+                    if (other.empty()) break;
+                    size_t at = below(input.size() + 1);
+                    input.resize(at);
+                    input.insert(input.end(), other.begin() + below(other.size()), other.end());
+                    if (input.size() > MAX_INPUT_BYTES) input.resize(MAX_INPUT_BYTES);
+                    break;
+                }
+            }
+        }
+    }
+
+    void report(std::ostream& log, double seconds) const {
+        StreamFormat format(log);
+        log << std::dec << "#" << executions << " " << std::fixed << std::setprecision(0)
+            << (seconds > 0.0 ? executions / seconds : 0.0) << " execs/s, corpus " << corpus.size()
+            << ", edges " << edge_count() << ", crashes " << crash_list.size()
+            << ", hangs " << hangs << std::endl;
+    }
+};
+
+// Synthetic programs that each stress one part of the VM, run unthrottled for
+// a fixed number of cycles and repeated to expose noise. Every case is an
+// endless loop, so all of them retire exactly the requested cycle budget.
+class BenchmarkSuite {
+public:
+    struct Case {
+        std::string name;
+        std::string source;
+    };
+
+    struct Result {
+        std::string name;
+        uint64_t instructions; // Per run
+        double mean_ns, stddev_ns, min_ns; // Per instruction, over the timed runs
+    };
+
+    static std::vector<Case> cases() {
+        static const char* const ALU_OPS[] = { "mov", "add", "sub", "mul", "div", "and", "or", "xor", "not", "nor", "nand" };
+        struct Mode { const char* name; const char* dst; const char* src; };
+        static const Mode MODES[] = {
+            { "reg", "r3", "r4" }, { "mem", "[0xf0]", "[0xf1]" }, { "ind", "[r1]", "[r2]" }
+        };
+        const std::string prologue =
+            "start:\n  lea r1, 0xf0\n  lea r2, 0xf1\n  lea r3, 7\n  lea r4, 3\n";
+        const std::string data = ".org 0xf0\n  db 7, 3\n";
+
+        std::vector<Case> list;
+        for (const char* op : ALU_OPS) {
+            for (const Mode& mode : MODES) {
+                std::string line = std::string("  ") + op + " " + mode.dst;
+                if (std::strcmp(op, "not") != 0) line = line + ", " + mode.src;
+                std::string body;
+                for (int i = 0; i < 8; ++i) body += line + "\n";
+                list.push_back({ std::string("alu.") + op + "." + mode.name,
+                                 prologue + "loop:\n" + body + "  jmp loop\n" + data });
+            }
+        }
+        list.push_back({ "call.recursion",
+            "start:\n  lea r2, 1\n"
+            "loop:\n  lea r1, 40\n  cal rec\n  jmp loop\n"
+            "rec:\n  cmp r1, 0\n  je base\n  sub r1, r2\n  cal rec\n"
+            "base:\n  ret\n" });
+        list.push_back({ "stack.push_pop",
+            "start:\n  lea r1, 1\n  lea r2, 2\n"
+            "loop:\n  push r1\n  push r2\n  push [0xf0]\n  push 5\n"
+            "  pop r3\n  pop [0xf1]\n  pop r4\n  pop r3\n  jmp loop\n" + data });
+        list.push_back({ "branch.compare",
+            "start:\n  lea r2, 1\n"
+            "loop:\n  add r1, r2\n  cmp r1, 100\n  jl low\n  cmp r1, 200\n  jm high\n  jne loop\n"
+            "low:\n  cmp r1, 50\n  je loop\n  jmp loop\n"
+            "high:\n  xor r1, r1\n  jmp loop\n" });
+        list.push_back({ "io.out",
+            "start:\n  lea r1, 'a'\n  lea r2, 10\n"
+            "loop:\n  out r1, 0\n  out r1, 0\n  out r1, 0\n  out r1, 0\n"
+            "  out r1, 0\n  out r1, 0\n  out r1, 0\n  out r2, 0\n  jmp loop\n" });
+        list.push_back({ "block.copy",
+            "start:\n  lea r4, 64\n  lea r1, 0xc0\n"
+            "loop:\n  mcpy [0x80], [r1]\n  mcpy [r1], [0x80]\n  jmp loop\n" });
+        list.push_back({ "block.fill",
+            "start:\n  lea r4, 64\n  lea r1, 0xc0\n"
+            "loop:\n  mcpy [0x80], 0\n  mcpy [r1], r4\n  jmp loop\n" });
+        list.push_back({ "block.compare",
+            "start:\n  lea r4, 64\n  mcpy [0x80], [0xc0]\n"
+            "loop:\n  mcmp [0x80], [0xc0]\n  jne loop\n  mcmp [0xc0], 0\n  jmp loop\n" });
+        return list;
+    }
+
+    BenchmarkSuite(Engine engine, uint64_t cycles, unsigned repeats)
+        : engine(engine), cycles(cycles), repeats(repeats ? repeats : 1) {}
+
+    // Run every case whose name starts with filter; the first run of each is
+    // a warm-up (decoding, JIT compilation) and is not timed. Every case, and
+    // test.asm, is first checked against core_step().
+    void run(const std::string& filter, std::ostream& log) {
+        static std::istream no_input(nullptr);
+        static std::ostream no_output(nullptr);
+        const ProgramImage test_asm = Assembler().assemble(TEST_ASM);
+        if (!std::equal(TEST_ASM_BYTES.begin(), TEST_ASM_BYTES.end(), test_asm.memory.begin())) {
+            throw std::runtime_error("test.asm no longer assembles to TEST_ASM_BYTES");
+        }
+        check("test.asm", test_asm);
+        for (const Case& c : cases()) {
+            if (c.name.compare(0, filter.size(), filter) != 0) continue;
+            Assembler assembler;
+            ProgramImage program = assembler.assemble(c.source);
+            check(c.name, program);
+
+            VirtualMachine vm;
+            vm.set_engine(engine);
+            vm.set_io(no_input, no_output, nullptr);
+            vm.register_port(0, discard, nullptr, VirtualMachine::Buffering::Line);
+
+            std::vector<double> ns;
+            for (unsigned i = 0; i <= repeats; ++i) {
+                vm.reset(program);
+                auto start = std::chrono::steady_clock::now();
+                vm.run_for(cycles);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (i > 0) ns.push_back(seconds * 1e9 / vm.instruction_count());
+            }
+
+            Result r;
+            r.name = c.name;
+            r.instructions = vm.instruction_count();
+            r.mean_ns = 0.0;
+            r.min_ns = ns[0];
+            for (double v : ns) {
+                r.mean_ns += v;
+                r.min_ns = std::min(r.min_ns, v);
+            }
+            r.mean_ns /= ns.size();
+            double variance = 0.0;
+            for (double v : ns) {
+                variance += (v - r.mean_ns) * (v - r.mean_ns);
+            }
+            r.stddev_ns = ns.size() > 1 ? std::sqrt(variance / (ns.size() - 1)) : 0.0;
+            results.push_back(r);
+
+            log << std::left << std::setw(20) << r.name << std::right << std::fixed
+                << std::setprecision(1) << std::setw(10) << 1e3 / r.mean_ns << " MIPS "
+                << std::setprecision(3) << std::setw(8) << r.mean_ns << " ns/insn +- "
+                << std::setprecision(1) << 100.0 * r.stddev_ns / r.mean_ns << "%" << std::endl;
+        }
+    }
+
+    // One line per case: name, engine, instructions per run, runs, mean,
+    // standard deviation and minimum ns per instruction, instructions/s
+    void write(std::ostream& out) const {
+        const char* engine_name = engine == Engine::Jit ? "jit" : "interpreter";
+        for (const Result& r : results) {
+            out << r.name << '\t' << engine_name << '\t' << r.instructions << '\t' << repeats << '\t'
+                << std::fixed << std::setprecision(4) << r.mean_ns << '\t' << r.stddev_ns << '\t' << r.min_ns << '\t'
+                << std::setprecision(0) << 1e9 / r.mean_ns << '\n';
+        }
+    }
+
+private:
+    Engine engine;
+    uint64_t cycles;
+    unsigned repeats;
+    std::vector<Result> results;
+
+    static void discard(void*, const uint8_t*, size_t) {}
+
+    // Run program on core_step() and on each engine for the same cycles and
+    // throw unless they all end in the same state
+    static void check(const std::string& name, const ProgramImage& program) {
+        static const uint64_t CHECK_CYCLES = 100000;
+        CoreState reference;
+        reference.memory = program.memory;
+        reference.pc = program.entry;
+        reference.sp = program.stack_pointer;
+        while (reference.running && reference.cycles < CHECK_CYCLES) core_step(reference);
+
+        check_engine(name, program, Engine::Interpreter, "the interpreter", reference);
+#if NIGG8_JIT
+        check_engine(name, program, Engine::Jit, "the JIT", reference);
+#endif
+    }
+
+    static void check_engine(const std::string& name, const ProgramImage& program, Engine engine,
+                             const char* engine_name, const CoreState& reference) {
+        static std::istream no_input(nullptr);
+        static std::ostream no_output(nullptr);
+        VirtualMachine vm;
+        vm.set_engine(engine);
+        vm.set_io(no_input, no_output, nullptr);
+        vm.register_port(0, discard, nullptr, VirtualMachine::Buffering::Line);
+        vm.reset(program);
+        vm.run_for(reference.cycles);
+        const CoreState s = vm.core_state();
+        if (s.memory != reference.memory || s.registers != reference.registers || s.pc != reference.pc ||
+            s.sp != reference.sp || s.flag_equal != reference.flag_equal || s.flag_less != reference.flag_less ||
+            s.flag_more != reference.flag_more || s.running != reference.running || s.fault != reference.fault ||
+            s.instructions != reference.instructions || s.cycles != reference.cycles) {
+            throw std::runtime_error(name + ": " + engine_name + " and core_step() disagree after " +
+                                     std::to_string(reference.instructions) + " instructions");
+        }
+    }
+};
+
+// Times the Raster primitives on each available span kernel against naive
+// per-pixel loops, at surface sizes from the default window to 4K. Every
+// kernel's output is checked against the naive one first.
+class RasterBenchmark {
+public:
+    struct Result {
+        std::string primitive, size, kernel;
+        uint64_t calls; // Per run
+        double ns; // Mean per call
+        double speedup; // Naive time over this time
+    };
+
+    explicit RasterBenchmark(unsigned repeats) : repeats(repeats ? repeats : 1) {}
+
+    void run(std::ostream& log) {
+        static const int SIZES[][2] = { { 800, 600 }, { 1920, 1080 }, { 3840, 2160 } };
+        static const char* const PRIMITIVES[] = { "clear", "rect", "circle", "line" };
+        for (const auto& size : SIZES) {
+            const int width = size[0], height = size[1];
+            std::vector<uint32_t> expected(static_cast<size_t>(width) * height), actual(expected.size());
+            const std::string size_name = std::to_string(width) + "x" + std::to_string(height);
+            for (const char* primitive : PRIMITIVES) {
+                const std::vector<Shape> shapes = workload(primitive, width, height);
+                std::fill(expected.begin(), expected.end(), 0);
+                draw_naive(primitive, shapes, expected.data(), width, height);
+                const double naive_ns = time([&] { draw_naive(primitive, shapes, expected.data(), width, height); }) / shapes.size();
+                record(log, { primitive, size_name, "naive", shapes.size(), naive_ns, 1.0 });
+
+                for (const Raster::Kernel& kernel : Raster::kernels()) {
+                    Raster raster(actual.data(), width, height, kernel.fill);
+                    std::fill(actual.begin(), actual.end(), 0);
+                    draw(primitive, shapes, raster);
+                    if (actual != expected) {
+                        throw std::runtime_error(std::string("Kernel ") + kernel.name + " draws " + primitive + " wrongly at " + size_name);
+                    }
+                    const double ns = time([&] { draw(primitive, shapes, raster); }) / shapes.size();
+                    record(log, { primitive, size_name, kernel.name, shapes.size(), ns, naive_ns / ns });
+                }
+            }
+        }
+    }
+
+    // One line per primitive, size and kernel: calls per run, runs, mean ns
+    // per call, speedup over the naive loops
+    void write(std::ostream& out) const {
+        for (const Result& r : results) {
+            out << r.primitive << '\t' << r.size << '\t' << r.kernel << '\t' << r.calls << '\t' << repeats << '\t'
+                << std::fixed << std::setprecision(1) << r.ns << '\t' << std::setprecision(2) << r.speedup << '\n';
+        }
+    }
+
+private:
+    struct Shape {
+        int a, b, c, d;
+        uint32_t color;
+    };
+
+    unsigned repeats;
+    std::vector<Result> results;
+
+    // Shapes spread over (and partly off) the surface, the same every run
+    static std::vector<Shape> workload(const std::string& primitive, int width, int height) {
+        uint32_t state = 12345;
+        auto next = [&](int range) {
+            state = state * 1103515245u + 12345u;
+            return static_cast<int>((state >> 8) % static_cast<uint32_t>(range));
+        };
+        std::vector<Shape> shapes;
+        if (primitive == "clear") {
+            for (int i = 0; i < 4; ++i) shapes.push_back({ 0, 0, 0, 0, 0xff000000u | (0x10101u * i) });
+        } else if (primitive == "rect") {
+            for (int i = 0; i < 64; ++i) {
+                shapes.push_back({ next(width) - width / 8, next(height) - height / 8, width / 2, height / 2, 0xff000000u | next(0xffffff) });
+            }
+        } else if (primitive == "circle") {
+            for (int i = 0; i < 64; ++i) {
+                shapes.push_back({ next(width), next(height), height / 4, 0, 0xff000000u | next(0xffffff) });
+            }
+        } else {
+            for (int i = 0; i < 1024; ++i) {
+                int x1 = next(width + 64) - 32, y1 = next(height + 64) - 32;
+                int y2 = i % 4 == 0 ? y1 : next(height + 64) - 32; // A quarter are horizontal
+                shapes.push_back({ x1, y1, next(width + 64) - 32, y2, 0xff000000u | next(0xffffff) });
+            }
+        }
+        return shapes;
+    }
+
+    static void draw(const std::string& primitive, const std::vector<Shape>& shapes, const Raster& raster) {
+        for (const Shape& s : shapes) {
+            if (primitive == "clear") raster.clear(s.color);
+            else if (primitive == "rect") raster.rect(s.a, s.b, s.a + s.c, s.b + s.d, s.color);
+            else if (primitive == "circle") raster.circle(s.a, s.b, s.c, s.color);
+            else raster.line(s.a, s.b, s.c, s.d, s.color);
+        }
+    }
+
+    // One bounds-checked store per covered pixel
+    static void draw_naive(const std::string& primitive, const std::vector<Shape>& shapes, uint32_t* pixels, int width, int height) {
+        auto plot = [&](int x, int y, uint32_t p) {
+            if (x >= 0 && y >= 0 && x < width && y < height) pixels[static_cast<size_t>(y) * width + x] = p;
+        };
+        for (const Shape& s : shapes) {
+            if (primitive == "clear" || primitive == "rect") {
+                const int left = primitive == "clear" ? 0 : s.a, top = primitive == "clear" ? 0 : s.b;
+                const int w = primitive == "clear" ? width : s.c, h = primitive == "clear" ? height : s.d;
+                for (int y = top; y < top + h; ++y) {
+                    for (int x = left; x < left + w; ++x) plot(x, y, s.color);
+                }
+            } else if (primitive == "circle") {
+                const int64_t r2 = 4 * static_cast<int64_t>(s.c) * s.c;
+                for (int py = s.b - s.c; py < s.b + s.c; ++py) {
+                    int64_t dy = 2 * (py - s.b) + 1;
+                    for (int px = s.a - s.c; px < s.a + s.c; ++px) {
+                        int64_t dx = 2 * (px - s.a) + 1;
+                        if (dx * dx + dy * dy <= r2) plot(px, py, s.color);
+                    }
+                }
+            } else {
+                int dx = std::abs(s.c - s.a), sx = s.a < s.c ? 1 : -1;
+                int dy = -std::abs(s.d - s.b), sy = s.b < s.d ? 1 : -1;
+                int err = dx + dy;
+                int x = s.a, y = s.b;
+                while (x != s.c || y != s.d) {
+                    plot(x, y, s.color);
+                    int e2 = 2 * err;
+                    if (e2 >= dy) { err += dy; x += sx; }
+                    if (e2 <= dx) { err += dx; y += sy; }
+                }
+            }
+        }
+    }
+
+    // Mean ns for one call of body, over the timed runs after a warm-up
+    template <typename Body>
+    double time(Body body) const {
+        body();
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < repeats; ++i) body();
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / repeats;
+    }
+
+    void record(std::ostream& log, const Result& r) {
+        results.push_back(r);
+        log << std::left << std::setw(8) << r.primitive << std::setw(11) << r.size << std::setw(8) << r.kernel
+            << std::right << std::fixed << std::setprecision(1) << std::setw(12) << r.ns << " ns/call "
+            << std::setprecision(2) << std::setw(7) << r.speedup << "x" << std::endl;
+    }
+};
+
+// Runs an embarrassingly parallel guest on 1 to 16 cores: register-only
+// loops, each core storing its result to its own shared byte every 256
+// iterations. Reports the combined instructions/s and the speedup over one
+// core; the host's thread count caps what is achievable.
+class CoreScalingBenchmark {
+public:
+    struct Result {
+        size_t cores;
+        uint64_t instructions; // Per run, all cores together
+        double seconds; // Mean per run
+        double ips;
+        double speedup; // Over one core
+    };
+
+    CoreScalingBenchmark(uint64_t cycles, unsigned repeats) : cycles(cycles), repeats(repeats ? repeats : 1) {}
+
+    // Every run executes cycles on each core; the first is a warm-up
+    void run(std::ostream& log) {
+        static const size_t COUNTS[] = { 1, 2, 4, 8, 16 };
+        static std::istream no_input(nullptr);
+        static std::ostream no_output(nullptr);
+        Assembler assembler;
+        const ProgramImage program = assembler.assemble(
+            "start:\n  in r1, 10\n  lea r2, 0x80\n  add r2, r1\n  lea e1, 1\n"
+            "outer:\n  lea r4, 0\n"
+            "inner:\n  add r3, r1\n  xor r3, r4\n  add r4, e1\n  cmp r4, 0\n  jne inner\n"
+            "  push r3\n  pop [r2]\n  jmp outer\n");
+        log << "Host threads: " << std::thread::hardware_concurrency() << std::endl;
+
+        for (size_t count : COUNTS) {
+            Result r = { count, 0, 0.0, 0.0, 1.0 };
+            for (unsigned i = 0; i <= repeats; ++i) {
+                MultiCore machine(program, count);
+                for (size_t c = 0; c < count; ++c) {
+                    machine.core(c).set_io(no_input, no_output, nullptr);
+                }
+                auto start = std::chrono::steady_clock::now();
+                machine.run(cycles);
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                for (size_t c = 0; c < count; ++c) {
+                    if (!machine.error(c).empty()) throw std::runtime_error("Core " + std::to_string(c) + ": " + machine.error(c));
+                }
+                if (i > 0) r.seconds += seconds;
+                r.instructions = machine.instruction_count();
+            }
+            r.seconds /= repeats;
+            r.ips = r.instructions / r.seconds;
+            if (!results.empty()) r.speedup = r.ips / results[0].ips;
+            results.push_back(r);
+
+            log << std::setw(2) << count << " cores " << std::fixed << std::setprecision(1) << std::setw(10)
+                << r.ips / 1e6 << " MIPS " << std::setprecision(2) << std::setw(6) << r.speedup << "x "
+                << std::setprecision(0) << std::setw(4) << 100.0 * r.speedup / count << "% efficiency" << std::endl;
+        }
+    }
+
+    // One line per core count: instructions per run, runs, mean ms per run,
+    // instructions/s, speedup over one core and parallel efficiency
+    void write(std::ostream& out) const {
+        for (const Result& r : results) {
+            out << r.cores << '\t' << r.instructions << '\t' << repeats << '\t' << std::fixed << std::setprecision(3)
+                << r.seconds * 1e3 << '\t' << std::setprecision(0) << r.ips << '\t' << std::setprecision(2)
+                << r.speedup << '\t' << r.speedup / r.cores << '\n';
+        }
+    }
+
+private:
+    uint64_t cycles;
+    unsigned repeats;
+    std::vector<Result> results;
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Error: No input binary" << std::endl;
+        std::cerr << "Usage: nigg8 <binary | source.asm> [--turbo] [--hz <frequency>] [--batch <cycles>] [--jit | --interpreter]" << std::endl;
+        std::cerr << "       [--out-buffer <bytes>] [-v] [--headless] [--frames <prefix>] [--screenshot <file.ppm>]" << std::endl;
+        std::cerr << "       [--banks <n> | --cores <n>] [--profile <file.json>] [--folded <file>] [--record <log> | --replay <log>]" << std::endl;
+        std::cerr << "       nigg8 <binary> --travel [--replay <log>] [--checkpoints <instructions>]" << std::endl;
+        std::cerr << "       nigg8 <binary> --debug <port | socket path> [--jit]" << std::endl;
+        std::cerr << "       nigg8 <source.asm> [--bake <label>] --assemble <image>" << std::endl;
+        std::cerr << "       nigg8 <binary> (--inputs <file> | --runs <n>) [--threads <n>] [--max-cycles <n>] [--jit]" << std::endl;
+        std::cerr << "       nigg8 <binary> --fuzz <executions> [--inputs <seeds>] [--max-cycles <n>] [--seed <n>]" << std::endl;
+        std::cerr << "       nigg8 --bench [--filter <prefix>] [--runs <n>] [--max-cycles <n>] [--jit]" << std::endl;
+        std::cerr << "       nigg8 --bench --raster [--runs <n>]" << std::endl;
+        std::cerr << "       nigg8 --bench --cores [--runs <n>] [--max-cycles <n>]" << std::endl;
+        std::cerr << "       nigg8 --serve <port | socket path> [--threads <n>] [--max-instructions <n>] [--jit]" << std::endl;
+        std::cerr << "       nigg8 <binary> --load <port | socket path> [--runs <n>] [--threads <n>] [--inputs <file>] [--max-instructions <n>]" << std::endl;
+        return 1;
+    }
+
+    VirtualMachine vm;
+    ClockConfig clock;
+    Engine engine = Engine::Interpreter;
+    std::string inputs_path;
+    uint64_t runs = 0;
+    unsigned threads = std::thread::hardware_concurrency();
+    uint64_t max_cycles = UINT64_MAX;
+    uint64_t max_instructions = UINT64_MAX;
+    uint64_t fuzz_executions = 0;
+    uint64_t seed = 0;
+    bool headless = false;
+    int verbosity = 0;
+    std::string assemble_path;
+    std::string bake_label;
+    size_t out_buffer = 0;
+    std::string frames_prefix, screenshot_path;
+    std::string profile_path, folded_path;
+    const bool bench = std::strcmp(argv[1], "--bench") == 0; // No binary; the options follow
+    const bool serving = std::strcmp(argv[1], "--serve") == 0 && argc > 2; // No binary; the endpoint follows
+    std::string bench_filter;
+    bool bench_raster = false;
+    bool bench_cores = false;
+    size_t banks = 1;
+    size_t cores = 1;
+    std::string record_path, replay_path;
+    bool travel = false;
+    uint64_t checkpoint_interval = 16384;
+    std::string debug_endpoint;
+    std::string load_endpoint;
+
+    try {
+        for (int i = serving ? 3 : 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--turbo") {
+                clock.mode = ClockMode::Turbo;
+            } else if (arg == "--hz" && i + 1 < argc) {
+                clock.mode = ClockMode::Throttled;
+                clock.frequency_hz = std::stod(argv[++i]);
+            } else if (arg == "--batch" && i + 1 < argc) {
+                clock.batch_size = std::stoull(argv[++i]);
+            } else if (arg == "--jit") {
+                engine = Engine::Jit;
+            } else if (arg == "--interpreter") {
+                engine = Engine::Interpreter;
+            } else if (arg == "--inputs" && i + 1 < argc) {
+                inputs_path = argv[++i];
+            } else if (arg == "--runs" && i + 1 < argc) {
+                runs = std::stoull(argv[++i]);
+            } else if (arg == "--threads" && i + 1 < argc) {
+                threads = static_cast<unsigned>(std::stoul(argv[++i]));
+            } else if (arg == "--max-cycles" && i + 1 < argc) {
+                max_cycles = std::stoull(argv[++i]);
+            } else if (arg == "--max-instructions" && i + 1 < argc) {
+                max_instructions = std::stoull(argv[++i]);
+            } else if (arg == "--fuzz" && i + 1 < argc) {
+                fuzz_executions = std::stoull(argv[++i]);
+            } else if (arg == "--filter" && i + 1 < argc) {
+                bench_filter = argv[++i];
+            } else if (arg == "--raster") {
+                bench_raster = true;
+            } else if (arg == "--cores" && bench) {
+                bench_cores = true;
+            } else if (arg == "--cores" && i + 1 < argc) {
+                cores = std::stoull(argv[++i]);
+            } else if (arg == "--seed" && i + 1 < argc) {
+                seed = std::stoull(argv[++i]);
+            } else if (arg == "--out-buffer" && i + 1 < argc) {
+                out_buffer = std::stoull(argv[++i]);
+            } else if (arg == "--assemble" && i + 1 < argc) {
+                assemble_path = argv[++i];
+            } else if (arg == "--bake" && i + 1 < argc) {
+                bake_label = argv[++i];
+            } else if (arg == "--verbose" || arg == "-v") {
+                ++verbosity;
+            } else if (arg == "--headless") {
+                headless = true;
+            } else if (arg == "--frames" && i + 1 < argc) {
+                headless = true;
+                frames_prefix = argv[++i];
+            } else if (arg == "--screenshot" && i + 1 < argc) {
+                headless = true;
+                screenshot_path = argv[++i];
+            } else if (arg == "--banks" && i + 1 < argc) {
+                banks = std::stoull(argv[++i]);
+            } else if (arg == "--record" && i + 1 < argc) {
+                record_path = argv[++i];
+            } else if (arg == "--replay" && i + 1 < argc) {
+                replay_path = argv[++i];
+            } else if (arg == "--travel") {
+                travel = true;
+            } else if (arg == "--checkpoints" && i + 1 < argc) {
+                checkpoint_interval = std::stoull(argv[++i]);
+            } else if (arg == "--load" && i + 1 < argc) {
+                load_endpoint = argv[++i];
+            } else if (arg == "--debug" && i + 1 < argc) {
+                debug_endpoint = argv[++i];
+            } else if (arg == "--profile" && i + 1 < argc) {
+                profile_path = argv[++i];
+            } else if (arg == "--folded" && i + 1 < argc) {
+                folded_path = argv[++i];
+            } else {
+                throw std::runtime_error("Unknown option: " + arg);
+            }
+        }
+#if !NIGG8_PROFILE
+        if (!profile_path.empty() || !folded_path.empty()) {
+            throw std::runtime_error("Profiling is not compiled in (build with -DNIGG8_PROFILE=1)");
+        }
+#endif
+        // Snapshots hold bank 0 only, so neither time travel nor the fuzzer's
+        // reset between executions would put the other banks back
+        if (banks > 1 && (travel || fuzz_executions > 0)) {
+            throw std::runtime_error("--banks cannot be combined with --travel or --fuzz");
+        }
+        if (cores > 1 && banks > 1) {
+            throw std::runtime_error("Memory banks are not available on multi-core guests");
+        }
+        if (cores > 1 && (!inputs_path.empty() || runs > 0 || fuzz_executions > 0 || travel)) {
+            throw std::runtime_error("--cores cannot be combined with batch runs, fuzzing or --travel");
+        }
+        if (!debug_endpoint.empty() && (cores > 1 || !inputs_path.empty() || runs > 0 || fuzz_executions > 0 || travel)) {
+            throw std::runtime_error("--debug cannot be combined with --cores, batch runs, fuzzing or --travel");
+        }
+        if (!load_endpoint.empty() && (cores > 1 || fuzz_executions > 0 || travel || !debug_endpoint.empty())) {
+            throw std::runtime_error("--load cannot be combined with --cores, fuzzing, --travel or --debug");
+        }
+        if (max_instructions != UINT64_MAX && !serving && load_endpoint.empty()) {
+            throw std::runtime_error("--max-instructions only applies to --serve and --load");
+        }
+        if ((serving || !load_endpoint.empty()) && max_cycles != UINT64_MAX) {
+            throw std::runtime_error("--serve and --load take an instruction budget: use --max-instructions");
+        }
+        // The server's pooled VMs run with bank 0 only
+        if ((serving || !load_endpoint.empty()) && banks > 1) {
+            throw std::runtime_error("--banks cannot be combined with --serve or --load");
+        }
+#ifdef _WIN32
+        if (!debug_endpoint.empty()) {
+            throw std::runtime_error("The debug server is not supported on this host");
+        }
+        if (serving || !load_endpoint.empty()) {
+            throw std::runtime_error("The execution server is not supported on this host");
+        }
+#endif
+        vm.set_banks(banks);
+        vm.set_clock(clock);
+        vm.set_engine(engine);
+        vm.set_verbosity(verbosity);
+        if (out_buffer) vm.set_output_buffer(out_buffer);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+#ifndef _WIN32
+    // Execution server: run jobs from local clients until stopped
+    if (serving) {
+        try {
+            ExecutionServer server(argv[2], engine, max_instructions == UINT64_MAX ? 10000000 : max_instructions, threads);
+            server.serve(std::cerr);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
+    // Benchmarks: instructions/s of each synthetic program, results as TSV
+    if (bench && bench_cores) {
+        try {
+            CoreScalingBenchmark suite(max_cycles == UINT64_MAX ? 5000000 : max_cycles,
+                                       runs ? static_cast<unsigned>(runs) : 5);
+            suite.run(std::cerr);
+            suite.write(std::cout);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (bench && bench_raster) {
+        try {
+            RasterBenchmark suite(runs ? static_cast<unsigned>(runs) : 5);
+            suite.run(std::cerr);
+            suite.write(std::cout);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (bench) {
+        try {
+            BenchmarkSuite suite(engine, max_cycles == UINT64_MAX ? 5000000 : max_cycles,
+                                 runs ? static_cast<unsigned>(runs) : 5);
+            suite.run(bench_filter, std::cerr);
+            suite.write(std::cout);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Load program:
+    ProgramImage program;
+#if NIGG8_PROFILE
+    Profiler profiler;
+#endif
+    try {
+        std::string path = argv[1];
+        if (path.size() > 4 && path.compare(path.size() - 4, 4, ".asm") == 0) {
+            MappedFile file(path);
+            Assembler assembler;
+            program = assembler.assemble(std::string(reinterpret_cast<const char*>(file.data()), file.size()));
+#if NIGG8_PROFILE
+            // Name functions after the first label (alphabetically) at their address
+            for (const auto& symbol : assembler.symbols()) {
+                if (symbol.second > 0xff) continue;
+                std::string& name = profiler.names[symbol.second];
+                if (name.empty() || symbol.first < name) name = symbol.first;
+            }
+#endif
+            if (!bake_label.empty()) {
+                auto symbol = assembler.symbols().find(bake_label);
+                if (symbol == assembler.symbols().end() || symbol->second > 0xff) {
+                    throw std::runtime_error("Unknown label: " + bake_label);
+                }
+                program = bake_program(program, static_cast<uint8_t>(symbol->second),
+                                       max_cycles == UINT64_MAX ? 1u << 24 : max_cycles);
+            }
+            if (!assemble_path.empty()) {
+                std::vector<uint8_t> image = bake_label.empty() ? assembler.image_file()
+                    : encode_image({ { 0, SectionKind::Bytes, 256, std::vector<uint8_t>(program.memory.begin(), program.memory.end()) } },
+                                   program.entry, program.stack_pointer);
+                std::ofstream out(assemble_path, std::ios::binary);
+                if (!out.write(reinterpret_cast<const char*>(image.data()), image.size())) {
+                    throw std::runtime_error("Failed to write file: " + assemble_path);
+                }
+                return 0;
+            }
+        } else {
+            if (!assemble_path.empty() || !bake_label.empty()) {
+                throw std::runtime_error("--assemble and --bake need a .asm source");
+            }
+            program = get_program(path);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Batch mode: one run per input line (or --runs runs with no input).
+    // Fuzzing takes the same lines as seeds, and --load sends them to a server.
+    if (!inputs_path.empty() || runs > 0 || fuzz_executions > 0 || !load_endpoint.empty()) {
+        try {
+            std::string text;
+            std::vector<std::pair<size_t, size_t>> inputs;
+            if (!inputs_path.empty()) {
+                std::ifstream file(inputs_path, std::ios::binary);
+                if (!file.is_open()) {
+                    throw std::runtime_error("Failed to open file: " + inputs_path);
+                }
+                text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+                size_t begin = 0;
+                while (begin < text.size()) {
+                    size_t end = text.find('\n', begin);
+                    if (end == std::string::npos) end = text.size();
+                    inputs.emplace_back(begin, end - begin);
+                    begin = end + 1;
+                }
+            }
+
+            if (fuzz_executions > 0) {
+                Fuzzer fuzzer(program, max_cycles == UINT64_MAX ? 10000 : max_cycles, seed);
+                for (const auto& input : inputs) {
+                    fuzzer.add_seed(reinterpret_cast<const uint8_t*>(text.data()) + input.first, input.second);
+                }
+                fuzzer.fuzz(fuzz_executions, std::cerr);
+                fuzzer.write(std::cout);
+                return fuzzer.crashes().empty() ? 0 : 2;
+            }
+
+#ifndef _WIN32
+            if (!load_endpoint.empty()) {
+                LoadGenerator load(load_endpoint, program, max_instructions == UINT64_MAX ? 0 : max_instructions);
+                load.run(runs ? runs : (inputs.empty() ? 1000 : inputs.size()), threads, text, inputs);
+                load.write(std::cout);
+                return load.ok() ? 0 : 1;
+            }
+#endif
+
+            if (inputs_path.empty()) {
+                inputs.assign(runs, std::make_pair(size_t(0), size_t(0)));
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            BatchRunner batch(program, engine, max_cycles, threads, banks);
+            batch.run(text, inputs);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            batch.write(std::cout);
+
+            uint64_t total = 0;
+            for (const BatchRunner::Result& r : batch.result_list()) {
+                total += r.instructions;
+            }
+            std::cerr << std::dec << "Executed " << inputs.size() << " runs, " << total << " instructions in "
+                      << std::fixed << std::setprecision(3) << seconds << " s" << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Recorded input: --replay feeds in from a log, --record writes one
+    std::vector<uint8_t> replay_inputs;
+    std::ofstream record_log;
+    try {
+        if (!record_path.empty() && !replay_path.empty()) {
+            throw std::runtime_error("--record and --replay cannot be combined");
+        }
+        if (!replay_path.empty()) {
+            replay_inputs = read_input_log(replay_path, program);
+        }
+        if (!record_path.empty()) {
+            record_log.open(record_path, std::ios::binary);
+            if (!record_log.is_open()) {
+                throw std::runtime_error("Failed to open file: " + record_path);
+            }
+            write_input_log_header(record_log, program);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Time travel: step through the (replayed) run with commands read from stdin
+    if (travel) {
+        Timeline timeline(program, std::move(replay_inputs), checkpoint_interval);
+        std::string line;
+        auto show = [&] {
+            std::cout << "#" << timeline.instruction() << ' ';
+            timeline.machine().dump_state(std::cout);
+            if (timeline.finished()) {
+                std::cout << (timeline.fault().empty() ? "halted" : timeline.fault()) << std::endl;
+            }
+        };
+        show();
+        while (std::getline(std::cin, line)) {
+            std::istringstream command(line);
+            std::string name;
+            uint64_t count = 1;
+            if (!(command >> name)) continue;
+            command >> count;
+            if (name == "q" || name == "quit") {
+                break;
+            } else if (name == "s" || name == "step") {
+                timeline.seek(timeline.instruction() + count);
+            } else if (name == "b" || name == "back") {
+                timeline.seek(count < timeline.instruction() ? timeline.instruction() - count : 0);
+            } else if (name == "g" || name == "goto") {
+                timeline.seek(count);
+            } else if (name == "e" || name == "end") {
+                timeline.seek(UINT64_MAX);
+            } else if (name != "p" && name != "state") {
+                std::cout << "commands: step [n], back [n], goto <n>, end, state, quit" << std::endl;
+                continue;
+            }
+            show();
+        }
+        return 0;
+    }
+
+    // With --cores every core runs the program, sharing memory operands (see
+    // MultiCore); core 0 takes the input, the display and the profiler, the
+    // others read 0 from in
+    std::unique_ptr<MultiCore> machine;
+    if (cores > 1) {
+        static const uint8_t no_input = 0;
+        try {
+            machine.reset(new MultiCore(program, cores));
+            for (size_t i = 0; i < cores; ++i) {
+                VirtualMachine& core = machine->core(i);
+                core.set_clock(clock);
+                core.set_engine(engine);
+                if (out_buffer) core.set_output_buffer(out_buffer);
+                if (i > 0) {
+                    core.set_io(std::cin, std::cout, nullptr);
+                    core.set_input_bytes(&no_input, 0);
+                }
+            }
+            machine->core(0).set_verbosity(verbosity);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    VirtualMachine& main_core = machine ? machine->core(0) : vm;
+
+    // Standard input is read ahead on its own thread, so in only waits when
+    // nothing has been typed yet and port 1 can report what is pending
+    InputQueue input_queue;
+    if (!replay_path.empty()) {
+        main_core.replay_input(replay_inputs.data(), replay_inputs.size());
+    } else {
+        try {
+            input_queue.feed_stdin();
+            main_core.set_input_queue(&input_queue);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (record_log.is_open()) {
+        main_core.record_input(&record_log);
+    }
+
+    // Headless drawing is rasterized on a render thread, off the VM's path
+    FramebufferIO framebuffer;
+    std::unique_ptr<RenderThread> renderer;
+    if (headless) {
+        framebuffer.dump_frames(frames_prefix);
+        renderer.reset(new RenderThread(framebuffer));
+        main_core.set_io(std::cin, std::cout, renderer.get());
+    }
+
+    int status = 0;
+    try {
+        main_core.load_program(program);
+#if NIGG8_PROFILE
+        if (!profile_path.empty() || !folded_path.empty()) main_core.set_profiler(&profiler);
+#endif
+        if (machine) {
+            machine->run();
+            for (size_t i = 0; i < cores; ++i) {
+                if (machine->error(i).empty()) continue;
+                std::cerr << "Error: Core " << i << ": " << machine->error(i) << std::endl;
+                status = 1;
+            }
+        } else if (!debug_endpoint.empty()) {
+#ifndef _WIN32
+            // Under the debugger until it detaches, then on as usual
+            DebugServer server(vm, debug_endpoint);
+            if (server.serve(std::cerr)) vm.run();
+#endif
+        } else {
+            vm.run();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        status = 1;
+    }
+
+#if NIGG8_PROFILE
+    if (!profile_path.empty() || !folded_path.empty()) {
+        main_core.finish_profile();
+        if (!profile_path.empty()) {
+            std::ofstream out(profile_path);
+            profiler.write_json(out);
+            if (!out) {
+                std::cerr << "Error: Failed to write file: " << profile_path << std::endl;
+                status = 1;
+            }
+        }
+        if (!folded_path.empty()) {
+            std::ofstream out(folded_path);
+            profiler.write_folded(out);
+            if (!out) {
+                std::cerr << "Error: Failed to write file: " << folded_path << std::endl;
+                status = 1;
+            }
+        }
+    }
+#endif
+
+    if (renderer) {
+        try {
+            renderer->stop();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            status = 1;
+        }
+    }
+
+    if (!screenshot_path.empty()) {
+        try {
+            framebuffer.present();
+            framebuffer.write_ppm(screenshot_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            status = 1;
+        }
+    }
+
+    input_queue.stop();
+
+    main_core.record_input(nullptr);
+    if (record_log.is_open() && !record_log.flush()) {
+        std::cerr << "Error: Failed to write file: " << record_path << std::endl;
+        status = 1;
     }
 
-    return 0;
+    if (machine) machine->report(std::cerr);
+    else vm.report(std::cerr);
+    if (renderer) renderer->report(std::cerr);
+    return status;
 }